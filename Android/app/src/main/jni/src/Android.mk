@@ -50,6 +50,14 @@ $(THE_APP_ROOT)/handle_db.c \
 $(THE_APP_ROOT)/shader_utils.c \
 $(THE_APP_ROOT)/utils.c \
 $(THE_APP_ROOT)/getData.c \
+$(THE_APP_ROOT)/fetch_pool.c \
+$(THE_APP_ROOT)/geom_cache.c \
+$(THE_APP_ROOT)/raster_cache.c \
+$(THE_APP_ROOT)/raster_decode.c \
+$(THE_APP_ROOT)/stats.c \
+$(THE_APP_ROOT)/trace.c \
+$(THE_APP_ROOT)/prefetch.c \
+$(THE_APP_ROOT)/connections.c \
 $(THE_APP_ROOT)/eventHandling.c \
 $(THE_APP_ROOT)/twkb.c \
 $(THE_APP_ROOT)/varint.c \
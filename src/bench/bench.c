@@ -0,0 +1,464 @@
+/**********************************************************************
+ *
+ * TileLessMap
+ *
+ * TileLessMap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * TileLessMap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TileLessMap.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **********************************************************************
+ *
+ * Copyright (C) 2016-2018 Nicklas Avén
+ *
+ ***********************************************************************/
+
+
+/**********************************************************************
+ * Benchmark
+ *
+ * Opens a project, and replays a sequence of map extents through
+ * get_data and render_data the same way mainLoop does, without any
+ * user in the loop. Frame times, the time per pipeline stage and the
+ * peak memory use are printed when finished.
+ *
+ * To run without a gpu, on a ci box, use the offscreen video driver of
+ * SDL or an X server like Xvfb, with mesa's llvmpipe:
+ *   LIBGL_ALWAYS_SOFTWARE=1 SDL_VIDEODRIVER=offscreen ./tileLessBench -f project.sqlite
+ * If there is no display and no driver is chosen, offscreen is used.
+ *
+ * A trace is a text file with one frame per line:
+ *   g minx miny maxx maxy   fetch and render the extent, like after a pan or zoom
+ *   r minx miny maxx maxy   only render, like when a gps position arrives
+ * Empty lines and lines starting with # are skipped.
+ * A trace recorded with TLM_record_trace, like tileLess --record, is
+ * replayed through mainLoop as fast as possible instead. The frames
+ * are measured as mainLoop finishes them, and the window gets the size
+ * it had when recorded.
+ * Without a trace a pan and zoom sequence around the projects start
+ * position is used.
+ ***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include "../theclient.h"
+#include "../utils.h"
+#include "../tilelessmap.h"
+#include "../trace.h"
+
+#define BENCH_FETCH 'g'
+#define BENCH_RENDER 'r'
+
+/*Stages we show a breakdown for, summed over all layers in a frame*/
+#define STAGE_FRAME 0
+#define STAGE_SQL 1
+#define STAGE_DECODE 2
+#define STAGE_REPROJECT 3
+#define STAGE_GPU 4
+#define N_STAGES 5
+
+static const char *stage_names[N_STAGES] = {"frame", "sql", "decode", "reproject", "gpu"};
+
+typedef struct
+{
+    char what;
+    GLfloat bbox[4];
+} BENCH_FRAME;
+
+typedef struct
+{
+    BENCH_FRAME *frames;
+    int used;
+    int alloced;
+} BENCH_TRACE;
+
+typedef struct
+{
+    double *ms[N_STAGES];
+    int used;
+    int alloced;
+    unsigned long long draw_calls;
+    unsigned long long upload_bytes;
+    int raster_frames;
+    int skip; // warmup frames left to skip when replaying a recorded trace
+} BENCH_RESULT;
+
+
+static void add_frame(BENCH_TRACE *trace, char what, GLfloat *bbox)
+{
+    if(trace->used == trace->alloced)
+    {
+        trace->alloced = trace->alloced ? trace->alloced * 2 : 256;
+        trace->frames = realloc(trace->frames, trace->alloced * sizeof(BENCH_FRAME));
+    }
+    trace->frames[trace->used].what = what;
+    memcpy(trace->frames[trace->used].bbox, bbox, 4 * sizeof(GLfloat));
+    trace->used++;
+}
+
+static int read_trace(const char *filename, BENCH_TRACE *trace)
+{
+    char line[256];
+    char what;
+    float b[4];
+    GLfloat bbox[4];
+    int i, lineno = 0;
+    FILE *f = fopen(filename, "r");
+    if(!f)
+    {
+        fprintf(stderr, "Cannot open trace %s\n", filename);
+        return 1;
+    }
+    while(fgets(line, sizeof(line), f))
+    {
+        lineno++;
+        if(line[0] == '#' || line[0] == '\n' || line[0] == '\r')
+            continue;
+        if(sscanf(line, " %c %f %f %f %f", &what, b, b+1, b+2, b+3) != 5 ||
+                (what != BENCH_FETCH && what != BENCH_RENDER))
+        {
+            fprintf(stderr, "Invalid line %d in trace %s\n", lineno, filename);
+            fclose(f);
+            return 1;
+        }
+        for (i=0; i<4; i++)
+            bbox[i] = b[i];
+        add_frame(trace, what, bbox);
+    }
+    fclose(f);
+    return 0;
+}
+
+/*Is the file recorded with TLM_record_trace, or a text trace*/
+static int is_recorded_trace(const char *filename)
+{
+    char magic[8];
+    int recorded = 0;
+    FILE *f = fopen(filename, "rb");
+    if(!f)
+        return 0;
+    if(fread(magic, 1, 8, f) == 8 && !memcmp(magic, TRACE_MAGIC, 8))
+        recorded = 1;
+    fclose(f);
+    return recorded;
+}
+
+/*Zoom in, pan in a square, zoom out and render a few times in between, from the start extent of the project*/
+static void default_trace(BENCH_TRACE *trace, MATRIX *start)
+{
+    GLfloat bbox[4];
+    GLfloat cx = (start->bbox[0] + start->bbox[2]) / 2;
+    GLfloat cy = (start->bbox[1] + start->bbox[3]) / 2;
+    GLfloat w = start->bbox[2] - start->bbox[0];
+    GLfloat h = start->bbox[3] - start->bbox[1];
+    GLfloat dx[4] = {1, 0, -1, 0};
+    GLfloat dy[4] = {0, 1, 0, -1};
+    int i, j;
+
+    for (i=0; i<20; i++)
+    {
+        w *= 0.8;
+        h *= 0.8;
+        bbox[0] = cx - w/2; bbox[1] = cy - h/2; bbox[2] = cx + w/2; bbox[3] = cy + h/2;
+        add_frame(trace, BENCH_FETCH, bbox);
+    }
+    for (i=0; i<4; i++)
+    {
+        for (j=0; j<10; j++)
+        {
+            cx += dx[i] * w * 0.1;
+            cy += dy[i] * h * 0.1;
+            bbox[0] = cx - w/2; bbox[1] = cy - h/2; bbox[2] = cx + w/2; bbox[3] = cy + h/2;
+            add_frame(trace, BENCH_FETCH, bbox);
+            add_frame(trace, BENCH_RENDER, bbox);
+        }
+    }
+    for (i=0; i<20; i++)
+    {
+        w *= 1.25;
+        h *= 1.25;
+        bbox[0] = cx - w/2; bbox[1] = cy - h/2; bbox[2] = cx + w/2; bbox[3] = cy + h/2;
+        add_frame(trace, BENCH_FETCH, bbox);
+    }
+}
+
+static void add_result(BENCH_RESULT *res, double frame_ms)
+{
+    TLM_FRAME_STATS fs;
+    TLM_LAYER_STATS ls;
+    int i;
+    if(res->used == res->alloced)
+    {
+        res->alloced = res->alloced ? res->alloced * 2 : 256;
+        for (i=0; i<N_STAGES; i++)
+            res->ms[i] = realloc(res->ms[i], res->alloced * sizeof(double));
+    }
+    for (i=0; i<N_STAGES; i++)
+        res->ms[i][res->used] = 0;
+
+    res->ms[STAGE_FRAME][res->used] = frame_ms;
+    for (i=0; TLM_get_layer_stats(i, &ls) == 0; i++)
+    {
+        res->ms[STAGE_SQL][res->used] += ls.sql_ms;
+        res->ms[STAGE_DECODE][res->used] += ls.decode_ms;
+        res->ms[STAGE_REPROJECT][res->used] += ls.reproject_ms;
+    }
+    TLM_get_frame_stats(&fs);
+    res->ms[STAGE_GPU][res->used] = fs.gpu_ms;
+    res->draw_calls += fs.draw_calls;
+    res->upload_bytes += fs.upload_bytes;
+    res->used++;
+}
+
+/*Finish everything on the gpu, so the gpu time is in the frame time*/
+static double run_frame(SDL_Window *window, MATRIX *map_matrix, CTRL *controls, char what)
+{
+    uint64_t t = SDL_GetPerformanceCounter();
+    if(what == BENCH_FETCH)
+        get_data(window, map_matrix, controls);
+    else
+        render_data(window, map_matrix, controls);
+    glFinish();
+    return (SDL_GetPerformanceCounter() - t) * 1000.0 / SDL_GetPerformanceFrequency();
+}
+
+/*Every finished frame when a recorded trace is replayed through mainLoop*/
+static void replay_frame(const TLM_FRAME_STATS *stats, void *arg)
+{
+    BENCH_RESULT *res = (BENCH_RESULT*) arg;
+    if(res->skip > 0)
+    {
+        res->skip--;
+        return;
+    }
+    add_result(res, stats->frame_ms);
+}
+
+/*A recorded trace is replayed repeats times through mainLoop, the first warmup frames are not counted*/
+static int replay_recorded(const char *tracefile, CTRL *controls, int repeats, int warmup, BENCH_RESULT *res)
+{
+    int r;
+    res->skip = warmup;
+    TLM_set_frame_callback(replay_frame, res);
+    for (r=0; r<repeats; r++)
+    {
+        if(TLM_replay_trace(tracefile, 1))
+            return 1;
+        TLM_start(controls);
+    }
+    TLM_set_frame_callback(NULL, NULL);
+    return 0;
+}
+
+/*Tiles decoded in the background asks for a new rendering, the same way as in mainLoop*/
+static void handle_events(SDL_Window *window, MATRIX *map_matrix, CTRL *controls, BENCH_RESULT *res)
+{
+    SDL_Event ev;
+    double ms;
+    while(SDL_PollEvent(&ev))
+    {
+        if(ev.type == RasterEventType)
+        {
+            ms = run_frame(window, map_matrix, controls, BENCH_RENDER);
+            if(res)
+            {
+                add_result(res, ms);
+                res->raster_frames++;
+            }
+        }
+    }
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double da = *(const double*) a;
+    double db = *(const double*) b;
+    return (da > db) - (da < db);
+}
+
+/*Nearest rank, the values gets sorted*/
+static double percentile(double *vals, int n, double p)
+{
+    int i;
+    if(!n)
+        return 0;
+    i = (int) (p * n + 0.5) - 1;
+    if(i < 0)
+        i = 0;
+    if(i >= n)
+        i = n - 1;
+    return vals[i];
+}
+
+static void report(BENCH_RESULT *res, double total_ms)
+{
+    int i, j;
+    double sum;
+    struct rusage usage;
+    TLM_CACHE_STATS cs;
+
+    printf("%d frames (%d from decoded raster tiles) in %.1f ms\n", res->used, res->raster_frames, total_ms);
+    printf("%-10s %10s %10s %10s %10s %10s\n", "stage", "mean", "p50", "p95", "p99", "max");
+    for (i=0; i<N_STAGES; i++)
+    {
+        sum = 0;
+        for (j=0; j<res->used; j++)
+            sum += res->ms[i][j];
+        qsort(res->ms[i], res->used, sizeof(double), cmp_double);
+        printf("%-10s %10.2f %10.2f %10.2f %10.2f %10.2f\n", stage_names[i], res->used ? sum / res->used : 0,
+               percentile(res->ms[i], res->used, 0.5), percentile(res->ms[i], res->used, 0.95),
+               percentile(res->ms[i], res->used, 0.99), res->used ? res->ms[i][res->used - 1] : 0);
+    }
+    printf("draw calls per frame: %.1f\n", res->used ? (double) res->draw_calls / res->used : 0);
+    printf("uploaded: %llu kB\n", res->upload_bytes / 1024);
+
+    TLM_get_geom_cache_stats(&cs);
+    printf("geometry cache: %llu hits, %llu misses\n", (unsigned long long) cs.hits, (unsigned long long) cs.misses);
+    TLM_get_raster_cache_stats(&cs);
+    printf("raster cache: %llu hits, %llu misses\n", (unsigned long long) cs.hits, (unsigned long long) cs.misses);
+
+    if(!getrusage(RUSAGE_SELF, &usage))
+        printf("peak rss: %ld kB\n", usage.ru_maxrss);
+}
+
+static void usage()
+{
+    printf("tileLessBench -f projectfile [-d directory] [-t trace] [-n repeats] [-w warmup frames] [-s widthxheight]\n");
+}
+
+int main(int argc, char **argv)
+{
+    char *projectfile=NULL, *dir=NULL, *tracefile=NULL, *opt, *val;
+    int repeats = 1, warmup = 5, width = 1024, height = 768;
+    int i, r, recorded;
+    BENCH_TRACE trace = {NULL, 0, 0};
+    BENCH_RESULT res;
+    MATRIX map_matrix;
+    SDL_Window *window;
+    CTRL *controls;
+    uint64_t t_start;
+
+    while(--argc>0)
+    {
+        /*All options takes a value*/
+        if(argc < 2)
+        {
+            usage();
+            return 1;
+        }
+        opt = *++argv;
+        val = *++argv;
+        argc--;
+
+        if(!strcmp(opt,"-f") || !strcmp(opt,"--projfile"))
+            projectfile = val;
+        else if(!strcmp(opt,"-d") || !strcmp(opt,"--directory"))
+            dir = val;
+        else if(!strcmp(opt,"-t") || !strcmp(opt,"--trace"))
+            tracefile = val;
+        else if(!strcmp(opt,"-n") || !strcmp(opt,"--repeats"))
+            repeats = atoi(val);
+        else if(!strcmp(opt,"-w") || !strcmp(opt,"--warmup"))
+            warmup = atoi(val);
+        else if((strcmp(opt,"-s") && strcmp(opt,"--size")) || sscanf(val, "%dx%d", &width, &height) != 2)
+        {
+            usage();
+            return 1;
+        }
+    }
+    if(!projectfile)
+    {
+        usage();
+        return 1;
+    }
+
+    if(!getenv("SDL_VIDEODRIVER") && !getenv("DISPLAY") && !getenv("WAYLAND_DISPLAY"))
+        setenv("SDL_VIDEODRIVER", "offscreen", 1);
+
+    if(TLM_init_SDL())
+        return 1;
+    if(TLM_init_db(projectfile, dir))
+        return 1;
+    controls = TLM_init_controls(NATIVE_custom);
+
+    /*The window is created from the display size, but we want the same size every run*/
+    window = SDL_GL_GetCurrentWindow();
+    SDL_SetWindowSize(window, width, height);
+    CURR_WIDTH = width;
+    CURR_HEIGHT = height;
+    glViewport(0,0,CURR_WIDTH, CURR_HEIGHT);
+
+    GPSEventType = ((Uint32) -1);
+    reset_matrix(&map_matrix);
+    initialBBOX(init_x, init_y, init_box_width, &map_matrix);
+
+    recorded = tracefile && is_recorded_trace(tracefile);
+    if(recorded)
+    {
+        TLM_set_stats(1, 0);
+        memset(&res, 0, sizeof(BENCH_RESULT));
+        t_start = SDL_GetPerformanceCounter();
+        if(replay_recorded(tracefile, controls, repeats, warmup, &res))
+            return 1;
+        report(&res, (SDL_GetPerformanceCounter() - t_start) * 1000.0 / SDL_GetPerformanceFrequency());
+        for (i=0; i<N_STAGES; i++)
+            free(res.ms[i]);
+        TLM_close();
+        return 0;
+    }
+
+    if(tracefile)
+    {
+        if(read_trace(tracefile, &trace))
+            return 1;
+    }
+    else
+        default_trace(&trace, &map_matrix);
+
+    if(!trace.used)
+    {
+        fprintf(stderr, "Nothing to replay\n");
+        return 1;
+    }
+
+    TLM_set_stats(1, 0);
+
+    /*Warm up the disk cache and the gpu driver*/
+    for (i=0; i<warmup && i<trace.used; i++)
+    {
+        memcpy(map_matrix.bbox, trace.frames[i].bbox, 4 * sizeof(GLfloat));
+        matrixFromBBOX(&map_matrix);
+        run_frame(window, &map_matrix, controls, trace.frames[i].what);
+        handle_events(window, &map_matrix, controls, NULL);
+    }
+
+    memset(&res, 0, sizeof(BENCH_RESULT));
+    t_start = SDL_GetPerformanceCounter();
+    for (r=0; r<repeats; r++)
+    {
+        for (i=0; i<trace.used; i++)
+        {
+            memcpy(map_matrix.bbox, trace.frames[i].bbox, 4 * sizeof(GLfloat));
+            matrixFromBBOX(&map_matrix);
+            add_result(&res, run_frame(window, &map_matrix, controls, trace.frames[i].what));
+            handle_events(window, &map_matrix, controls, &res);
+        }
+    }
+    report(&res, (SDL_GetPerformanceCounter() - t_start) * 1000.0 / SDL_GetPerformanceFrequency());
+
+    for (i=0; i<N_STAGES; i++)
+        free(res.ms[i]);
+    free(trace.frames);
+    TLM_close();
+    return 0;
+}
@@ -27,6 +27,7 @@
 #include "buffer_handling.h"
 #include "uthash.h"
 #include "twkb.h"
+#include "stats.h"
 
 
 
@@ -105,6 +106,16 @@ int addbatch2glfloat_list(GLFLOAT_LIST *list,GLuint n_vals, GLfloat *vals)
     return 0;
 }
 
+/*Makes room for n_vals values at the end of the list, and returns where to write them*/
+GLfloat* reserve_glfloat_list(GLFLOAT_LIST *list,GLuint n_vals)
+{
+    GLfloat *res;
+    increase_glfloat_list(list, n_vals);
+    res = list->list + list->used;
+    list->used += n_vals;
+    return res;
+}
+
 
 
 /************* GLUInt List ********************/
@@ -176,6 +187,16 @@ int addbatch2gluint_list(GLUINT_LIST *list,GLuint n_vals, GLuint *vals)
     return 0;
 }
 
+/*Makes room for n_vals values at the end of the list, and returns where to write them*/
+GLuint* reserve_gluint_list(GLUINT_LIST *list,GLuint n_vals)
+{
+    GLuint *res;
+    increase_gluint_list(list, n_vals);
+    res = list->list + list->used;
+    list->used += n_vals;
+    return res;
+}
+
 
 /************* int64 List ********************/
 static INT64_LIST* init_int64_list()
@@ -289,7 +310,7 @@ static int increase_glushort_list(GLUSHORT_LIST *l, size_t needed_space)
     return 0;
 }
 
-static int reset_glushort_list(GLUSHORT_LIST *l)
+int reset_glushort_list(GLUSHORT_LIST *l)
 {
     l->used = 0;
     return 0;
@@ -395,6 +416,58 @@ int addbatch2uint8_list(UINT8_LIST *list,GLuint n_vals, uint8_t *vals)
 }
 
 
+/************* GPU buffers ********************/
+
+/*Smallest allocation on the gpu, to not reallocate many times for small layers*/
+#define MIN_GPU_BUFFER_SIZE 4096
+
+int init_gpu_buffer(GPU_BUFFER *b)
+{
+    glGenBuffers(1, &(b->id));
+    b->capacity = 0;
+    b->version = 0;
+    return 0;
+}
+
+/**
+ * Bind a buffer and load data to it.
+ * If version is the same as last time the data is already there and nothing is uploaded.
+ * Version 0 means we don't know, so it is always uploaded.
+ * The allocation on the gpu is kept and grown geometrically, so most uploads is just a glBufferSubData.
+ * Returns 1 if data was uploaded
+ */
+int upload_gpu_buffer(GPU_BUFFER *b, GLenum target, const void *data, size_t size, unsigned int version)
+{
+    glBindBuffer(target, b->id);
+
+    if(version && version == b->version)
+        return 0;
+
+    if(size > b->capacity)
+    {
+        size_t new_size = b->capacity ? b->capacity : MIN_GPU_BUFFER_SIZE;
+        while (new_size < size)
+            new_size *= 2;
+        glBufferData(target, new_size, NULL, GL_DYNAMIC_DRAW);
+        b->capacity = new_size;
+    }
+    if(size)
+        glBufferSubData(target, 0, size, data);
+    STATS_UPLOAD(size);
+    b->version = version;
+    return 1;
+}
+
+int destroy_gpu_buffer(GPU_BUFFER *b)
+{
+    glDeleteBuffers(1, &(b->id));
+    b->id = 0;
+    b->capacity = 0;
+    b->version = 0;
+    return 0;
+}
+
+
 /************* POINTER_LIST List ********************/
 POINTER_LIST* init_pointer_list()
 {
@@ -487,6 +560,25 @@ static RASTER_LIST* init_raster_list()
     glGenBuffers(1, &(res->cvbo));
     glGenBuffers(1, &(res->cibo));
     glGenBuffers(1, &(res->vbo));
+
+    /*Every tile is a quad with the whole texture on it,
+     so texture coordinates and elements are loaded once here*/
+    GLfloat cube_texcoords[2*4] = {
+        0.0, 0.0,
+        1.0, 0.0,
+        1.0, 1.0,
+        0.0, 1.0,
+    };
+    GLushort cube_elements[] = {
+        0,  1,  2,
+        2,  3,  0
+    };
+    glBindBuffer(GL_ARRAY_BUFFER, res->cvbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(cube_texcoords), cube_texcoords, GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, res->cibo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(cube_elements), cube_elements, GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
     return res;
 }
 static POINT_LIST* init_point_list()
@@ -496,7 +588,7 @@ static POINT_LIST* init_point_list()
     res->style_id = init_pointer_list();
     res->point_start_indexes = init_gluint_list();
     glGenBuffers(1, &(res->vbo));
-    glGenBuffers(1, &(res->tbo)); //For text
+    init_gpu_buffer(&(res->tbo)); //For text
     return res;
 }
 
@@ -506,7 +598,7 @@ static LINESTRING_LIST* init_linestring_list()
     res->vertex_array = init_glfloat_list();
     res->line_start_indexes = init_gluint_list();
     res->style_id = init_pointer_list();
-    glGenBuffers(1, &(res->vbo));
+    init_gpu_buffer(&(res->vbo));
 
     return res;
 }
@@ -517,13 +609,21 @@ static POLYGON_LIST* init_polygon_list()
     res->vertex_array = init_glfloat_list();
     res->pa_start_indexes = init_gluint_list();
     res->polygon_start_indexes = init_gluint_list();
-    res->element_array = init_glushort_list();
+    res->element_array = init_gluint_list();
     res->element_start_indexes = init_gluint_list();
     res->style_id = init_pointer_list();
     res->line_style_id = init_pointer_list();
-
-    glGenBuffers(1, &(res->vbo));
-    glGenBuffers(1, &(res->ebo));
+    res->batch_elements = init_gluint_list();
+    res->batch_elements16 = init_glushort_list();
+    res->batch_info = init_gluint_list();
+    res->batch_style = init_pointer_list();
+    res->loose_vertices = init_glfloat_list();
+    res->loose_info = init_gluint_list();
+    res->loose_style = init_pointer_list();
+
+    init_gpu_buffer(&(res->vbo));
+    init_gpu_buffer(&(res->ebo));
+    init_gpu_buffer(&(res->lvbo));
     return res;
 }
 
@@ -566,10 +666,17 @@ static int reset_polygon_list(POLYGON_LIST *l)
     reset_glfloat_list(l->vertex_array);
     reset_gluint_list(l->pa_start_indexes);
     reset_gluint_list(l->polygon_start_indexes);
-    reset_glushort_list(l->element_array);
+    reset_gluint_list(l->element_array);
     reset_gluint_list(l->element_start_indexes);
     reset_pointer_list(l->style_id);
     reset_pointer_list(l->line_style_id);
+    reset_gluint_list(l->batch_elements);
+    reset_glushort_list(l->batch_elements16);
+    reset_gluint_list(l->batch_info);
+    reset_pointer_list(l->batch_style);
+    reset_glfloat_list(l->loose_vertices);
+    reset_gluint_list(l->loose_info);
+    reset_pointer_list(l->loose_style);
     return 0;
 }
 
@@ -596,6 +703,7 @@ int destroy_point_list(POINT_LIST *l)
     destroy_gluint_list(l->point_start_indexes);
     destroy_pointer_list(l->style_id);
     glDeleteBuffers(1,&(l->vbo));
+    destroy_gpu_buffer(&(l->tbo));
     free(l);
     l=NULL;
     return 0;
@@ -609,7 +717,7 @@ static int destroy_linestring_list(LINESTRING_LIST *l)
     destroy_glfloat_list(l->vertex_array);
     destroy_gluint_list(l->line_start_indexes);
     destroy_pointer_list(l->style_id);
-    glDeleteBuffers(1,&(l->vbo));
+    destroy_gpu_buffer(&(l->vbo));
     free(l);
     l=NULL;
     return 0;
@@ -623,12 +731,20 @@ static int destroy_polygon_list(POLYGON_LIST *l)
     destroy_glfloat_list(l->vertex_array);
     destroy_gluint_list(l->pa_start_indexes);
     destroy_gluint_list(l->polygon_start_indexes);
-    destroy_glushort_list(l->element_array);
+    destroy_gluint_list(l->element_array);
     destroy_gluint_list(l->element_start_indexes);
     destroy_pointer_list(l->style_id);
     destroy_pointer_list(l->line_style_id);
-    glDeleteBuffers(1,&(l->vbo));
-    glDeleteBuffers(1,&(l->ebo));
+    destroy_gluint_list(l->batch_elements);
+    destroy_glushort_list(l->batch_elements16);
+    destroy_gluint_list(l->batch_info);
+    destroy_pointer_list(l->batch_style);
+    destroy_glfloat_list(l->loose_vertices);
+    destroy_gluint_list(l->loose_info);
+    destroy_pointer_list(l->loose_style);
+    destroy_gpu_buffer(&(l->lvbo));
+    destroy_gpu_buffer(&(l->vbo));
+    destroy_gpu_buffer(&(l->ebo));
     free(l);
     return 0;
 }
@@ -684,6 +800,41 @@ int reset_buffers(LAYER_RUNTIME *layer)
     if(layer->geometryType == RASTER)
         reset_raster_list(layer->rast);
     //  reset_gluint_list(layer->style_id);
+
+    reset_loaded_ids(layer);
+    layer->data_version++;
+    layer->loaded_mpp = 0;
+    layer->n_fetch_boxes = 0;
+    return 0;
+}
+
+
+/************* Loaded ids, used for incremental loading ********************/
+
+int has_loaded_id(LAYER_RUNTIME *layer, int64_t id)
+{
+    LOADED_ID *s = NULL;
+    HASH_FIND(hh, layer->loaded_ids, &id, sizeof(int64_t), s);
+    return s != NULL;
+}
+
+int add_loaded_id(LAYER_RUNTIME *layer, int64_t id)
+{
+    LOADED_ID *s = st_malloc(sizeof(LOADED_ID));
+    s->id = id;
+    HASH_ADD(hh, layer->loaded_ids, id, sizeof(int64_t), s);
+    return 0;
+}
+
+int reset_loaded_ids(LAYER_RUNTIME *layer)
+{
+    LOADED_ID *s, *tmp;
+    HASH_ITER(hh, layer->loaded_ids, s, tmp)
+    {
+        HASH_DEL(layer->loaded_ids, s);
+        free(s);
+    }
+    layer->loaded_ids = NULL;
     return 0;
 }
 
@@ -720,30 +871,24 @@ struct STYLES* get_style(struct STYLES *styles, void *val,int val_type)
 
 GLFLOAT_LIST* get_coord_list(LAYER_RUNTIME *l, TWKB_PARSE_STATE *ts)
 {
-    struct STYLES *s;
     log_this(10,"layer = %s  and ",l->name);
 //   add2gluint_list(l->style_id, style_id);
     int type = l->type;
     if(type & 224)
     {
 //        add2union_list(l->points->style_id, &(ts->styleID));
-        s = get_style(l->styles, &(ts->styleID), ts->styleid_type);
-
-
-        add2pointer_list(l->points->style_id, s);
+        add2pointer_list(l->points->style_id, ts->style);
         return l->points->points;
     }
     else if(type & 16)
     {
-        s = get_style(l->styles, &(ts->styleID), ts->styleid_type);
-        add2pointer_list(l->lines->style_id, s);
+        add2pointer_list(l->lines->style_id, ts->style);
         return l->lines->vertex_array;
     }
 
     else if(type & 6)
     {
-        s = get_style(l->styles,  &(ts->styleID), ts->styleid_type);
-        add2pointer_list(l->polygons->line_style_id, s);
+        add2pointer_list(l->polygons->line_style_id, ts->style);
         return l->polygons->vertex_array;
     }
     else
@@ -756,9 +901,7 @@ GLFLOAT_LIST* get_coord_list(LAYER_RUNTIME *l, TWKB_PARSE_STATE *ts)
 
 GLFLOAT_LIST* get_wide_line_list(LAYER_RUNTIME *l, TWKB_PARSE_STATE *ts)
 {
-    struct STYLES *s = get_style(l->styles, &(ts->styleID), ts->styleid_type);
-
-    add2pointer_list(l->wide_lines->style_id, s);
+    add2pointer_list(l->wide_lines->style_id, ts->style);
 //   add2union_list(l->wide_lines->style_id, &(ts->styleID));
     return l->wide_lines->vertex_array;
 
@@ -782,6 +925,39 @@ int pa_end(LAYER_RUNTIME *l, int64_t id)
     return 0;
 }
 
+/*Makes room for n_pa more point arrays and n_vals more coordinates in the lists get_coord_list and pa_end writes to,
+so big geometries don't grow the lists one doubling at a time*/
+int pa_reserve(LAYER_RUNTIME *l, size_t n_pa, size_t n_vals)
+{
+    int type = l->type;
+
+    increase_int64_list(l->twkb_id, n_pa);
+    if(type & 224)
+    {
+        increase_pointer_list(l->points->style_id, n_pa);
+        increase_gluint_list(l->points->point_start_indexes, n_pa);
+        increase_glfloat_list(l->points->points, n_vals);
+    }
+    else if(type & 16)
+    {
+        increase_pointer_list(l->lines->style_id, n_pa);
+        increase_gluint_list(l->lines->line_start_indexes, n_pa);
+        increase_glfloat_list(l->lines->vertex_array, n_vals);
+    }
+    else if(type & 6)
+    {
+        increase_pointer_list(l->polygons->line_style_id, n_pa);
+        increase_gluint_list(l->polygons->pa_start_indexes, n_pa);
+        increase_glfloat_list(l->polygons->vertex_array, n_vals);
+    }
+    if(type & 8)
+    {
+        increase_pointer_list(l->wide_lines->style_id, n_pa);
+        increase_gluint_list(l->wide_lines->line_start_indexes, n_pa);
+    }
+    return 0;
+}
+
 
 
 
@@ -802,6 +978,8 @@ int destroy_buffers(LAYER_RUNTIME *layer)
 
     if(layer->geometryType == RASTER)
         destroy_raster_list(layer->rast);
+
+    reset_loaded_ids(layer);
     return 0;
 }
 
@@ -72,8 +72,10 @@ int add2glushort_list(GLUSHORT_LIST *list, GLshort val);
 int add2uint8_list(UINT8_LIST *list, uint8_t val);
 
 int addbatch2glfloat_list(GLFLOAT_LIST *list,GLuint n_vals, GLfloat *vals);
+GLfloat* reserve_glfloat_list(GLFLOAT_LIST *list,GLuint n_vals);
 int addbatch2int64_list(INT64_LIST *list,GLuint n_vals, int64_t *vals);
 int addbatch2gluint_list(GLUINT_LIST *list,GLuint n_vals, GLuint *vals);
+GLuint* reserve_gluint_list(GLUINT_LIST *list,GLuint n_vals);
 int addbatch2glushort_list(GLUSHORT_LIST *list,GLuint n_vals, GLushort *vals);
 
 
@@ -81,11 +83,13 @@ int add2union_list(UNION_LIST *list, void *val);
 int addbatch2uint8_list(UINT8_LIST *list,GLuint n_vals, uint8_t *vals);
 
 int add2pointer_list(POINTER_LIST *list, void *val);
+int addbatch2pointer_list(POINTER_LIST *list,GLuint n_vals, void *vals);
 int setzero2pointer_list(POINTER_LIST *list,GLuint n_vals);
 int setzero2int64_list(INT64_LIST *list,int64_t n_vals);
 
 int reset_gluint_list(GLUINT_LIST *l);
 int reset_glfloat_list(GLFLOAT_LIST *l);
+int reset_glushort_list(GLUSHORT_LIST *l);
 int reset_pointer_list(POINTER_LIST *l);
 int reset_point_list(POINT_LIST *l);
 
@@ -105,13 +109,22 @@ int destroy_point_list(POINT_LIST *l);
 
 int reset_buffers(LAYER_RUNTIME *layer);
 
+int has_loaded_id(LAYER_RUNTIME *layer, int64_t id);
+int add_loaded_id(LAYER_RUNTIME *layer, int64_t id);
+int reset_loaded_ids(LAYER_RUNTIME *layer);
+
 int init_buffers(LAYER_RUNTIME *layer);
 
+int init_gpu_buffer(GPU_BUFFER *b);
+int upload_gpu_buffer(GPU_BUFFER *b, GLenum target, const void *data, size_t size, unsigned int version);
+int destroy_gpu_buffer(GPU_BUFFER *b);
+
 
 TEXTSTRUCT* init_text_buf();
 void text_reset_buffer(TEXTSTRUCT *text_buf);
 void text_destroy_buffer(TEXTSTRUCT *text_buf);
 int pa_end(LAYER_RUNTIME *l, int64_t id);
+int pa_reserve(LAYER_RUNTIME *l, size_t n_pa, size_t n_vals);
 
 
 
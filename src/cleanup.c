@@ -28,6 +28,13 @@
 #include "matrix_handling.h"
 #include "log.h"
 #include "cleanup.h"
+#include "fetch_pool.h"
+#include "geom_cache.h"
+#include "raster_cache.h"
+#include "raster_decode.h"
+#include "prefetch.h"
+#include "stats.h"
+#include "connections.h"
 
 void free_resources(SDL_Window* window,SDL_GLContext context)
 {
@@ -43,11 +50,21 @@ void free_resources(SDL_Window* window,SDL_GLContext context)
         glDeleteProgram(gps_program);
         glDeleteProgram(sym_program);
         glDeleteProgram(raster_program);
+        /*The prefetcher adds to the caches, so it has to go before them*/
+        destroy_prefetch();
+        destroy_raster_decode();
+        raster_cache_clear();
+        destroy_stats();
+
+        /*The workers holds statements on the layers, so they have to go first*/
+        destroy_fetch_pool();
+        geom_cache_clear();
 
         destroy_control(get_master_control());
     //   destroy_layer_runtime(layerRuntime,nLayers);
         destroy_layers(global_layers);
         destroy_layer_runtime(infoLayer,1);
+        destroy_data_dbs();
         free(gps_circle);
         destroy_symbol_list(global_symbols);
         destroy_font(fnts);
@@ -0,0 +1,270 @@
+/**********************************************************************
+ *
+ * TileLessMap
+ *
+ * TileLessMap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * TileLessMap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TileLessMap.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **********************************************************************
+ *
+ * Copyright (C) 2016-2018 Nicklas Avén
+ *
+ ***********************************************************************/
+
+
+/**********************************************************************
+ * Connections to the data dbs.
+ *
+ * The layers data is spread over the dbs listed in the dbs table of
+ * the project db. Instead of attaching them all to one connection,
+ * which sqlite limits to 10 dbs, every data db gets its own read-only
+ * connection, opened the first time a layer in it is used.
+ * The main schema of the connection is renamed to the db's name in the
+ * dbs table, so the sql can keep addressing the tables as name.table.
+ *
+ * Every connection gets its own page cache and mmap budget, set with
+ * TLM_set_db_budget before TLM_init_db.
+ ***********************************************************************/
+
+#include "theclient.h"
+#include "mem.h"
+#include "utils.h"
+#include "connections.h"
+#include "tilelessmap.h"
+#include <ctype.h>
+
+static DATA_DB *data_dbs = NULL;
+static int n_data_dbs = 0;
+
+static size_t cache_budget = DB_CACHE_DEFAULT_SIZE;
+static size_t mmap_budget = DB_MMAP_DEFAULT_SIZE;
+
+/*The main thread's connections*/
+static DB_CONNECTIONS main_connections = {NULL, NULL, 0, 0, NULL, NULL};
+
+
+/**
+ * Read which dbs the layers use from the project db.
+ * Nothing is opened here
+ */
+int init_data_dbs(sqlite3 *project, const char *dir)
+{
+    int rc, size = 8;
+    sqlite3_stmt *prepared_dbs;
+    char *sql_dbs = " select distinct d.source, d.name from dbs d inner join layers l on d.name=l.source;";
+    check_sql(sql_dbs);
+    rc = sqlite3_prepare_v2(project, sql_dbs, -1, &prepared_dbs, 0);
+    if (rc != SQLITE_OK ) {
+        log_this(1, "SQL error in %s\n",sql_dbs );
+        return 1;
+    }
+
+    data_dbs = st_malloc(size * sizeof(DATA_DB));
+    n_data_dbs = 0;
+    while(sqlite3_step(prepared_dbs)==SQLITE_ROW)
+    {
+        const char *dbsource = (const char*) sqlite3_column_text(prepared_dbs, 0);
+        const char *dbname = (const char*) sqlite3_column_text(prepared_dbs, 1);
+        DATA_DB *d;
+        size_t len;
+
+        if(!dbsource || !dbname)
+            continue;
+        if(n_data_dbs == size)
+        {
+            size *= 2;
+            data_dbs = st_realloc(data_dbs, size * sizeof(DATA_DB));
+        }
+        d = data_dbs + n_data_dbs;
+        d->name = st_malloc(strlen(dbname) + 1);
+        strcpy(d->name, dbname);
+        len = strlen(dbsource) + (dir ? strlen(dir) + 3 : 1);
+        d->path = st_malloc(len);
+        if(dir)
+            snprintf(d->path, len, "%s//%s", dir, dbsource);
+        else
+            snprintf(d->path, len, "%s", dbsource);
+        log_this(10, "data db %s in %s\n", d->name, d->path);
+        n_data_dbs++;
+    }
+    sqlite3_finalize(prepared_dbs);
+
+    init_db_connections(&main_connections, 0, NULL, NULL);
+    return 0;
+}
+
+/*Index of a data db from its name, -1 if it is not a data db*/
+int data_db_index(const char *name)
+{
+    int i;
+    if(!name)
+        return -1;
+    for (i=0; i<n_data_dbs; i++)
+    {
+        if(!strcmp(data_dbs[i].name, name))
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * Set up a set of connections, one per data db, none opened yet.
+ * progress is set on every connection when it is opened and is called with progress_arg every progress_ops vm instructions
+ */
+void init_db_connections(DB_CONNECTIONS *c, int progress_ops, int (*progress)(void*), void *progress_arg)
+{
+    c->n = n_data_dbs;
+    c->db = st_calloc(n_data_dbs ? n_data_dbs : 1, sizeof(sqlite3*));
+    c->failed = st_calloc(n_data_dbs ? n_data_dbs : 1, sizeof(uint8_t));
+    c->progress_ops = progress_ops;
+    c->progress = progress;
+    c->progress_arg = progress_arg;
+}
+
+/*The connection to data db i in the set, opened if it is not already. NULL if it can't be opened*/
+sqlite3* db_connection(DB_CONNECTIONS *c, int i)
+{
+    int rc;
+    char pragma[64];
+    sqlite3 *db;
+    DATA_DB *d;
+
+    if(i < 0 || i >= c->n)
+        return NULL;
+    if(c->db[i] || c->failed[i])
+        return c->db[i];
+
+    d = data_dbs + i;
+    rc = sqlite3_open_v2(d->path, &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL);
+    if (rc != SQLITE_OK)
+    {
+        log_this(90, "failed to open db: %s, %s\n", d->path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        c->failed[i] = 1;
+        return NULL;
+    }
+    /*sqlite keeps the pointer, d->name lives until the connection is closed*/
+    sqlite3_db_config(db, SQLITE_DBCONFIG_MAINDBNAME, d->name);
+
+    /*negative cache_size is in KiB instead of pages*/
+    snprintf(pragma, sizeof(pragma), "PRAGMA cache_size = -%lu;", (unsigned long) (cache_budget / 1024));
+    sqlite3_exec(db, pragma, NULL, NULL, NULL);
+    snprintf(pragma, sizeof(pragma), "PRAGMA mmap_size = %lu;", (unsigned long) mmap_budget);
+    sqlite3_exec(db, pragma, NULL, NULL, NULL);
+
+    if(c->progress)
+        sqlite3_progress_handler(db, c->progress_ops, c->progress, c->progress_arg);
+    c->db[i] = db;
+    return db;
+}
+
+void close_db_connections(DB_CONNECTIONS *c)
+{
+    int i;
+    if(c->db)
+    {
+        for (i=0; i<c->n; i++)
+        {
+            if(c->db[i])
+                sqlite3_close_v2(c->db[i]);
+        }
+        st_free(c->db);
+        c->db = NULL;
+    }
+    if(c->failed)
+    {
+        st_free(c->failed);
+        c->failed = NULL;
+    }
+    c->n = 0;
+}
+
+/**
+ * The main thread's connection for a schema name as used in the sql.
+ * Anything that is not a data db, like main, is in the project db.
+ * NULL if the data db can't be opened
+ */
+sqlite3* schema_db(const char *name)
+{
+    int i = data_db_index(name);
+    if(i < 0)
+        return projectDB;
+    return db_connection(&main_connections, i);
+}
+
+/*The main thread's connection to the db a layer's data is in*/
+sqlite3* layer_db(LAYER_RUNTIME *l)
+{
+    return db_connection(&main_connections, l->data_db);
+}
+
+/**
+ * Attach every data db the sql addresses as name.table that the connection doesn't have yet.
+ * Used for sql that joins across data dbs, like the info relations.
+ * The attached dbs get the flags of the connection, so they are read-only too
+ */
+int attach_data_dbs(sqlite3 *db, const char *sql)
+{
+    int i, rc, res = 0;
+    const char *p;
+    size_t len;
+    char *attach;
+
+    if(!db || !sql)
+        return 1;
+    for (i=0; i<n_data_dbs; i++)
+    {
+        if(sqlite3_db_filename(db, data_dbs[i].name))
+            continue;
+        len = strlen(data_dbs[i].name);
+        for (p = strstr(sql, data_dbs[i].name); p; p = strstr(p + 1, data_dbs[i].name))
+        {
+            if(p[len] == '.' && (p == sql || !(isalnum((unsigned char) p[-1]) || p[-1] == '_')))
+                break;
+        }
+        if(!p)
+            continue;
+
+        attach = sqlite3_mprintf("ATTACH DATABASE %Q AS %Q;", data_dbs[i].path, data_dbs[i].name);
+        rc = sqlite3_exec(db, attach, NULL, NULL, NULL);
+        sqlite3_free(attach);
+        if (rc != SQLITE_OK)
+        {
+            log_this(90, "failed to attach db: %s, %s\n", data_dbs[i].path, sqlite3_errmsg(db));
+            res = 1;
+        }
+    }
+    return res;
+}
+
+/*Has to be called after the layers statements are finalized*/
+void destroy_data_dbs()
+{
+    int i;
+    close_db_connections(&main_connections);
+    for (i=0; i<n_data_dbs; i++)
+    {
+        st_free(data_dbs[i].name);
+        st_free(data_dbs[i].path);
+    }
+    st_free(data_dbs);
+    data_dbs = NULL;
+    n_data_dbs = 0;
+}
+
+/*Page cache and mmap size for every connection to a data db. Has to be set before TLM_init_db*/
+void TLM_set_db_budget(size_t cache_bytes, size_t mmap_bytes)
+{
+    cache_budget = cache_bytes;
+    mmap_budget = mmap_bytes;
+}
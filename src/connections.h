@@ -0,0 +1,67 @@
+/**********************************************************************
+ *
+ * TileLessMap
+ *
+ * TileLessMap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * TileLessMap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TileLessMap.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **********************************************************************
+ *
+ * Copyright (C) 2016-2018 Nicklas Avén
+ *
+ ***********************************************************************/
+#ifndef _connections_H
+#define _connections_H
+
+#include "structures.h"
+
+/*Default page cache and mmap size for every connection to a data db.
+There is one connection per data db for the main thread and for every fetch worker, so the cache is kept small.
+No mmap on 32 bit where the address space runs out*/
+#define DB_CACHE_DEFAULT_SIZE (512 * 1024)
+#define DB_MMAP_DEFAULT_SIZE (sizeof(void*) > 4 ? (size_t) 64 * 1024 * 1024 : 0)
+
+/*A db with data for the project, from the dbs table*/
+typedef struct
+{
+    char *name; //the name the layers sql use for the db, as in name.table
+    char *path;
+} DATA_DB;
+
+/**
+ * One read-only connection per data db, opened the first time it is asked for.
+ * The main thread has one set and every fetch worker its own,
+ * so no connection is shared between threads
+ */
+typedef struct
+{
+    sqlite3 **db; //one per data db, NULL until opened
+    uint8_t *failed; //the db could not be opened, so we don't try again
+    int n;
+    int progress_ops;
+    int (*progress)(void*); //progress handler for every connection in the set, can be NULL
+    void *progress_arg;
+} DB_CONNECTIONS;
+
+
+int init_data_dbs(sqlite3 *project, const char *dir);
+int data_db_index(const char *name);
+void init_db_connections(DB_CONNECTIONS *c, int progress_ops, int (*progress)(void*), void *progress_arg);
+sqlite3* db_connection(DB_CONNECTIONS *c, int i);
+void close_db_connections(DB_CONNECTIONS *c);
+sqlite3* schema_db(const char *name);
+sqlite3* layer_db(LAYER_RUNTIME *l);
+int attach_data_dbs(sqlite3 *db, const char *sql);
+void destroy_data_dbs();
+
+#endif
@@ -30,6 +30,9 @@
 #include "log.h"
 #include "utils.h"
 #include "tilelessmap.h"
+#include "trace.h"
+#include "prefetch.h"
+#include "fetch_pool.h"
 void mainLoop(SDL_Window* window,struct  CTRL *controls)
 {
     log_this(100, "Entering mainLoop now\n");
@@ -122,13 +125,26 @@ void mainLoop(SDL_Window* window,struct  CTRL *controls)
 
     while (1)
     {
-        if (SDL_WaitEvent(&ev)) /* execution suspends here while waiting on an event */
+        /*Works as SDL_WaitEvent, but records or replays the events if asked for.
+         * While the map is left alone the wait times out when the prefetcher needs us*/
+        if (trace_wait_event_timeout(&ev, prefetch_idle())) /* execution suspends here while waiting on an event */
         {
+            /*Input aborts the prefetching until the map is idle again*/
+            if(ev.type != GPSEventType && ev.type != RasterEventType && ev.type != FetchEventType)
+                prefetch_interrupt();
 
-            if(ev.type == GPSEventType)
+            if(ev.type == GPSEventType || ev.type == RasterEventType)
             {
                 render_data(window, &map_matrix, controls);
             }
+            else if(ev.type == FetchEventType)
+            {
+                /*Layers fetched for a view we have already left are fetched again anyway.
+                 * If more layers are done we only render for the last of them*/
+                if(fetch_pool_current((uint32_t) ev.user.code) &&
+                        !SDL_PeepEvents(tmp_ev, 1, SDL_PEEKEVENT, FetchEventType, FetchEventType))
+                    show_progress(window, &map_matrix, controls);
+            }
             else
             {
                 switch (ev.type)
@@ -168,7 +184,7 @@ void mainLoop(SDL_Window* window,struct  CTRL *controls)
                         if(!incharge)
                         {
                             matrixFromDeltaMouse(&map_matrix,&ref, mouse_down_x,mouse_down_y,mouse_up_x,mouse_up_y);
-                            get_data(window, &map_matrix, controls);
+                            request_data(window, &map_matrix, controls);
                             //  copyNew2CurrentBBOX(newBBOX, currentBBOX);
                         }
                         else
@@ -183,7 +199,7 @@ void mainLoop(SDL_Window* window,struct  CTRL *controls)
                 case SDL_MOUSEWHEEL:
                     wheel_y = ev.wheel.y;
 
-                    SDL_GetMouseState(&px_x_clicked, &px_y_clicked);
+                    trace_mouse_state(&px_x_clicked, &px_y_clicked);
                     /*  if(map_modus)
                       {*/
                     if(incharge)
@@ -205,7 +221,7 @@ void mainLoop(SDL_Window* window,struct  CTRL *controls)
 
                     }
 
-                    get_data(window, &map_matrix, controls);
+                    request_data(window, &map_matrix, controls);
 
                     // copyNew2CurrentBBOX(newBBOX, currentBBOX);
                     //}
@@ -304,7 +320,7 @@ void mainLoop(SDL_Window* window,struct  CTRL *controls)
                                 {
                                     get_box_from_touches(touches, &map_matrix, &ref);
                                     matrixFromBBOX(&map_matrix);
-                                    get_data(window, &map_matrix, controls);
+                                    request_data(window, &map_matrix, controls);
 
                                 }
                                 else
@@ -330,7 +346,7 @@ void mainLoop(SDL_Window* window,struct  CTRL *controls)
                             if(!incharge)
                             {
                                 matrixFromDeltaMouse(&map_matrix,&ref,mouse_down_x,mouse_down_y,mouse_up_x,mouse_up_y);
-                                get_data(window, &map_matrix, controls);
+                                request_data(window, &map_matrix, controls);
                             }
                             else
                             {
@@ -424,7 +440,7 @@ void mainLoop(SDL_Window* window,struct  CTRL *controls)
                         if(!incharge)
                         {
                             matrixFromDeltaMouse(&map_matrix,&map_matrix,0,0,0,0);
-                            get_data(window, &map_matrix, controls);
+                            request_data(window, &map_matrix, controls);
                         }
                         else
                         {
@@ -438,6 +454,7 @@ void mainLoop(SDL_Window* window,struct  CTRL *controls)
                     break;
 
                 case SDL_QUIT:
+                    trace_stop();
                     free(touches);
                     return;
                 }
@@ -0,0 +1,486 @@
+/**********************************************************************
+ *
+ * TileLessMap
+ *
+ * TileLessMap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * TileLessMap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TileLessMap.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **********************************************************************
+ *
+ * Copyright (C) 2016-2018 Nicklas Avén
+ *
+ ***********************************************************************/
+
+
+/**********************************************************************
+ * The fetch pool is a fixed number of worker threads fetching and
+ * decoding layers in parallel.
+ *
+ * Every worker has its own read-only connection to every data db, see
+ * connections.c, and its own copy of every layer's prepared statement,
+ * both made the first time the worker fetches a layer from that db. The layer buffers are only
+ * written by the worker that has picked the layer, so the only shared
+ * state is the job queue below.
+ *
+ * Every job belongs to a generation, one per view asked for. When a new
+ * view is asked for, queued jobs from older generations are skipped and
+ * running queries are aborted from a progress handler on the worker's
+ * connection. The layers they were for are loaded from scratch next time.
+ * When a job of the current generation is done an event is pushed to the
+ * main loop, so fetching doesn't have to block the event handling and the
+ * map can be shown layer by layer as they arrive.
+ ***********************************************************************/
+
+#include <time.h>
+#include "theclient.h"
+#include "mem.h"
+#include "fetch_pool.h"
+#include "stats.h"
+
+static FETCH_WORKER *workers = NULL;
+static int n_workers = 0;
+
+/*job queue, holds layer indexes. Never longer than the number of layers*/
+static int *queue = NULL;
+static int queue_head = 0;
+static int queue_used = 0;
+static int queue_size = 0;
+
+/*one state and the generation it was submitted in, per layer in global_layers*/
+static uint8_t *layer_state = NULL;
+static uint32_t *layer_generation = NULL;
+
+/*The generation of the view asked for last. Written with pool_mutex held,
+ * read without it from the progress handlers*/
+static uint32_t generation = 0;
+static int n_running = 0;
+
+/*Set while the layers for a new view are submitted, the main loop renders what is done after that anyway.
+ * notify is set if the main loop wants the events*/
+static int submitting = 0;
+static int notify = 0;
+
+static int stop_workers = 0;
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+
+static int layer_index(LAYER_RUNTIME *l)
+{
+    int i = (int) (l - global_layers->layers);
+    if(i < 0 || i >= queue_size)
+        return -1;
+    return i;
+}
+
+/*The worker is done with the layer, so the main thread can take over. Called with the mutex held*/
+static void collect(LAYER_RUNTIME *l, int i)
+{
+    if(layer_state[i] == FETCH_DONE)
+        stats_collect_fetch(l, layer_generation[i] == generation);
+    layer_state[i] = FETCH_IDLE;
+}
+
+/*Tell the main loop that a layer in the current generation is fetched. Called with the mutex held*/
+static void push_fetch_event()
+{
+    if(!notify || submitting || FetchEventType == ((Uint32)-1))
+        return;
+    SDL_Event event;
+    SDL_zero(event);
+    event.type = FetchEventType;
+    event.user.code = (Sint32) generation;
+    SDL_PushEvent(&event);
+}
+
+/*Returning non zero makes the running query return SQLITE_INTERRUPT*/
+static int fetch_progress(void *w)
+{
+    FETCH_WORKER *worker = (FETCH_WORKER*) w;
+    return worker->generation != __atomic_load_n(&generation, __ATOMIC_RELAXED);
+}
+
+static void *fetch_worker_thread(void *w)
+{
+    FETCH_WORKER *worker = (FETCH_WORKER*) w;
+    int i, stale;
+    while(1)
+    {
+        pthread_mutex_lock(&pool_mutex);
+        while(!queue_used && !stop_workers)
+            pthread_cond_wait(&job_cond, &pool_mutex);
+
+        if(stop_workers)
+        {
+            pthread_mutex_unlock(&pool_mutex);
+            break;
+        }
+        i = queue[queue_head];
+        queue_head = (queue_head + 1) % queue_size;
+        queue_used--;
+        layer_state[i] = FETCH_RUNNING;
+        worker->generation = layer_generation[i];
+        stale = worker->generation != generation;
+        n_running++;
+        pthread_mutex_unlock(&pool_mutex);
+
+        LAYER_RUNTIME *theLayer = global_layers->layers + i;
+
+        sqlite3_stmt *ps = stale ? NULL : fetch_worker_statement(worker, i, theLayer->geom_level);
+        if(ps)
+        {
+            log_this(10, "worker %d fetches layer %s\n", worker->id, theLayer->name);
+            twkb_fromSQLiteBBOX_stmt(theLayer, ps);
+        }
+
+        pthread_mutex_lock(&pool_mutex);
+        n_running--;
+        if(worker->generation != generation)
+        {
+            /*What is in the buffers is not what get_data planned for, so it can't be loaded incremental*/
+            log_this(10, "worker %d dropped layer %s, the view has changed\n", worker->id, theLayer->name);
+            theLayer->loaded_mpp = 0;
+        }
+        else
+            push_fetch_event();
+        layer_state[i] = FETCH_DONE;
+        pthread_cond_broadcast(&done_cond);
+        pthread_mutex_unlock(&pool_mutex);
+    }
+    return NULL;
+}
+
+/**
+ * Set up a worker. Its connections are opened and the layers prepared statements copied to them
+ * when they are first needed, so only the dbs actually used are opened.
+ * progress is called every FETCH_PROGRESS_OPS vm instructions with the worker, and aborts the query when it returns non zero.
+ * Also used for the prefetcher
+ */
+int init_fetch_worker(FETCH_WORKER *worker, int (*progress)(void*))
+{
+    init_db_connections(&(worker->conns), FETCH_PROGRESS_OPS, progress, (void*) worker);
+    worker->n_ps = global_layers->nlayers;
+    worker->ps = st_calloc(worker->n_ps, sizeof(sqlite3_stmt*));
+    worker->level_ps = st_calloc(worker->n_ps * MAX_GEOM_LEVELS, sizeof(sqlite3_stmt*));
+    worker->prepared = st_calloc(worker->n_ps, sizeof(uint8_t));
+    return 0;
+}
+
+/**
+ * The worker's copy of layer i's statement for level of detail level, or the layer's own geometry if level is -1.
+ * The first time, all the layer's statements are prepared on the worker's connection to the layer's db.
+ * NULL if that failed
+ */
+sqlite3_stmt* fetch_worker_statement(FETCH_WORKER *worker, int i, int level)
+{
+    int j, rc;
+    sqlite3 *db;
+    const char *sql;
+    LAYER_RUNTIME *oneLayer = global_layers->layers + i;
+
+    if(!worker->prepared[i])
+    {
+        worker->prepared[i] = 1;
+        db = db_connection(&(worker->conns), oneLayer->data_db);
+        if(!db || !oneLayer->preparedStatement->ps)
+            return NULL;
+
+        sql = sqlite3_sql(oneLayer->preparedStatement->ps);
+        rc = sqlite3_prepare_v2(db, sql, -1, worker->ps + i, 0);
+        if (rc != SQLITE_OK )
+        {
+            log_this(100, "Fetch worker, SQL error in %s\n",sql );
+            worker->ps[i] = NULL;
+        }
+
+        for (j=0; j<oneLayer->n_levels; j++)
+        {
+            sql = sqlite3_sql(oneLayer->levels[j].ps);
+            rc = sqlite3_prepare_v2(db, sql, -1, worker->level_ps + i * MAX_GEOM_LEVELS + j, 0);
+            if (rc != SQLITE_OK )
+            {
+                log_this(100, "Fetch worker, SQL error in %s\n",sql );
+                worker->level_ps[i * MAX_GEOM_LEVELS + j] = NULL;
+            }
+        }
+    }
+    if(level >= 0)
+        return worker->level_ps[i * MAX_GEOM_LEVELS + level];
+    return worker->ps[i];
+}
+
+void destroy_fetch_worker(FETCH_WORKER *worker)
+{
+    int i;
+    if(worker->ps)
+    {
+        for (i=0; i<worker->n_ps; i++)
+        {
+            if(worker->ps[i])
+                sqlite3_finalize(worker->ps[i]);
+        }
+        free(worker->ps);
+        worker->ps = NULL;
+    }
+    if(worker->level_ps)
+    {
+        for (i=0; i<worker->n_ps * MAX_GEOM_LEVELS; i++)
+        {
+            if(worker->level_ps[i])
+                sqlite3_finalize(worker->level_ps[i]);
+        }
+        free(worker->level_ps);
+        worker->level_ps = NULL;
+    }
+    if(worker->prepared)
+    {
+        free(worker->prepared);
+        worker->prepared = NULL;
+    }
+    close_db_connections(&(worker->conns));
+}
+
+/**
+ * Start the workers. Has to be called after the layers are loaded since
+ * the workers copy the layers prepared statements.
+ * If anything fails we just fall back to fetching in serial.
+ */
+int init_fetch_pool()
+{
+    int i, n;
+    FetchEventType = ((Uint32)-1);
+#if THREADING > 0
+    n = SDL_GetCPUCount();
+#else
+    n = 0;
+#endif
+    if(n > MAX_FETCH_WORKERS)
+        n = MAX_FETCH_WORKERS;
+    if(n > global_layers->nlayers)
+        n = global_layers->nlayers;
+
+    /*With only one worker there is nothing to gain*/
+    if(n < 2)
+        return 0;
+
+    queue_size = global_layers->nlayers;
+    queue = st_malloc(queue_size * sizeof(int));
+    layer_state = st_calloc(queue_size, sizeof(uint8_t));
+    layer_generation = st_calloc(queue_size, sizeof(uint32_t));
+    queue_head = queue_used = n_running = submitting = notify = 0;
+    stop_workers = 0;
+    FetchEventType = SDL_RegisterEvents(1);
+
+    workers = st_calloc(n, sizeof(FETCH_WORKER));
+    for (i=0; i<n; i++)
+    {
+        workers[i].id = i;
+        if(init_fetch_worker(workers + i, fetch_progress))
+            break;
+        if(pthread_create(&(workers[i].thread), NULL, fetch_worker_thread, (void*) (workers + i)))
+        {
+            destroy_fetch_worker(workers + i);
+            break;
+        }
+        n_workers++;
+    }
+    if(!n_workers)
+    {
+        destroy_fetch_pool();
+        return 1;
+    }
+    log_this(100, "Fetch pool started with %d workers\n", n_workers);
+    return 0;
+}
+
+int fetch_pool_active()
+{
+    return n_workers > 0;
+}
+
+/**
+ * Queue a layer for fetching.
+ * Without any workers the layer is fetched right away in the calling thread
+ */
+int fetch_pool_submit(LAYER_RUNTIME *l)
+{
+    int i;
+    if(!n_workers || (i = layer_index(l)) < 0)
+    {
+        twkb_fromSQLiteBBOX((void *) l);
+        stats_collect_fetch(l, 1);
+        return 0;
+    }
+    pthread_mutex_lock(&pool_mutex);
+    queue[(queue_head + queue_used) % queue_size] = i;
+    queue_used++;
+    layer_state[i] = FETCH_QUEUED;
+    layer_generation[i] = generation;
+    pthread_cond_signal(&job_cond);
+    pthread_mutex_unlock(&pool_mutex);
+    return 0;
+}
+
+/**
+ * Like fetch_pool_wait, but doesn't block.
+ * Returns 1 if the layer is still queued or being fetched, 0 if its buffers can be used.
+ * fetched, if not NULL, is set to 1 if the layer was fetched since it was last collected, so the buffers have to be uploaded
+ */
+int fetch_pool_collect(LAYER_RUNTIME *l, int *fetched)
+{
+    int i, busy = 0;
+    if(fetched)
+        *fetched = 0;
+    if(!n_workers || (i = layer_index(l)) < 0)
+        return 0;
+
+    pthread_mutex_lock(&pool_mutex);
+    if(layer_state[i] == FETCH_QUEUED || layer_state[i] == FETCH_RUNNING)
+        busy = 1;
+    else
+    {
+        if(fetched)
+            *fetched = layer_state[i] == FETCH_DONE;
+        collect(l, i);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    return busy;
+}
+
+/**
+ * Block until a submitted layer is fetched.
+ * Layers that are not submitted returns directly.
+ */
+int fetch_pool_wait(LAYER_RUNTIME *l)
+{
+    int i;
+    if(!n_workers || (i = layer_index(l)) < 0)
+        return 0;
+
+    pthread_mutex_lock(&pool_mutex);
+    while(layer_state[i] == FETCH_QUEUED || layer_state[i] == FETCH_RUNNING)
+        pthread_cond_wait(&done_cond, &pool_mutex);
+    collect(l, i);
+    pthread_mutex_unlock(&pool_mutex);
+    return 0;
+}
+
+/**
+ * Start a new generation, before the layers are submitted for a new view.
+ * Everything submitted before is skipped or aborted, but still has to be waited for
+ */
+uint32_t fetch_pool_new_generation()
+{
+    uint32_t g;
+    pthread_mutex_lock(&pool_mutex);
+    g = generation + 1;
+    __atomic_store_n(&generation, g, __ATOMIC_RELAXED);
+    submitting = 1;
+    notify = 0;
+    pthread_mutex_unlock(&pool_mutex);
+    return g;
+}
+
+/**
+ * All layers for the view are submitted. With want_event the main loop gets a FetchEventType
+ * event every time one of them is fetched from now on
+ */
+void fetch_pool_end_generation(int want_event)
+{
+    if(!n_workers)
+        return;
+    pthread_mutex_lock(&pool_mutex);
+    submitting = 0;
+    notify = want_event;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+/*Number of layers queued or being fetched*/
+int fetch_pool_pending()
+{
+    int n;
+    if(!n_workers)
+        return 0;
+    pthread_mutex_lock(&pool_mutex);
+    n = queue_used + n_running;
+    pthread_mutex_unlock(&pool_mutex);
+    return n;
+}
+
+/**
+ * Wait max ms milliseconds for all layers to be fetched.
+ * Returns the number of layers still queued or being fetched
+ */
+int fetch_pool_wait_all(int ms)
+{
+    struct timespec until;
+    int n;
+    if(!n_workers)
+        return 0;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += ms / 1000;
+    until.tv_nsec += (long) (ms % 1000) * 1000000;
+    if(until.tv_nsec >= 1000000000)
+    {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&pool_mutex);
+    while(queue_used + n_running)
+    {
+        if(pthread_cond_timedwait(&done_cond, &pool_mutex, &until))
+            break;
+    }
+    n = queue_used + n_running;
+    pthread_mutex_unlock(&pool_mutex);
+    return n;
+}
+
+/*Is the generation from a fetch event the one asked for last*/
+int fetch_pool_current(uint32_t g)
+{
+    int current;
+    pthread_mutex_lock(&pool_mutex);
+    current = g == generation;
+    pthread_mutex_unlock(&pool_mutex);
+    return current;
+}
+
+void destroy_fetch_pool()
+{
+    int i;
+    pthread_mutex_lock(&pool_mutex);
+    stop_workers = 1;
+    pthread_cond_broadcast(&job_cond);
+    pthread_mutex_unlock(&pool_mutex);
+
+    for (i=0; i<n_workers; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        destroy_fetch_worker(workers + i);
+    }
+    n_workers = 0;
+    st_free(workers);
+    workers = NULL;
+    st_free(queue);
+    queue = NULL;
+    st_free(layer_state);
+    layer_state = NULL;
+    st_free(layer_generation);
+    layer_generation = NULL;
+    queue_size = queue_used = queue_head = 0;
+}
@@ -0,0 +1,75 @@
+/**********************************************************************
+ *
+ * TileLessMap
+ *
+ * TileLessMap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * TileLessMap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TileLessMap.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **********************************************************************
+ *
+ * Copyright (C) 2016-2018 Nicklas Avén
+ *
+ ***********************************************************************/
+#ifndef _fetch_pool_H
+#define _fetch_pool_H
+
+#include <pthread.h>
+#include "structures.h"
+#include "connections.h"
+
+/*Upper limit of fetch workers, the actual number also depends on number of cores and layers*/
+#define MAX_FETCH_WORKERS 8
+
+/*States of a layer in the fetch pool*/
+#define FETCH_IDLE 0
+#define FETCH_QUEUED 1
+#define FETCH_RUNNING 2
+#define FETCH_DONE 3
+
+/*How many sqlite vm instructions between the checks if a running query is for an old view*/
+#define FETCH_PROGRESS_OPS 1000
+
+/**
+ * A fetch worker owns its own read-only connections to the data dbs,
+ * and its own copy of every layer's prepared statement.
+ * That way no sqlite connection or statement is ever shared between threads.
+ */
+typedef struct
+{
+    pthread_t thread;
+    int id;
+    DB_CONNECTIONS conns;
+    sqlite3_stmt **ps; //one per layer, in the same order as global_layers
+    sqlite3_stmt **level_ps; //MAX_GEOM_LEVELS per layer, for the levels of detail
+    uint8_t *prepared; //per layer, if the statements are prepared yet
+    int n_ps;
+    uint32_t generation; //the generation of the job the worker is running
+} FETCH_WORKER;
+
+
+int init_fetch_worker(FETCH_WORKER *worker, int (*progress)(void*));
+sqlite3_stmt* fetch_worker_statement(FETCH_WORKER *worker, int i, int level);
+void destroy_fetch_worker(FETCH_WORKER *worker);
+int init_fetch_pool();
+int fetch_pool_active();
+int fetch_pool_submit(LAYER_RUNTIME *l);
+int fetch_pool_wait(LAYER_RUNTIME *l);
+int fetch_pool_collect(LAYER_RUNTIME *l, int *fetched);
+int fetch_pool_pending();
+int fetch_pool_wait_all(int ms);
+uint32_t fetch_pool_new_generation();
+void fetch_pool_end_generation(int want_event);
+int fetch_pool_current(uint32_t generation);
+void destroy_fetch_pool();
+
+#endif
@@ -0,0 +1,485 @@
+/**********************************************************************
+ *
+ * TileLessMap
+ *
+ * TileLessMap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * TileLessMap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TileLessMap.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **********************************************************************
+ *
+ * Copyright (C) 2016-2018 Nicklas Avén
+ *
+ ***********************************************************************/
+
+
+/**********************************************************************
+ * Cache of decoded features.
+ *
+ * When a feature is decoded, the part of the layer buffers it wrote is
+ * copied to the cache, keyed by layer, twkb_id and the utm zone it is
+ * reprojected to. Next time the same feature is fetched it is appended
+ * to the buffers from the cache instead of decoded and reprojected again.
+ *
+ * The prefetcher fills the cache from its own copies of the layers, and
+ * the entries are keyed as for the layers they are copies of.
+ *
+ * The entries are kept in a uthash in least recently used order, and
+ * the oldest entries are dropped when the cache grows above its limit.
+ * The fetch workers share the cache, so the hash is only touched under
+ * one mutex. A hit pins the entry and appends it with the mutex
+ * released, so workers hitting the cache don't wait on each other.
+ ***********************************************************************/
+
+#include "theclient.h"
+#include "mem.h"
+#include "geom_cache.h"
+#include "tilelessmap.h"
+
+static GEOM_CACHE_ENTRY *cache = NULL;
+static size_t cache_bytes = 0;
+static size_t cache_max_bytes = GEOM_CACHE_DEFAULT_SIZE;
+
+static uint64_t n_hits = 0;
+static uint64_t n_misses = 0;
+static uint64_t n_evicted = 0;
+static uint64_t n_prefetched = 0;
+static uint64_t n_prefetch_hits = 0;
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*A type independent view of one of the lists in the layer buffers*/
+typedef struct
+{
+    void *list;
+    size_t used;
+    size_t elem_size;
+    int rebase; // the slot the values are indexes into, -1 if the values are not indexes
+} GC_LIST_VIEW;
+
+static int list_view(LAYER_RUNTIME *l, int slot, GC_LIST_VIEW *v)
+{
+    v->list = NULL;
+    v->used = 0;
+    v->rebase = -1;
+
+    switch(slot)
+    {
+    case GC_TWKB_ID:
+        if(!l->twkb_id)
+            return 0;
+        v->list = l->twkb_id->list;
+        v->used = l->twkb_id->used;
+        v->elem_size = sizeof(int64_t);
+        return 1;
+    case GC_POINTS:
+    case GC_POINT_START:
+    case GC_POINT_STYLE:
+        if(!l->points)
+            return 0;
+        if(slot == GC_POINTS)
+        {
+            v->list = l->points->points->list;
+            v->used = l->points->points->used;
+            v->elem_size = sizeof(GLfloat);
+        }
+        else if(slot == GC_POINT_START)
+        {
+            v->list = l->points->point_start_indexes->list;
+            v->used = l->points->point_start_indexes->used;
+            v->elem_size = sizeof(GLuint);
+            v->rebase = GC_POINTS;
+        }
+        else
+        {
+            v->list = l->points->style_id->list;
+            v->used = l->points->style_id->used;
+            v->elem_size = sizeof(void*);
+        }
+        return 1;
+    case GC_LINES:
+    case GC_LINE_START:
+    case GC_LINE_STYLE:
+    case GC_WIDE_LINES:
+    case GC_WIDE_LINE_START:
+    case GC_WIDE_LINE_STYLE:
+    {
+        int wide = slot >= GC_WIDE_LINES;
+        LINESTRING_LIST *ll = wide ? l->wide_lines : l->lines;
+        if(!ll)
+            return 0;
+        slot -= wide ? GC_WIDE_LINES : GC_LINES;
+        if(slot == 0)
+        {
+            v->list = ll->vertex_array->list;
+            v->used = ll->vertex_array->used;
+            v->elem_size = sizeof(GLfloat);
+        }
+        else if(slot == 1)
+        {
+            v->list = ll->line_start_indexes->list;
+            v->used = ll->line_start_indexes->used;
+            v->elem_size = sizeof(GLuint);
+            v->rebase = wide ? GC_WIDE_LINES : GC_LINES;
+        }
+        else
+        {
+            v->list = ll->style_id->list;
+            v->used = ll->style_id->used;
+            v->elem_size = sizeof(void*);
+        }
+        return 1;
+    }
+    default:
+        break;
+    }
+
+    POLYGON_LIST *p = l->polygons;
+    if(!p)
+        return 0;
+    switch(slot)
+    {
+    case GC_POLY_VERTEX:
+        v->list = p->vertex_array->list;
+        v->used = p->vertex_array->used;
+        v->elem_size = sizeof(GLfloat);
+        return 1;
+    case GC_POLY_PA_START:
+        v->list = p->pa_start_indexes->list;
+        v->used = p->pa_start_indexes->used;
+        v->elem_size = sizeof(GLuint);
+        v->rebase = GC_POLY_VERTEX;
+        return 1;
+    case GC_POLY_START:
+        v->list = p->polygon_start_indexes->list;
+        v->used = p->polygon_start_indexes->used;
+        v->elem_size = sizeof(GLuint);
+        v->rebase = GC_POLY_VERTEX;
+        return 1;
+    case GC_POLY_ELEMENTS:
+        /*The element values are relative to the polygon so they are not rebased*/
+        v->list = p->element_array->list;
+        v->used = p->element_array->used;
+        v->elem_size = sizeof(GLuint);
+        return 1;
+    case GC_POLY_ELEMENT_START:
+        v->list = p->element_start_indexes->list;
+        v->used = p->element_start_indexes->used;
+        v->elem_size = sizeof(GLuint);
+        v->rebase = GC_POLY_ELEMENTS;
+        return 1;
+    case GC_POLY_STYLE:
+        v->list = p->style_id->list;
+        v->used = p->style_id->used;
+        v->elem_size = sizeof(void*);
+        return 1;
+    case GC_POLY_LINE_STYLE:
+        v->list = p->line_style_id->list;
+        v->used = p->line_style_id->used;
+        v->elem_size = sizeof(void*);
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/*Append a cached slice to the right list of the layer*/
+static void list_append(LAYER_RUNTIME *l, int slot, void *vals, GLuint n)
+{
+    switch(slot)
+    {
+    case GC_TWKB_ID:
+        addbatch2int64_list(l->twkb_id, n, (int64_t*) vals);
+        break;
+    case GC_POINTS:
+        addbatch2glfloat_list(l->points->points, n, (GLfloat*) vals);
+        break;
+    case GC_POINT_START:
+        addbatch2gluint_list(l->points->point_start_indexes, n, (GLuint*) vals);
+        break;
+    case GC_POINT_STYLE:
+        addbatch2pointer_list(l->points->style_id, n, vals);
+        break;
+    case GC_LINES:
+        addbatch2glfloat_list(l->lines->vertex_array, n, (GLfloat*) vals);
+        break;
+    case GC_LINE_START:
+        addbatch2gluint_list(l->lines->line_start_indexes, n, (GLuint*) vals);
+        break;
+    case GC_LINE_STYLE:
+        addbatch2pointer_list(l->lines->style_id, n, vals);
+        break;
+    case GC_WIDE_LINES:
+        addbatch2glfloat_list(l->wide_lines->vertex_array, n, (GLfloat*) vals);
+        break;
+    case GC_WIDE_LINE_START:
+        addbatch2gluint_list(l->wide_lines->line_start_indexes, n, (GLuint*) vals);
+        break;
+    case GC_WIDE_LINE_STYLE:
+        addbatch2pointer_list(l->wide_lines->style_id, n, vals);
+        break;
+    case GC_POLY_VERTEX:
+        addbatch2glfloat_list(l->polygons->vertex_array, n, (GLfloat*) vals);
+        break;
+    case GC_POLY_PA_START:
+        addbatch2gluint_list(l->polygons->pa_start_indexes, n, (GLuint*) vals);
+        break;
+    case GC_POLY_START:
+        addbatch2gluint_list(l->polygons->polygon_start_indexes, n, (GLuint*) vals);
+        break;
+    case GC_POLY_ELEMENTS:
+        addbatch2gluint_list(l->polygons->element_array, n, (GLuint*) vals);
+        break;
+    case GC_POLY_ELEMENT_START:
+        addbatch2gluint_list(l->polygons->element_start_indexes, n, (GLuint*) vals);
+        break;
+    case GC_POLY_STYLE:
+        addbatch2pointer_list(l->polygons->style_id, n, vals);
+        break;
+    case GC_POLY_LINE_STYLE:
+        addbatch2pointer_list(l->polygons->line_style_id, n, vals);
+        break;
+    }
+}
+
+static void set_key(GEOM_CACHE_KEY *key, LAYER_RUNTIME *l, int64_t id)
+{
+    /*The key is hashed as raw memory, so no garbage in padding*/
+    memset(key, 0, sizeof(GEOM_CACHE_KEY));
+    key->layer = l->prefetch_for ? l->prefetch_for : l;
+    key->id = id;
+    /*Features the shaders reproject are stored in the layer's own zone*/
+    key->utm_zone = l->gpu_reproject ? l->utm_zone : curr_utm;
+    key->hemisphere = l->gpu_reproject ? l->hemisphere : curr_hemi;
+    key->decimate_tol = l->decimate_tol;
+    key->geom_level = l->geom_level;
+    /*The reprojection grid is only accurate to a fraction of a pixel at the zoom it was built for,
+     * so what is interpolated from it is only reused within a factor 2 of that zoom*/
+    if(!l->gpu_reproject && l->reproj_grid.valid && l->loaded_mpp > 0)
+    {
+        int e;
+        frexpf(l->loaded_mpp, &e);
+        key->reproj_mpp = ldexpf(1, e);
+    }
+}
+
+static void free_entry(GEOM_CACHE_ENTRY *e)
+{
+    HASH_DEL(cache, e);
+    cache_bytes -= e->bytes;
+    if(e->refs)
+        e->dropped = 1;
+    else
+        st_free(e);
+}
+
+/*Drop the least recently used entries until we are below max_bytes*/
+static void evict(size_t max_bytes)
+{
+    GEOM_CACHE_ENTRY *e, *tmp;
+    HASH_ITER(hh, cache, e, tmp)
+    {
+        if(cache_bytes <= max_bytes)
+            break;
+        free_entry(e);
+        n_evicted++;
+    }
+}
+
+/**
+ * Register how far the layer buffers are filled before decoding a feature
+ */
+int geom_cache_mark(LAYER_RUNTIME *l, GEOM_CACHE_MARK *mark)
+{
+    int i;
+    GC_LIST_VIEW v;
+    for (i=0; i<GC_NSLOTS; i++)
+    {
+        list_view(l, i, &v);
+        mark->used[i] = v.used;
+    }
+    return 0;
+}
+
+/**
+ * Append a feature from the cache to the layer buffers.
+ * Returns 1 on a hit, 0 if the feature has to be decoded.
+ * For the prefetcher nothing is appended, it only needs to know that the feature is there
+ */
+int geom_cache_get(LAYER_RUNTIME *l, int64_t id)
+{
+    GEOM_CACHE_KEY key;
+    GEOM_CACHE_ENTRY *e = NULL;
+    GEOM_CACHE_MARK base;
+    GC_LIST_VIEW v;
+    size_t k;
+    int i;
+
+    set_key(&key, l, id);
+
+    pthread_mutex_lock(&cache_mutex);
+    HASH_FIND(hh, cache, &key, sizeof(GEOM_CACHE_KEY), e);
+    if(!e)
+    {
+        if(!l->prefetch_for)
+            n_misses++;
+        pthread_mutex_unlock(&cache_mutex);
+        return 0;
+    }
+
+    /*Move it last, to mark it as most recently used*/
+    HASH_DEL(cache, e);
+    HASH_ADD(hh, cache, key, sizeof(GEOM_CACHE_KEY), e);
+
+    if(l->prefetch_for)
+    {
+        pthread_mutex_unlock(&cache_mutex);
+        return 1;
+    }
+    n_hits++;
+    if(e->prefetched)
+    {
+        n_prefetch_hits++;
+        e->prefetched = 0;
+    }
+    /*The slices are never changed after put, so they can be read without the lock as long as the entry is pinned*/
+    e->refs++;
+    pthread_mutex_unlock(&cache_mutex);
+
+    geom_cache_mark(l, &base);
+    for (i=0; i<GC_NSLOTS; i++)
+    {
+        if(!e->n[i] || !list_view(l, i, &v))
+            continue;
+        list_append(l, i, e->data[i], (GLuint) e->n[i]);
+
+        /*Indexes get the start of the feature in the buffers added back*/
+        if(v.rebase >= 0)
+        {
+            int rebase = v.rebase;
+            list_view(l, i, &v);
+            GLuint *vals = ((GLuint*) v.list) + base.used[i];
+            for (k=0; k<e->n[i]; k++)
+                vals[k] += (GLuint) base.used[rebase];
+        }
+    }
+
+    pthread_mutex_lock(&cache_mutex);
+    e->refs--;
+    if(!e->refs && e->dropped)
+        st_free(e);
+    pthread_mutex_unlock(&cache_mutex);
+    return 1;
+}
+
+/**
+ * Copy what a feature added to the layer buffers since mark to the cache
+ */
+int geom_cache_put(LAYER_RUNTIME *l, int64_t id, GEOM_CACHE_MARK *mark)
+{
+    GEOM_CACHE_ENTRY *e = NULL;
+    GC_LIST_VIEW v;
+    size_t n[GC_NSLOTS];
+    size_t offset[GC_NSLOTS];
+    size_t bytes = sizeof(GEOM_CACHE_ENTRY);
+    size_t k;
+    int i;
+
+    if(!cache_max_bytes)
+        return 0;
+
+    for (i=0; i<GC_NSLOTS; i++)
+    {
+        n[i] = 0;
+        offset[i] = bytes;
+        if(!list_view(l, i, &v) || v.used <= mark->used[i])
+            continue;
+        n[i] = v.used - mark->used[i];
+        /*keep every slice 8 byte aligned*/
+        bytes += (n[i] * v.elem_size + 7) & ~((size_t) 7);
+    }
+    if(bytes > cache_max_bytes / 4)
+        return 0;
+
+    e = st_malloc(bytes);
+    set_key(&(e->key), l, id);
+    e->bytes = bytes;
+    e->prefetched = l->prefetch_for != NULL;
+    e->dropped = 0;
+    e->refs = 0;
+
+    for (i=0; i<GC_NSLOTS; i++)
+    {
+        e->n[i] = n[i];
+        e->data[i] = NULL;
+        if(!n[i])
+            continue;
+        list_view(l, i, &v);
+        e->data[i] = (uint8_t*) e + offset[i];
+        memcpy(e->data[i], (uint8_t*) v.list + mark->used[i] * v.elem_size, n[i] * v.elem_size);
+
+        /*Store indexes relative to the start of the feature*/
+        if(v.rebase >= 0)
+        {
+            GLuint *vals = (GLuint*) e->data[i];
+            for (k=0; k<n[i]; k++)
+                vals[k] -= (GLuint) mark->used[v.rebase];
+        }
+    }
+
+    pthread_mutex_lock(&cache_mutex);
+    GEOM_CACHE_ENTRY *old = NULL;
+    HASH_FIND(hh, cache, &(e->key), sizeof(GEOM_CACHE_KEY), old);
+    if(old)
+        free_entry(old);
+    HASH_ADD(hh, cache, key, sizeof(GEOM_CACHE_KEY), e);
+    cache_bytes += bytes;
+    if(e->prefetched)
+        n_prefetched++;
+    evict(cache_max_bytes);
+    pthread_mutex_unlock(&cache_mutex);
+    return 0;
+}
+
+void geom_cache_clear()
+{
+    pthread_mutex_lock(&cache_mutex);
+    evict(0);
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+
+/**
+ * Set upper limit of memory used for cached geometries. 0 turns the cache off
+ */
+extern void TLM_set_geom_cache_size(size_t max_bytes)
+{
+    pthread_mutex_lock(&cache_mutex);
+    cache_max_bytes = max_bytes;
+    evict(cache_max_bytes);
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+extern void TLM_get_geom_cache_stats(TLM_CACHE_STATS *stats)
+{
+    pthread_mutex_lock(&cache_mutex);
+    stats->hits = n_hits;
+    stats->misses = n_misses;
+    stats->evicted = n_evicted;
+    stats->entries = HASH_COUNT(cache);
+    stats->bytes = cache_bytes;
+    stats->max_bytes = cache_max_bytes;
+    stats->prefetched = n_prefetched;
+    stats->prefetch_hits = n_prefetch_hits;
+    pthread_mutex_unlock(&cache_mutex);
+}
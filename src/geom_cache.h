@@ -0,0 +1,92 @@
+/**********************************************************************
+ *
+ * TileLessMap
+ *
+ * TileLessMap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * TileLessMap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TileLessMap.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **********************************************************************
+ *
+ * Copyright (C) 2016-2018 Nicklas Avén
+ *
+ ***********************************************************************/
+#ifndef _geom_cache_H
+#define _geom_cache_H
+
+#include "structures.h"
+
+/*Default upper limit of memory used by the cache. Can be changed with TLM_set_geom_cache_size*/
+#define GEOM_CACHE_DEFAULT_SIZE (32*1024*1024)
+
+/*The buffers of a layer a decoded feature can write to.
+ * Every slot is stored as a separate slice in the cache entry*/
+#define GC_TWKB_ID 0
+#define GC_POINTS 1
+#define GC_POINT_START 2
+#define GC_POINT_STYLE 3
+#define GC_LINES 4
+#define GC_LINE_START 5
+#define GC_LINE_STYLE 6
+#define GC_WIDE_LINES 7
+#define GC_WIDE_LINE_START 8
+#define GC_WIDE_LINE_STYLE 9
+#define GC_POLY_VERTEX 10
+#define GC_POLY_PA_START 11
+#define GC_POLY_START 12
+#define GC_POLY_ELEMENTS 13
+#define GC_POLY_ELEMENT_START 14
+#define GC_POLY_STYLE 15
+#define GC_POLY_LINE_STYLE 16
+#define GC_NSLOTS 17
+
+typedef struct
+{
+    LAYER_RUNTIME *layer;
+    int64_t id;
+    int32_t utm_zone;
+    int32_t hemisphere;
+    GLfloat decimate_tol; // the same feature is cached once per decimation tolerance
+    int32_t geom_level; // and once per level of detail
+    GLfloat reproj_mpp; // the power of 2 above the meter per pixel of the reprojection grid used, 0 if reprojected without grid
+} GEOM_CACHE_KEY;
+
+/**
+ * One decoded feature. The slices are what the feature appended to each buffer of the layer.
+ * Start indexes are stored relative to the start of the feature so they can be
+ * appended anywhere in the buffers again
+ */
+typedef struct
+{
+    GEOM_CACHE_KEY key;
+    size_t n[GC_NSLOTS];
+    void *data[GC_NSLOTS];
+    size_t bytes;
+    uint8_t prefetched; // put by the prefetcher and not used since
+    uint8_t dropped; // removed from the cache while pinned, freed when the last reader is done
+    int refs; // readers appending from it outside the lock
+    UT_hash_handle hh;
+} GEOM_CACHE_ENTRY;
+
+/*How far the buffers of a layer was filled before decoding a feature*/
+typedef struct
+{
+    size_t used[GC_NSLOTS];
+} GEOM_CACHE_MARK;
+
+
+int geom_cache_mark(LAYER_RUNTIME *l, GEOM_CACHE_MARK *mark);
+int geom_cache_get(LAYER_RUNTIME *l, int64_t id);
+int geom_cache_put(LAYER_RUNTIME *l, int64_t id, GEOM_CACHE_MARK *mark);
+void geom_cache_clear();
+
+#endif
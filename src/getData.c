@@ -25,22 +25,147 @@
 #include "theclient.h"
 #include "interface/interface.h"
 #include "buffer_handling.h"
+#include "fetch_pool.h"
+#include "prefetch.h"
+#include "stats.h"
+#include "utils.h"
+#include "tilelessmap.h"
 
 
+/*How many times the view area the fetched extent may grow to before
+ * the layer is reset and loaded from scratch. That is how features far
+ * outside the view gets evicted*/
+#define MAX_INCREMENTAL_EXTENT 9
 
-int get_data(SDL_Window* window,MATRIX *map_matrix,struct CTRL *controls)
+/*How long request_data waits for the layers before the first frame is shown, in ms*/
+#define FIRST_FRAME_BUDGET_MS 16
+
+
+static int draw_frame(SDL_Window* window,MATRIX *map_matrix,struct CTRL *controls, int wait);
+
+static GLfloat box_area(GLfloat *box)
 {
+    return (box[2] - box[0]) * (box[3] - box[1]);
+}
 
+static void set_box(GLfloat *box, GLfloat minx, GLfloat miny, GLfloat maxx, GLfloat maxy)
+{
+    box[0] = minx;
+    box[1] = miny;
+    box[2] = maxx;
+    box[3] = maxy;
+}
 
-#ifndef _WIN32
-    gettimeofday(&tval_before, NULL);
-#endif
-    log_this(10, "Entering get_data\n");
-    int i,t, rc;
-    pthread_t threads[255];
+/*The share of the view size fetched outside the view on every side, for the layer's class*/
+static GLfloat layer_overscan(LAYER_RUNTIME *l)
+{
+    if(l->geometryType == RASTER)
+        return overscan[TLM_OVERSCAN_RASTER];
+    if(l->type & 224)
+        return overscan[TLM_OVERSCAN_POINTS];
+    if(l->type & 24)
+        return overscan[TLM_OVERSCAN_LINES];
+    return overscan[TLM_OVERSCAN_POLYGONS];
+}
+
+/*The view expanded with the layer's overscan. The prefetcher uses the same for the views it predicts*/
+void layer_fetch_box(LAYER_RUNTIME *l, GLfloat *bbox, GLfloat *box)
+{
+    GLfloat f = layer_overscan(l);
+    GLfloat dx = f * (bbox[2] - bbox[0]);
+    GLfloat dy = f * (bbox[3] - bbox[1]);
+    set_box(box, bbox[0] - dx, bbox[1] - dy, bbox[2] + dx, bbox[3] + dy);
+}
+
+/**
+ * Check if a layer can be loaded incrementally for the new view.
+ * That is possible if we are on the same zoom as last time and the new view
+ * overlaps the area we know is loaded. Then only the strips of fbox, the view
+ * with overscan, that are not loaded are put in fetch_boxes.
+ * If the view is inside the loaded area there is nothing to fetch.
+ * Returns 0 if the layer has to be reset and loaded from scratch
+ */
+static int plan_incremental(LAYER_RUNTIME *l, GLfloat *bbox, GLfloat *fbox, GLfloat meterPerPixel)
+{
+    GLfloat *lb = l->loaded_bbox;
+    GLfloat extent[4];
+    GLfloat cx0, cx1;
+
+    l->n_fetch_boxes = 0;
+
+    if(l->loaded_mpp <= 0)
+        return 0;
+
+    if(fabs(l->loaded_mpp - meterPerPixel) > SAME_ZOOM_TOLERANCE * meterPerPixel)
+        return 0;
+
+    /*The buffers can't mix features from two levels of detail*/
+    if(geom_level(l, meterPerPixel) != l->geom_level)
+        return 0;
+
+    /*Nor features reprojected when decoding with features the shaders reproject*/
+    if(gpu_reproject(l, bbox, meterPerPixel) != l->gpu_reproject)
+        return 0;
+
+    /*Still inside what the overscan has loaded, the loaded area is kept as it is*/
+    if(bbox[0] >= lb[0] && bbox[2] <= lb[2] && bbox[1] >= lb[1] && bbox[3] <= lb[3])
+        return 1;
+
+    if(!incremental_loading)
+        return 0;
+
+    /*No overlap, nothing to gain*/
+    if(fbox[0] >= lb[2] || fbox[2] <= lb[0] || fbox[1] >= lb[3] || fbox[3] <= lb[1])
+        return 0;
+
+    set_box(extent, min_f(fbox[0], l->fetched_extent[0]), min_f(fbox[1], l->fetched_extent[1]),
+            max_f(fbox[2], l->fetched_extent[2]), max_f(fbox[3], l->fetched_extent[3]));
+
+    if(box_area(extent) > MAX_INCREMENTAL_EXTENT * box_area(fbox))
+        return 0;
+
+    /*The new view with overscan minus the loaded area, as max 4 non overlapping strips*/
+    if(fbox[0] < lb[0])
+        set_box(l->fetch_boxes[l->n_fetch_boxes++], fbox[0], fbox[1], lb[0], fbox[3]);
+    if(fbox[2] > lb[2])
+        set_box(l->fetch_boxes[l->n_fetch_boxes++], lb[2], fbox[1], fbox[2], fbox[3]);
+
+    cx0 = max_f(fbox[0], lb[0]);
+    cx1 = min_f(fbox[2], lb[2]);
+
+    if(fbox[1] < lb[1])
+        set_box(l->fetch_boxes[l->n_fetch_boxes++], cx0, fbox[1], cx1, lb[1]);
+    if(fbox[3] > lb[3])
+        set_box(l->fetch_boxes[l->n_fetch_boxes++], cx0, lb[3], cx1, fbox[3]);
+
+    /*We only know for sure that the new view with overscan is complete. What is left from the old view
+     * will just be skipped by id if it shows up again*/
+    memcpy(l->loaded_bbox, fbox, 4 * sizeof(GLfloat));
+    memcpy(l->fetched_extent, extent, 4 * sizeof(GLfloat));
+    return 1;
+}
+
+static void reset_layer(LAYER_RUNTIME *l)
+{
+    reset_buffers(l);
+    if(l->type & 32)
+    {
+        text_reset_buffer(l->text);
+        reset_textblock(l->text->tb);
+    }
+}
+
+/*Plan and submit the fetching of all visible layers for the view. With want_event the main loop is told when they are fetched*/
+static void fetch_layers(MATRIX *map_matrix, int want_event)
+{
+    int i;
     LAYER_RUNTIME *oneLayer;
     GLfloat meterPerPixel = (map_matrix->bbox[3]-map_matrix->bbox[1])/CURR_HEIGHT;
-    uint8_t type;
+    GLfloat fbox[4];
+
+    /*Fetches still running for an earlier view are aborted, and so is the prefetching*/
+    fetch_pool_new_generation();
+    prefetch_note_view(map_matrix->bbox, meterPerPixel);
 
     for (i=0; i<global_layers->nlayers; i++)
     {
@@ -48,29 +173,106 @@ int get_data(SDL_Window* window,MATRIX *map_matrix,struct CTRL *controls)
         oneLayer = global_layers->layers + i;
         //   if(oneLayer->geometryType >= RASTER)
         //     continue;
-        type = oneLayer->type;
-        reset_buffers(oneLayer);
-        //   reset_buffer(oneLayer->res_buf);
-        /*    if(oneLayer->geometryType == POLYGONTYPE)
-                element_reset_buffer(oneLayer->tri_index);
-        */
-        if(type & 32)
-            text_reset_buffer(oneLayer->text);
 
         if(oneLayer->visible && oneLayer->minScale<=meterPerPixel && oneLayer->maxScale>meterPerPixel)
         {
+            /*The buffers can't be touched until the worker has let go of them. A layer still busy
+             * is always fetched again, since a fetch for an old view leaves it as not loaded*/
+            fetch_pool_wait(oneLayer);
+
             //  log_this(10, "decode nr %d\n", i);
-            oneLayer->BBOX = map_matrix->bbox;
+            /*The layer's own copy of the view, since the map matrix changes while the layer is fetched*/
+            oneLayer->BBOX = oneLayer->loaded_bbox;
+
+            layer_fetch_box(oneLayer, map_matrix->bbox, fbox);
+            if(plan_incremental(oneLayer, map_matrix->bbox, fbox, meterPerPixel))
+            {
+                /*The view is inside what is already loaded*/
+                if(!oneLayer->n_fetch_boxes)
+                    continue;
+            }
+            else
+            {
+                reset_layer(oneLayer);
+                memcpy(oneLayer->loaded_bbox, fbox, 4 * sizeof(GLfloat));
+                memcpy(oneLayer->fetched_extent, fbox, 4 * sizeof(GLfloat));
+            }
+            oneLayer->loaded_mpp = meterPerPixel;
+            oneLayer->geom_level = geom_level(oneLayer, meterPerPixel);
+            oneLayer->gpu_reproject = gpu_reproject(oneLayer, map_matrix->bbox, meterPerPixel);
 
-#if THREADING >0
-            pthread_create(&threads[i], NULL, twkb_fromSQLiteBBOX_thread, (void *) oneLayer);
-#else
-            twkb_fromSQLiteBBOX((void *) oneLayer);
-#endif
-            
-            
+            /*Without a running fetch pool this fetches the layer right away*/
+            fetch_pool_submit(oneLayer);
         }
+        /*A layer not in the view is not waited for, it is reset when it is asked for again*/
+        else if(!fetch_pool_collect(oneLayer, NULL))
+            reset_layer(oneLayer);
     }
+    fetch_pool_end_generation(want_event);
+}
+
+/**
+ * Fetch the layers for the view, and render them when they are fetched.
+ * Blocks until the frame is rendered
+ */
+int get_data(SDL_Window* window,MATRIX *map_matrix,struct CTRL *controls)
+{
+    stats_begin_frame();
+    log_this(10, "Entering get_data\n");
+    fetch_layers(map_matrix, 0);
+    return show_data(window, map_matrix, controls);
+}
+
+/**
+ * Start fetching the layers for the view without blocking the main loop.
+ * What is fetched within FIRST_FRAME_BUDGET_MS is shown right away, and
+ * show_progress is called from the main loop every time the fetch pool has
+ * fetched another layer. A new request before that aborts this one.
+ * Without a fetch pool this is the same as get_data
+ */
+int request_data(SDL_Window* window,MATRIX *map_matrix,struct CTRL *controls)
+{
+    if(!fetch_pool_active())
+        return get_data(window, map_matrix, controls);
+
+    stats_begin_frame();
+    log_this(10, "Entering request_data\n");
+    fetch_layers(map_matrix, 1);
+    fetch_pool_wait_all(FIRST_FRAME_BUDGET_MS);
+    return show_progress(window, map_matrix, controls);
+}
+
+/**
+ * Show the layers fetched so far. The layers still being fetched are left out,
+ * the rest are rendered in order from what is already uploaded, so the
+ * compositing is the same as when all are there.
+ * Without progressive rendering nothing is shown until all layers are fetched
+ */
+int show_progress(SDL_Window* window,MATRIX *map_matrix,struct CTRL *controls)
+{
+    if(!progressive_rendering && fetch_pool_pending())
+        return 0;
+    draw_frame(window, map_matrix, controls, 0);
+    return 0;
+}
+
+/*Upload and render the layers fetched for the view, waiting for any layer still fetched*/
+int show_data(SDL_Window* window,MATRIX *map_matrix,struct CTRL *controls)
+{
+    draw_frame(window, map_matrix, controls, 1);
+    return 0;
+}
+
+/**
+ * Upload and render the visible layers. With wait we wait for layers still
+ * being fetched, else they are skipped. Returns the number of skipped layers
+ */
+static int draw_frame(SDL_Window* window,MATRIX *map_matrix,struct CTRL *controls, int wait)
+{
+    int t, n_skipped = 0;
+    LAYER_RUNTIME *oneLayer;
+    GLfloat meterPerPixel = (map_matrix->bbox[3]-map_matrix->bbox[1])/CURR_HEIGHT;
+    uint8_t type;
 
     glClearColor(1.0, 1.0, 1.0, 1.0);
     glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
@@ -99,20 +301,22 @@ int get_data(SDL_Window* window,MATRIX *map_matrix,struct CTRL *controls)
         if(oneLayer->visible && oneLayer->minScale<=meterPerPixel && oneLayer->maxScale>meterPerPixel)
         {
             
-#if THREADING >0
-            rc = pthread_join(threads[t], NULL);
-#else
-            rc = 0;
-#endif
+            /*Layers are rendered in order, so we wait for this one even if later layers are finished*/
+            if(wait)
+                fetch_pool_wait(oneLayer);
+            else if(fetch_pool_collect(oneLayer, NULL))
+            {
+                n_skipped++;
+                continue;
+            }
+
+            stats_begin_layer(oneLayer);
+            update_reproj_poly(oneLayer, map_matrix->bbox);
             if(oneLayer->geometryType >= RASTER)
                 // loadRaster( oneLayer, map_matrix->matrix);
                 loadandRenderRaster( oneLayer, map_matrix->matrix);
             //           continue;
 
-            if (rc) {
-                printf("ERROR; return code from pthread_join() is %d\n", rc);
-                exit(-1);
-            }
             if(type & 224)
                 loadPoint( oneLayer, map_matrix->matrix);
 
@@ -121,6 +325,7 @@ int get_data(SDL_Window* window,MATRIX *map_matrix,struct CTRL *controls)
             if(type & 6)
                 loadPolygon( oneLayer, map_matrix->matrix);
 
+            stats_end_layer(oneLayer);
             
     while ((err = glGetError()) != GL_NO_ERROR) {
 fprintf(stderr,"0 - opengl error:%d in func %s layer %s\n", err, __func__,oneLayer->name);
@@ -136,13 +341,9 @@ fprintf(stderr,"0 - opengl error:%d in func %s layer %s\n", err, __func__,oneLay
     render_controls(controls, NULL);
 
 
-
-#ifndef _WIN32
-    gettimeofday(&tval_after, NULL);
-
-   // timersub(&tval_after, &tval_before, &tval_result);
-//   print_txt(10,80,200,0,0,255,1, "time used in seconds: %ld.%06ld", (long int)tval_result.tv_sec, (long int)tval_result.tv_usec);
-#endif
+    /*The frame is only complete when all layers are there*/
+    if(!n_skipped)
+        stats_end_frame();
 
     total_points=0;
 
@@ -150,7 +351,19 @@ fprintf(stderr,"0 - opengl error:%d in func %s layer %s\n", err, __func__,oneLay
     SDL_GL_SwapWindow(window);
 
 //render(window,res_buf);
-    return 0;
+    return n_skipped;
+}
+
+extern void TLM_set_progressive_rendering(int enabled)
+{
+    progressive_rendering = enabled;
+}
+
+extern void TLM_set_overscan(int layer_class, float share)
+{
+    if(layer_class < 0 || layer_class >= N_OVERSCAN_CLASSES)
+        return;
+    overscan[layer_class] = share > 0 ? share : 0;
 }
 
 
@@ -28,6 +28,7 @@
 #include "text.h"
 #include "interface/interface.h"
 #include "utils.h"
+#include "connections.h"
 
 
 static int printinfo(LAYER_RUNTIME *theLayer,uint64_t twkb_id)
@@ -90,10 +91,18 @@ int max_width = 1000;
 
     sqlite3_reset(prepared_info);
                 check_sql(layer_info_sql->txt);
-    rc = sqlite3_prepare_v2(projectDB, layer_info_sql->txt, -1,&prepared_layer_info, 0);
+    /*The info relation is looked for in the layer's db first and then in the project db.
+    Other data dbs it uses are attached to the layer's connection the first time*/
+    sqlite3 *db = layer_db(theLayer);
+    if(db && theLayer->info_rel)
+        attach_data_dbs(db, theLayer->info_rel);
+    rc = db ? sqlite3_prepare_v2(db, layer_info_sql->txt, -1,&prepared_layer_info, 0) : SQLITE_ERROR;
+    if (rc != SQLITE_OK && theLayer->info_rel)
+        rc = sqlite3_prepare_v2(projectDB, layer_info_sql->txt, -1,&prepared_layer_info, 0);
     if (rc != SQLITE_OK ) {
         log_this(100, "SQL error in %s\n",layer_info_sql->txt );
-        sqlite3_close(projectDB);
+        sqlite3_finalize(prepared_info);
+        destroy_txt(layer_info_sql);
         return 1;
     }
 
@@ -322,7 +331,7 @@ int identify(MATRIX *map_matrix, int x, int y)
 
                             n_elements = *(poly->element_start_indexes->list + poly_n) - n_elements_acc;
 
-                            addbatch2glushort_list(renderpoly->element_array, n_elements, poly->element_array->list + n_elements_acc); //memcpy all vertexes in polygon
+                            addbatch2gluint_list(renderpoly->element_array, n_elements, poly->element_array->list + n_elements_acc); //memcpy all vertexes in polygon
                             add2gluint_list(renderpoly->element_start_indexes, renderpoly->element_array->used); //register start of new polygon to render
 
                             printinfo(theLayer,id);
@@ -29,6 +29,10 @@
 #include "cleanup.h"
 #include "event_loop.h"
 #include "tilelessmap.h"
+#include "fetch_pool.h"
+#include "raster_decode.h"
+#include "prefetch.h"
+#include "trace.h"
 
 static SDL_Window* window;
 static SDL_GLContext context;
@@ -117,7 +121,15 @@ if (res) {
         fprintf(stderr, "Error: your graphic card does not support OpenGL 2.0");
         return EXIT_FAILURE;
     }
+    /*Desktop OpenGL always handles 32 bit element indexes*/
+    have_uint_elements = 1;
+    have_timer_query = GLEW_ARB_timer_query ? 1 : 0;
+#else
+    const char *extensions = (const char*) glGetString(GL_EXTENSIONS);
+    have_uint_elements = extensions && strstr(extensions, "GL_OES_element_index_uint") ? 1 : 0;
+    have_timer_query = 0;
 #endif
+    log_this(100, "32 bit element indexes: %s\n", have_uint_elements ? "yes" : "no");
 return 0;
 }
 
@@ -160,6 +172,11 @@ extern int TLM_init_db(const char *f,const char *dir)
 
     if (init_resources(dir))
         return EXIT_FAILURE;
+
+    /*The workers copies the layers prepared statements, so this has to be done after init_resources*/
+    init_fetch_pool();
+    init_raster_decode();
+    init_prefetch();
     init_success = 1;
     return EXIT_SUCCESS;
 }
@@ -172,6 +189,7 @@ extern void TLM_start(struct CTRL *controls)
 
 extern void TLM_close()
 {
+    trace_stop();
     free_resources(window, context);
 }
 
@@ -29,61 +29,8 @@
 #include "mem.h"
 #include "theclient.h"
 #include "utils.h"
-/********************************************************************************
-  Attach all databases with data for the project
-*/
-static int attach_db(const char *dir, TEXT *missing_db)
-{
-
-    int rc;
-    char *err_msg;
-    sqlite3_stmt *preparedDb2Attach;
-    char sql[2048];
-    char *sqlDb2Attach = " select distinct d.source, d.name from dbs d inner join layers l on d.name=l.source;";
-    check_sql(sqlDb2Attach);
-    rc = sqlite3_prepare_v2(projectDB, sqlDb2Attach, -1, &preparedDb2Attach, 0);
-    if (rc != SQLITE_OK ) {
-        log_this(1, "SQL error in %s\n",sqlDb2Attach );
-        sqlite3_close(projectDB);
-        return 1;
-    }
-
-    while(sqlite3_step(preparedDb2Attach)==SQLITE_ROW)
-    {
-
-        const unsigned char *dbsource = sqlite3_column_text(preparedDb2Attach, 0);
-        const unsigned char * dbname= sqlite3_column_text(preparedDb2Attach, 1);
-        char sqlAttachDb[128];
-		if(dir)
-	        snprintf(sqlAttachDb,sizeof(sql), "ATTACH '%s//%s' AS %s;", dir, dbsource, dbname);
-		else
-			snprintf(sqlAttachDb, sizeof(sql), "ATTACH '%s' AS %s;", dbsource, dbname);
-		log_this(10, "attachsql = %s\n",sqlAttachDb );
-        
-        check_sql(sqlAttachDb);
-        rc = sqlite3_exec(projectDB,sqlAttachDb,NULL, NULL, &err_msg);
-        if (rc != 0)
-        {
-            log_this(90, "failed to load db: %s. rc = %d errcode = %s, sql = %s\n",dbsource, rc,err_msg, sqlAttachDb);
-
-            if(missing_db->used)
-                add_txt(missing_db, ",");
-
-            add_txt(missing_db, "'");
-            add_txt(missing_db,(const char*) dbname);
-            add_txt(missing_db, "'");
-
-            sqlite3_free(err_msg);
-        }
-        /* vs_source = sqlite3_column_text(preparedLayerLoading, 3);
-         fs_source = sqlite3_column_text(preparedLayerLoading, 4);*/
-    }
-    sqlite3_finalize(preparedDb2Attach);
-    return 0;
-}
-
-
-
+#include "tilelessmap.h"
+#include "connections.h"
 /********************************************************************************
     Count how many layers we are dealing with
 */
@@ -161,7 +108,88 @@ static int load_symbols()
     return 0;
 }
 #endif
-static int load_layers(TEXT *missing_db)
+/**
+ * Optional levels of detail of a layer, from the table geometry_levels in the data db:
+ * geometry_levels(layer_name, geometry_fld, tri_idx_fld, spatial_idx_fld, min_mpp, max_mpp)
+ * Every level has its own geometry and triangle fields in the layer's table and its own r-tree,
+ * joined on the same idx id as the layer's own r-tree. A level is used when the meter per pixel
+ * is from min_mpp up to max_mpp. Else the layer's own geometry is used.
+ */
+static int load_geom_levels(LAYER_RUNTIME *oneLayer, const unsigned char *dbname, const unsigned char *layername,
+                            const unsigned char *idx_idfield, const unsigned char *unique_idfield, const char *styleselect, const char *textselect)
+{
+    int rc;
+    char sql[2048];
+    sqlite3_stmt *prepared_levels;
+    GEOM_LEVEL *level;
+
+    oneLayer->n_levels = 0;
+    if(!check_layer(dbname, (const unsigned char *) "geometry_levels"))
+        return 0;
+
+    snprintf(sql, sizeof(sql), "SELECT geometry_fld, tri_idx_fld, spatial_idx_fld, min_mpp, max_mpp from %s.geometry_levels where layer_name='%s' order by min_mpp;", dbname, layername);
+    check_sql(sql);
+    rc = sqlite3_prepare_v2(layer_db(oneLayer), sql, -1, &prepared_levels, 0);
+    if (rc != SQLITE_OK ) {
+        log_this(100, "SQL error in %s\n",sql);
+        return 1;
+    }
+
+    while(sqlite3_step(prepared_levels) == SQLITE_ROW && oneLayer->n_levels < MAX_GEOM_LEVELS)
+    {
+        const unsigned char *geometryfield = sqlite3_column_text(prepared_levels, 0);
+        const unsigned char *tri_index_field = sqlite3_column_text(prepared_levels, 1);
+        const unsigned char *geometryindex = sqlite3_column_text(prepared_levels, 2);
+
+        if(!geometryfield || !geometryindex || ((oneLayer->type & 4) && !tri_index_field))
+        {
+            log_this(100, "Incomplete level of detail for layer %s\n",layername);
+            continue;
+        }
+        level = oneLayer->levels + oneLayer->n_levels;
+        level->min_mpp = (GLfloat) sqlite3_column_double(prepared_levels, 3);
+        level->max_mpp = (GLfloat) sqlite3_column_double(prepared_levels, 4);
+
+        snprintf(sql,sizeof(sql),"select e.%s, %s,e.%s,e.%s %s %s from %s.%s e inner join %s.%s ei on e.%s = ei.id where  ei.minX<? and ei.maxX>? and ei.minY<? and ei.maxY >?",
+                 geometryfield,
+                 (oneLayer->type & 4) ? (const char*) tri_index_field : "'a'",
+                 idx_idfield,
+                 unique_idfield,
+                 styleselect,
+                 textselect,
+                 dbname,
+                 layername,
+                 dbname,
+                 geometryindex,
+                 idx_idfield);
+        check_sql(sql);
+        rc = sqlite3_prepare_v2(layer_db(oneLayer), sql, -1, &(level->ps), 0);
+        log_this(10, "level sql %s\n",sql );
+        if (rc != SQLITE_OK ) {
+            log_this(100, "SQL error in %s\n",sql );
+            continue;
+        }
+        oneLayer->n_levels++;
+    }
+    sqlite3_finalize(prepared_levels);
+    return 0;
+}
+
+/*A layer that can't be used after its buffers are set up. The slot is taken by the next layer*/
+static void drop_layer(LAYER_RUNTIME *oneLayer)
+{
+    destroy_buffers(oneLayer);
+    oneLayer->points = NULL;
+    oneLayer->lines = NULL;
+    oneLayer->wide_lines = NULL;
+    oneLayer->polygons = NULL;
+    oneLayer->twkb_id = NULL;
+    oneLayer->rast = NULL;
+    oneLayer->geometryType = 0;
+    oneLayer->type = 0;
+}
+
+static int load_layers()
 {
 
 
@@ -223,10 +251,7 @@ static int load_layers(TEXT *missing_db)
     else
         sqlSel2[0] = '\0';
 
-    if(missing_db->used)
-        snprintf(sqlLayerLoading, 2048, "%s %s %s where d.name not in (%s) order by l.orderby ;",sqlLayerLoading1, sqlSel2, sqlLayerLoading2, get_txt(missing_db));
-    else
-        snprintf(sqlLayerLoading, 2048, "%s %s %s order by l.orderby ;",sqlLayerLoading1, sqlSel2, sqlLayerLoading2);
+    snprintf(sqlLayerLoading, 2048, "%s %s %s order by l.orderby ;",sqlLayerLoading1, sqlSel2, sqlLayerLoading2);
 
 
     log_this(10, "Get Layer sql : %s\n",sqlLayerLoading);
@@ -281,6 +306,7 @@ static int load_layers(TEXT *missing_db)
         strcpy(oneLayer->name,(char*) layername);
         oneLayer->db = st_malloc(2 * strlen((char*) dbname)+1);
         strcpy(oneLayer->db,(char*) dbname);
+        oneLayer->data_db = data_db_index((const char*) dbname);
 
         
         oneLayer->title = malloc(2 * strlen((char*) title)+1);
@@ -295,12 +321,14 @@ static int load_layers(TEXT *missing_db)
                 snprintf(sql, 2048, "SELECT geometry_fld,data_fld, id_fld,spatial_idx,  utm_zone, hemisphere, tilewidth, tileheight from %s.raster_columns where layer_name='%s';", dbname, layername);
 
                 check_sql(sql);
-                rc = sqlite3_prepare_v2(projectDB, sql, -1, &prepared_geo_col, 0);
+                rc = sqlite3_prepare_v2(layer_db(oneLayer), sql, -1, &prepared_geo_col, 0);
 
+                /*The data db has its own connection, a broken data db only costs its layers*/
                 if (rc != SQLITE_OK ) {
                     log_this(110, "SQL error in %s\n",sql);
-                    sqlite3_close(projectDB);
-                    return 1;
+                    log_this(100, "Cannot use layer %s",layername);
+                    sqlite3_finalize(prepared_geo_col);
+                    continue;
                 }
                 if(!(sqlite3_step(prepared_geo_col) ==  SQLITE_ROW))
                 {
@@ -326,12 +354,16 @@ static int load_layers(TEXT *missing_db)
                          geometry_fld,data_fld,idfield, idfield, dbname, layername, dbname, geometryindex, idfield);
 
                 check_sql(sql);
-                rc = sqlite3_prepare_v2(projectDB, sql, -1,&preparedLayer, 0);
+                rc = sqlite3_prepare_v2(layer_db(oneLayer), sql, -1,&preparedLayer, 0);
                 log_this(10, "sql %s\n",sql );
                 if (rc != SQLITE_OK ) {
                     log_this(100, "SQL error in %s\n",sql );
-                    sqlite3_close(projectDB);
-                    return 1;
+                    log_this(100, "Cannot use layer %s",layername);
+                    sqlite3_finalize(preparedLayer);
+                    sqlite3_finalize(prepared_geo_col);
+                    drop_layer(oneLayer);
+                    i--;
+                    continue;
                 }
                 oneLayer->n_dims = 2;
                 oneLayer->preparedStatement->ps = preparedLayer;
@@ -364,12 +396,14 @@ static int load_layers(TEXT *missing_db)
 
                 log_this(10, "Get info from geometry_columns : %s\n",sql);
                 check_sql(sql);
-                rc = sqlite3_prepare_v2(projectDB, sql, -1, &prepared_geo_col, 0);
+                rc = sqlite3_prepare_v2(layer_db(oneLayer), sql, -1, &prepared_geo_col, 0);
 
+                /*The data db has its own connection, a broken data db only costs its layers*/
                 if (rc != SQLITE_OK ) {
                     log_this(110, "SQL error in %s\n",sql);
-                    sqlite3_close(projectDB);
-                    return 1;
+                    log_this(100, "Cannot use layer %s",layername);
+                    sqlite3_finalize(prepared_geo_col);
+                    continue;
                 }
                 if(!(sqlite3_step(prepared_geo_col) ==  SQLITE_ROW))
                 {
@@ -403,6 +437,7 @@ static int load_layers(TEXT *missing_db)
 
                 }
                 oneLayer->type = type;
+                oneLayer->use_geom_cache = 1;
 
                 init_buffers(oneLayer);
 
@@ -522,15 +557,25 @@ static int load_layers(TEXT *missing_db)
 
                         */
                 check_sql(sql);
-                rc = sqlite3_prepare_v2(projectDB, sql, -1,&preparedLayer, 0);
+                rc = sqlite3_prepare_v2(layer_db(oneLayer), sql, -1,&preparedLayer, 0);
                 log_this(10, "sql %s\n",sql );
                 if (rc != SQLITE_OK ) {
                     log_this(100, "SQL error in %s\n",sql );
-                    sqlite3_close(projectDB);
-                    return 1;
+                    log_this(100, "Cannot use layer %s",layername);
+                    sqlite3_finalize(preparedLayer);
+                    sqlite3_finalize(prepared_geo_col);
+                    drop_layer(oneLayer);
+                    i--;
+                    if(text_field)
+                        free(text_field);
+                    if(sld_style_field)
+                        free(sld_style_field);
+                    continue;
                 }
                 oneLayer->preparedStatement->ps =  preparedLayer;
                 oneLayer->preparedStatement->usage++;
+
+                load_geom_levels(oneLayer, dbname, layername, idx_idfield, unique_idfield, styleselect, textselect);
                 
 
 
@@ -639,7 +684,16 @@ int init_resources(const char *dir)
 {
     log_this(10, "Entering %s\n",__func__);
     map_modus = 1;
-    TEXT *missing_db = init_txt(1024);
+    incremental_loading = 1;
+    feature_culling = 1;
+    decimate_pixels = 0.5;
+    gpu_reprojection = 0;
+    progressive_rendering = 1;
+    overscan[TLM_OVERSCAN_POINTS] = 0.25;
+    overscan[TLM_OVERSCAN_LINES] = 0.25;
+    overscan[TLM_OVERSCAN_POLYGONS] = 0.25;
+    overscan[TLM_OVERSCAN_RASTER] = 0;
+    prefetching = 1;
     curr_utm = 0;
     curr_hemi = 0;
     //char stylewhere[128];
@@ -657,7 +711,7 @@ int init_resources(const char *dir)
         fprintf(stderr,"1 - opengl error:%d in func %s\n", err, __func__);
         }
     }
-    attach_db(dir, missing_db);
+    init_data_dbs(projectDB, dir);
 
 //   load_styles();
     add_system_default_style();
@@ -668,10 +722,9 @@ int init_resources(const char *dir)
     loadSymbols();
     
           
-    if(load_layers(missing_db))
+    if(load_layers())
         log_this(100, "There is a problem loading layers");
     
-    destroy_txt(missing_db);
     init_gps();
     init_info_Layer();
     tmp_unicode_txt = init_wc_txt(256);
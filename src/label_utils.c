@@ -281,8 +281,7 @@ int print_txtblock(GLfloat *point_coord, MATRIX *matrix_hndl,  TEXTBLOCK *tb,flo
         tb->txt_info->points = init_tb_point_list();
         addbatch2glfloat_list(tb->txt_info->points->points,2,point_coord);
         add2gluint_list(tb->txt_info->points->point_start_indexes, 0); 
-    glBindBuffer(GL_ARRAY_BUFFER, tb->txt_info->points->tbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(float)*4*(tb->dims->coords->used), tb->dims->coords->coords, GL_STATIC_DRAW);       
+    upload_gpu_buffer(&(tb->txt_info->points->tbo), GL_ARRAY_BUFFER, tb->dims->coords->coords, sizeof(float)*4*(tb->dims->coords->used), 0);
     }
        while ((err = glGetError()) != GL_NO_ERROR) {
         fprintf(stderr,"1 - opengl error:%d in func %s\n", err, __func__);
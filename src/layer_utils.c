@@ -28,6 +28,7 @@
 #include "mem.h"
 #include "cleanup.h"
 #include "utils.h"
+#include "connections.h"
 
 int check_layer(const unsigned char *dbname, const unsigned char  *layername)
 {
@@ -35,9 +36,15 @@ int check_layer(const unsigned char *dbname, const unsigned char  *layername)
     char sql[1024];
     int rc;
     sqlite3_stmt *prepared_sql;
+    sqlite3 *db = schema_db((const char*) dbname);
+    if(!db)
+    {
+        log_this(110, "we cannot use %s from %s database\n",layername, dbname);
+        return 0;
+    }
     snprintf(sql, 1024, "select count(*) from %s.sqlite_master where type in ('table','view') and name = '%s'", dbname, layername);
     check_sql(sql);
-    rc = sqlite3_prepare_v2(projectDB, sql, -1, &prepared_sql, 0);
+    rc = sqlite3_prepare_v2(db, sql, -1, &prepared_sql, 0);
 
     if (rc != SQLITE_OK ) {
         log_this(110, "SQL error in %s\n",sql);
@@ -70,10 +77,13 @@ int check_column(const unsigned char *dbname,const unsigned char * layername, co
     char sql[1024];
     int rc, res;
     sqlite3_stmt *prepared_sql;
+    sqlite3 *db = schema_db((const char*) dbname);
+    if(!db)
+        return 0;
     snprintf(sql, 1024, "select sql from %s.sqlite_master where type in ('table','view') and name = '%s'", dbname, layername);
 //   printf("sql = %s\n", sql);
 check_sql(sql);
-    rc = sqlite3_prepare_v2(projectDB, sql, -1, &prepared_sql, 0);
+    rc = sqlite3_prepare_v2(db, sql, -1, &prepared_sql, 0);
 
     if (rc != SQLITE_OK ) {
         log_this(90, "failed run sql: %s, error_code: %d\n",sql,  rc);
@@ -121,17 +131,33 @@ LAYER_RUNTIME* init_layer_runtime(int n)
         theLayer = lr+i;
         theLayer->name = NULL;
         theLayer->db = NULL;
+        theLayer->data_db = -1;
         theLayer->title = NULL;
         theLayer->visible = 0;
         theLayer->info_active = 0;
         theLayer->preparedStatement = st_malloc(sizeof(PS_HOLDER));
         theLayer->preparedStatement->ps=NULL;
         theLayer->preparedStatement->usage=0;
+        theLayer->n_levels = 0;
+        theLayer->geom_level = -1;
+        theLayer->reproj_grid.valid = 0;
+        theLayer->reproj_grid.nodes = NULL;
+        theLayer->gpu_reproject = 0;
+        reproj_poly_identity(theLayer->reproj_poly);
+        memset(theLayer->reproj_poly_box, 0, 4 * sizeof(GLfloat));
         /*Buffers*/
         /*Values for shaders*/
         //theLayer->theMatrix[16];
         /*values for what and how to render*/
         theLayer->BBOX = NULL;
+        theLayer->loaded_mpp = 0;
+        theLayer->n_fetch_boxes = 0;
+        theLayer->loaded_ids = NULL;
+        theLayer->use_geom_cache = 0;
+        theLayer->prefetch_for = NULL;
+        theLayer->data_version = 1;
+        memset(&(theLayer->stats), 0, sizeof(LAYER_STATS));
+        memset(&(theLayer->fetch_stats), 0, sizeof(LAYER_STATS));
         theLayer->geometryType = 0;
         theLayer->type = 0; //8 on/off switches: point simple, point symbol, point text, line simple, line width, poly
         theLayer->n_dims = 0;;
@@ -258,7 +284,7 @@ void destroy_layers(LAYERS *l)
 
 void destroy_layer_runtime(LAYER_RUNTIME *lr, int n)
 {
-    int i;
+    int i, j;
     LAYER_RUNTIME *theLayer;
     for (i=0; i<n; i++)
     {
@@ -285,6 +311,10 @@ void destroy_layer_runtime(LAYER_RUNTIME *lr, int n)
             theLayer->preparedStatement->ps = NULL;        
             st_free(theLayer->preparedStatement);
         }
+        for (j=0; j<theLayer->n_levels; j++)
+            sqlite3_finalize(theLayer->levels[j].ps);
+        theLayer->n_levels = 0;
+        reproj_grid_destroy(&(theLayer->reproj_grid));
 
     }
     free(lr);
@@ -68,7 +68,8 @@ int main(int argc, char **argv)
 #endif
 {
 
-    char *projectfile=NULL, *dir=NULL;
+    char *projectfile=NULL, *dir=NULL, *record=NULL, *replay=NULL;
+    int replay_fast = 0;
 
 
     while(--argc>0)
@@ -101,6 +102,29 @@ int main(int argc, char **argv)
 */
             continue;
         }
+
+        if(!strcmp(*argv,"--record"))
+        {
+            argc--;
+            if(argc > 0)
+                record=*++argv;
+            continue;
+        }
+
+        if(!strcmp(*argv,"--replay"))
+        {
+            argc--;
+            if(argc > 0)
+                replay=*++argv;
+            continue;
+        }
+
+        /*Replay as fast as possible instead of in the recorded pace*/
+        if(!strcmp(*argv,"--replay-fast"))
+        {
+            replay_fast = 1;
+            continue;
+        }
     }
 CTRL* controls = NULL;
      
@@ -110,6 +134,10 @@ CTRL* controls = NULL;
         TLM_init_db(projectfile, dir);
         controls = TLM_init_controls(NATIVE_default);
      }
+    if(replay)
+        TLM_replay_trace(replay, replay_fast);
+    else if(record)
+        TLM_record_trace(record);
     TLM_start(controls);
      
      
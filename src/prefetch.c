@@ -0,0 +1,548 @@
+/**********************************************************************
+ *
+ * TileLessMap
+ *
+ * TileLessMap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * TileLessMap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TileLessMap.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **********************************************************************
+ *
+ * Copyright (C) 2016-2018 Nicklas Avén
+ *
+ ***********************************************************************/
+/**********************************************************************
+ * Idle time prefetching.
+ *
+ * While the user is looking at the map, one low priority thread fetches
+ * and decodes what we guess is needed next: the neighbouring views
+ * along the recent pan, and the next zoom step if the user has been
+ * zooming. It decodes into its own copies of the layers, with
+ * prefetch_for pointing at the real layers, so the features end up in
+ * the geometry cache just as if the real layers had decoded them.
+ * Raster tiles are decoded in the thread and uploaded to the texture
+ * cache from the main loop, since it owns the gl context.
+ *
+ * Any input aborts the prefetching, a running query from a progress
+ * handler on the prefetcher's own connections. It starts over when the
+ * map has been left alone for PREFETCH_IDLE_MS.
+ * The caches count how many of the prefetched entries are used later.
+ ***********************************************************************/
+
+#include "theclient.h"
+#include "mem.h"
+#include "buffer_handling.h"
+#include "raster_cache.h"
+#include "raster_decode.h"
+#include "prefetch.h"
+#include "tilelessmap.h"
+
+static FETCH_WORKER worker;
+static pthread_t thread;
+static int active = 0;
+
+/*The last views asked for, the newest at history_head - 1*/
+static PREFETCH_VIEW history[PREFETCH_HISTORY];
+static int history_head = 0;
+static int n_history = 0;
+
+/*The views the running prefetch is for*/
+static PREFETCH_VIEW targets[PREFETCH_MAX_VIEWS];
+static int n_targets = 0;
+
+/*The prefetcher's copies of the layers, in the same order as global_layers.
+ * Only the copies with prefetch_for set are used in a run*/
+static LAYER_RUNTIME *copies = NULL;
+
+/*Decoded tiles waiting for the main loop*/
+static PREFETCH_TILE tiles[PREFETCH_MAX_TILES];
+static int n_tiles = 0;
+
+/*Only used from the main loop. wanted is set when the view has changed since the last finished prefetch*/
+static int wanted = 0;
+static uint32_t last_input = 0;
+
+/*Written with prefetch_mutex held. cancel is read without it from the progress handler*/
+static int state = PREFETCH_IDLE;
+static int cancel = 0;
+static int stop_thread = 0;
+
+static pthread_mutex_t prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t run_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t tile_cond = PTHREAD_COND_INITIALIZER;
+
+
+/*Returning non zero makes the running query return SQLITE_INTERRUPT*/
+static int prefetch_progress(void *w)
+{
+    (void) w;
+    return __atomic_load_n(&cancel, __ATOMIC_RELAXED);
+}
+
+static int cancelled()
+{
+    return __atomic_load_n(&cancel, __ATOMIC_RELAXED);
+}
+
+/*The view n steps back in the history, 0 is the last one*/
+static PREFETCH_VIEW* history_at(int n)
+{
+    return history + (history_head - 1 - n + PREFETCH_HISTORY) % PREFETCH_HISTORY;
+}
+
+static int same_zoom(PREFETCH_VIEW *a, PREFETCH_VIEW *b)
+{
+    return fabsf(a->mpp - b->mpp) <= SAME_ZOOM_TOLERANCE * b->mpp;
+}
+
+/*The view v moved dx, dy and scaled f times around its center*/
+static void move_view(PREFETCH_VIEW *out, PREFETCH_VIEW *v, GLfloat dx, GLfloat dy, GLfloat f)
+{
+    GLfloat cx = 0.5 * (v->bbox[0] + v->bbox[2]) + dx;
+    GLfloat cy = 0.5 * (v->bbox[1] + v->bbox[3]) + dy;
+    GLfloat hw = 0.5 * f * (v->bbox[2] - v->bbox[0]);
+    GLfloat hh = 0.5 * f * (v->bbox[3] - v->bbox[1]);
+
+    out->bbox[0] = cx - hw;
+    out->bbox[1] = cy - hh;
+    out->bbox[2] = cx + hw;
+    out->bbox[3] = cy + hh;
+    out->mpp = f * v->mpp;
+    out->time = v->time;
+}
+
+/**
+ * Guess the next views from the history.
+ * Along the pan from the velocity over the last PREFETCH_VELOCITY_WINDOW_MS at the current zoom,
+ * and one more zoom step of the same size and direction as the last one.
+ * Returns the number of views put in views, the closest first
+ */
+static int predict(PREFETCH_VIEW *views)
+{
+    PREFETCH_VIEW *last, *prev, *first = NULL;
+    GLfloat dx, dy, dist, ux, uy, w, h, step, f;
+    int i, ahead, n = 0;
+
+    if(!n_history)
+        return 0;
+    last = history_at(0);
+
+    for (i=1; i<n_history; i++)
+    {
+        prev = history_at(i);
+        if(last->time - prev->time > PREFETCH_VELOCITY_WINDOW_MS || !same_zoom(prev, last))
+            break;
+        first = prev;
+    }
+    if(first)
+    {
+        dx = 0.5 * (last->bbox[0] + last->bbox[2] - first->bbox[0] - first->bbox[2]);
+        dy = 0.5 * (last->bbox[1] + last->bbox[3] - first->bbox[1] - first->bbox[3]);
+        dist = sqrtf(dx * dx + dy * dy);
+        if(dist > 0)
+        {
+            ux = dx / dist;
+            uy = dy / dist;
+            w = last->bbox[2] - last->bbox[0];
+            h = last->bbox[3] - last->bbox[1];
+
+            /*How far along the pan the view is next to the last one*/
+            step = fabsf(ux) * h > fabsf(uy) * w ? w / fabsf(ux) : h / fabsf(uy);
+
+            ahead = (int) ceilf(dist / (GLfloat) (last->time - first->time + 1) * PREFETCH_LOOKAHEAD_MS / step);
+            if(ahead < 1)
+                ahead = 1;
+            if(ahead > PREFETCH_MAX_AHEAD)
+                ahead = PREFETCH_MAX_AHEAD;
+
+            for (i=1; i<=ahead; i++)
+                move_view(views + n++, last, i * step * ux, i * step * uy, 1);
+        }
+    }
+
+    if(n_history > 1)
+    {
+        prev = history_at(1);
+        if(last->time - prev->time <= PREFETCH_VELOCITY_WINDOW_MS && !same_zoom(prev, last))
+        {
+            f = last->mpp / prev->mpp;
+            if(f < 0.25)
+                f = 0.25;
+            if(f > 4)
+                f = 4;
+            move_view(views + n++, last, 0, 0, f);
+        }
+    }
+    return n;
+}
+
+/*Layers with labels are left out, since the text is read from the db every time anyway*/
+static int prefetchable(LAYER_RUNTIME *l)
+{
+    if(!l->visible || (l->type & 32))
+        return 0;
+    if(!l->use_geom_cache && l->geometryType != RASTER)
+        return 0;
+    return l->preparedStatement->ps != NULL;
+}
+
+/*A copy of the layer with buffers of its own. Made from the main loop since the raster buffers have gl objects*/
+static void init_copy(LAYER_RUNTIME *copy, LAYER_RUNTIME *l)
+{
+    memcpy(copy, l, sizeof(LAYER_RUNTIME));
+    copy->prefetch_for = l;
+    copy->text = NULL;
+    copy->rast = NULL;
+    copy->loaded_ids = NULL;
+    copy->reproj_grid.valid = 0;
+    copy->reproj_grid.nodes = NULL;
+    copy->n_fetch_boxes = 0;
+    memset(&(copy->stats), 0, sizeof(LAYER_STATS));
+    memset(&(copy->fetch_stats), 0, sizeof(LAYER_STATS));
+    init_buffers(copy);
+}
+
+static void destroy_copy(LAYER_RUNTIME *copy)
+{
+    destroy_buffers(copy);
+    reproj_grid_destroy(&(copy->reproj_grid));
+    copy->prefetch_for = NULL;
+}
+
+/*Hand over a decoded tile to the main loop, waiting while it has not taken the earlier ones*/
+static void add_tile(LAYER_RUNTIME *l, int x, int y, SDL_Surface *surface)
+{
+    pthread_mutex_lock(&prefetch_mutex);
+    while(n_tiles == PREFETCH_MAX_TILES && !cancel)
+        pthread_cond_wait(&tile_cond, &prefetch_mutex);
+    if(cancel)
+        SDL_FreeSurface(surface);
+    else
+    {
+        tiles[n_tiles].layer = l;
+        tiles[n_tiles].x = x;
+        tiles[n_tiles].y = y;
+        tiles[n_tiles].surface = surface;
+        n_tiles++;
+    }
+    pthread_mutex_unlock(&prefetch_mutex);
+}
+
+/*Decode the tiles fetched to a raster layer copy that are not in the texture cache already*/
+static void prefetch_tiles(LAYER_RUNTIME *copy)
+{
+    GLuint i;
+    size_t tot_index = 0;
+    RASTER_LIST *rast = copy->rast;
+    SDL_Surface *surface;
+
+    for (i=0; i<rast->raster_start_indexes->used && !cancelled(); i++)
+    {
+        uint8_t *data = rast->data->list + tot_index;
+        size_t data_len = rast->raster_start_indexes->list[i];
+        int x = rast->tileidxy->list[2*i];
+        int y = rast->tileidxy->list[2*i+1];
+        tot_index += data_len;
+
+        if(raster_cache_has(copy->prefetch_for, x, y))
+            continue;
+        surface = raster_decode_tile(data, data_len);
+        if(surface)
+            add_tile(copy->prefetch_for, x, y, surface);
+    }
+}
+
+/*Fetch a layer copy for a predicted view, the same way get_data would. i is the layer's index, for the statements*/
+static void prefetch_layer(LAYER_RUNTIME *copy, int i, PREFETCH_VIEW *view)
+{
+    sqlite3_stmt *ps;
+
+    reset_buffers(copy);
+    layer_fetch_box(copy, view->bbox, copy->loaded_bbox);
+    copy->BBOX = copy->loaded_bbox;
+    copy->loaded_mpp = view->mpp;
+    copy->geom_level = geom_level(copy, view->mpp);
+    copy->gpu_reproject = gpu_reproject(copy, view->bbox, view->mpp);
+
+    ps = fetch_worker_statement(&worker, i, copy->geom_level);
+    if(!ps)
+        return;
+
+    twkb_fromSQLiteBBOX_stmt(copy, ps);
+    if(copy->geometryType == RASTER)
+        prefetch_tiles(copy);
+}
+
+static void *prefetch_thread(void *arg)
+{
+    int t, i;
+    LAYER_RUNTIME *copy;
+    (void) arg;
+
+    /*Whatever the user does comes first*/
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
+
+    while(1)
+    {
+        pthread_mutex_lock(&prefetch_mutex);
+        while(state != PREFETCH_RUNNING && !stop_thread)
+            pthread_cond_wait(&run_cond, &prefetch_mutex);
+        if(stop_thread)
+        {
+            pthread_mutex_unlock(&prefetch_mutex);
+            break;
+        }
+        pthread_mutex_unlock(&prefetch_mutex);
+
+        for (t=0; t<n_targets; t++)
+        {
+            for (i=0; i<global_layers->nlayers && !cancelled(); i++)
+            {
+                copy = copies + i;
+                if(copy->prefetch_for && copy->minScale <= targets[t].mpp && copy->maxScale > targets[t].mpp)
+                    prefetch_layer(copy, i, targets + t);
+            }
+        }
+
+        pthread_mutex_lock(&prefetch_mutex);
+        state = PREFETCH_DONE;
+        pthread_mutex_unlock(&prefetch_mutex);
+    }
+    return NULL;
+}
+
+/*Upload the tiles the prefetcher has decoded to the texture cache. They are thrown away if it is cancelled*/
+static void upload_tiles()
+{
+    PREFETCH_TILE ready[PREFETCH_MAX_TILES];
+    GLuint texture_id;
+    size_t bytes;
+    int i, n, drop;
+
+    pthread_mutex_lock(&prefetch_mutex);
+    n = n_tiles;
+    memcpy(ready, tiles, n * sizeof(PREFETCH_TILE));
+    n_tiles = 0;
+    drop = cancel;
+    pthread_cond_signal(&tile_cond);
+    pthread_mutex_unlock(&prefetch_mutex);
+
+    for (i=0; i<n; i++)
+    {
+        if(!drop)
+        {
+            texture_id = load_raster_texture(ready[i].surface, &bytes);
+            raster_cache_add(ready[i].layer, ready[i].x, ready[i].y, texture_id, bytes, 1);
+        }
+        SDL_FreeSurface(ready[i].surface);
+    }
+}
+
+/*Copy the layers to prefetch and wake the thread. Returns 0 if there is nothing to prefetch*/
+static int start_prefetch()
+{
+    int i, n = 0;
+
+    n_targets = predict(targets);
+    if(!n_targets)
+        return 0;
+
+    for (i=0; i<global_layers->nlayers; i++)
+    {
+        if(!prefetchable(global_layers->layers + i))
+            continue;
+        init_copy(copies + i, global_layers->layers + i);
+        n++;
+    }
+    if(!n)
+        return 0;
+
+    log_this(10, "Prefetching %d layers for %d views\n", n, n_targets);
+    wanted = 0;
+    pthread_mutex_lock(&prefetch_mutex);
+    __atomic_store_n(&cancel, 0, __ATOMIC_RELAXED);
+    state = PREFETCH_RUNNING;
+    pthread_cond_signal(&run_cond);
+    pthread_mutex_unlock(&prefetch_mutex);
+    return 1;
+}
+
+/*Clean up after the thread is done. If it was cancelled we try again when the map is idle*/
+static void end_prefetch()
+{
+    int i;
+
+    upload_tiles();
+    for (i=0; i<global_layers->nlayers; i++)
+    {
+        if(copies[i].prefetch_for)
+            destroy_copy(copies + i);
+    }
+    pthread_mutex_lock(&prefetch_mutex);
+    if(cancel)
+        wanted = 1;
+    state = PREFETCH_IDLE;
+    pthread_mutex_unlock(&prefetch_mutex);
+}
+
+/**
+ * Start the prefetch thread, with its own connections and statements.
+ * Has to be called after the layers are loaded. Without it we just don't prefetch
+ */
+int init_prefetch()
+{
+#if THREADING > 0
+    if(!global_layers->nlayers)
+        return 0;
+
+    memset(&worker, 0, sizeof(FETCH_WORKER));
+    if(init_fetch_worker(&worker, prefetch_progress))
+        return 1;
+
+    copies = st_calloc(global_layers->nlayers, sizeof(LAYER_RUNTIME));
+    state = PREFETCH_IDLE;
+    cancel = stop_thread = 0;
+    n_tiles = n_history = history_head = wanted = 0;
+
+    if(pthread_create(&thread, NULL, prefetch_thread, NULL))
+    {
+        destroy_fetch_worker(&worker);
+        st_free(copies);
+        copies = NULL;
+        return 1;
+    }
+    active = 1;
+    log_this(100, "Prefetcher started\n");
+#endif
+    return 0;
+}
+
+/**
+ * A new view is asked for. It is remembered for the predictions,
+ * and what is prefetched right now is aborted
+ */
+void prefetch_note_view(GLfloat *bbox, GLfloat mpp)
+{
+    PREFETCH_VIEW *v;
+    if(!active)
+        return;
+
+    prefetch_interrupt();
+    wanted = 1;
+
+    /*Layers turned on and off gives the same view again*/
+    if(n_history && !memcmp(history_at(0)->bbox, bbox, 4 * sizeof(GLfloat)))
+        return;
+
+    v = history + history_head;
+    memcpy(v->bbox, bbox, 4 * sizeof(GLfloat));
+    v->mpp = mpp;
+    v->time = SDL_GetTicks();
+    history_head = (history_head + 1) % PREFETCH_HISTORY;
+    if(n_history < PREFETCH_HISTORY)
+        n_history++;
+}
+
+/*Input from the user. Any prefetching is aborted, and started again when the map is idle*/
+void prefetch_interrupt()
+{
+    if(!active)
+        return;
+
+    last_input = SDL_GetTicks();
+    pthread_mutex_lock(&prefetch_mutex);
+    if(state == PREFETCH_RUNNING)
+    {
+        __atomic_store_n(&cancel, 1, __ATOMIC_RELAXED);
+        pthread_cond_signal(&tile_cond);
+    }
+    pthread_mutex_unlock(&prefetch_mutex);
+}
+
+/**
+ * Called from the main loop before it waits for the next event.
+ * Starts the prefetching when the map has been idle long enough, and uploads the tiles it has decoded.
+ * Returns how many ms the main loop can wait before calling again, -1 to wait for the next event
+ */
+int prefetch_idle()
+{
+    int s;
+    uint32_t idle;
+
+    if(!active)
+        return -1;
+
+    pthread_mutex_lock(&prefetch_mutex);
+    s = state;
+    pthread_mutex_unlock(&prefetch_mutex);
+
+    if(s == PREFETCH_RUNNING)
+    {
+        upload_tiles();
+        return PREFETCH_POLL_MS;
+    }
+    if(s == PREFETCH_DONE)
+        end_prefetch();
+
+    if(!wanted || !prefetching)
+        return -1;
+
+    /*The fetch pool sends an event when a layer is done, and then we are called again*/
+    if(fetch_pool_pending())
+        return -1;
+
+    idle = SDL_GetTicks() - last_input;
+    if(idle < PREFETCH_IDLE_MS)
+        return (int) (PREFETCH_IDLE_MS - idle);
+
+    if(start_prefetch())
+        return PREFETCH_POLL_MS;
+    wanted = 0;
+    return -1;
+}
+
+void destroy_prefetch()
+{
+    TLM_CACHE_STATS geom, raster;
+
+    if(!active)
+        return;
+
+    pthread_mutex_lock(&prefetch_mutex);
+    stop_thread = 1;
+    __atomic_store_n(&cancel, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&run_cond);
+    pthread_cond_broadcast(&tile_cond);
+    pthread_mutex_unlock(&prefetch_mutex);
+
+    pthread_join(thread, NULL);
+    end_prefetch();
+    destroy_fetch_worker(&worker);
+    st_free(copies);
+    copies = NULL;
+    active = 0;
+
+    TLM_get_geom_cache_stats(&geom);
+    TLM_get_raster_cache_stats(&raster);
+    log_this(100, "Prefetched %llu features of which %llu were used, and %llu raster tiles of which %llu were used\n",
+             (unsigned long long) geom.prefetched, (unsigned long long) geom.prefetch_hits,
+             (unsigned long long) raster.prefetched, (unsigned long long) raster.prefetch_hits);
+}
+
+/**
+ * Let the caches be filled for where the user is heading while the map is left alone. On by default.
+ * prefetch_hits / prefetched in TLM_get_geom_cache_stats and TLM_get_raster_cache_stats tells if it pays off
+ */
+extern void TLM_set_prefetching(int enabled)
+{
+    prefetching = enabled;
+}
@@ -0,0 +1,81 @@
+/**********************************************************************
+ *
+ * TileLessMap
+ *
+ * TileLessMap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * TileLessMap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TileLessMap.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **********************************************************************
+ *
+ * Copyright (C) 2016-2018 Nicklas Avén
+ *
+ ***********************************************************************/
+#ifndef _prefetch_H
+#define _prefetch_H
+
+#include <pthread.h>
+#include "structures.h"
+#include "fetch_pool.h"
+
+/*How long the map has to be left alone before the prefetching starts, in ms*/
+#define PREFETCH_IDLE_MS 300
+
+/*How often the main loop looks after a running prefetch, to upload the raster tiles it has decoded. In ms*/
+#define PREFETCH_POLL_MS 50
+
+/*Number of views remembered to predict the next ones from*/
+#define PREFETCH_HISTORY 8
+
+/*Only views this recent are used to find the pan velocity, in ms*/
+#define PREFETCH_VELOCITY_WINDOW_MS 5000
+
+/*We prefetch as far along the pan as the velocity takes us in this many ms, but at least to
+ * the neighbouring view and at most PREFETCH_MAX_AHEAD views away*/
+#define PREFETCH_LOOKAHEAD_MS 10000
+#define PREFETCH_MAX_AHEAD 2
+
+/*The views predicted at once, the ones along the pan and one for the next zoom*/
+#define PREFETCH_MAX_VIEWS (PREFETCH_MAX_AHEAD + 1)
+
+/*Max decoded raster tiles waiting for the main loop to upload them*/
+#define PREFETCH_MAX_TILES 16
+
+/*States of the prefetcher*/
+#define PREFETCH_IDLE 0
+#define PREFETCH_RUNNING 1
+#define PREFETCH_DONE 2 // the prefetch thread is finished, the main loop cleans up after it
+
+typedef struct
+{
+    GLfloat bbox[4];
+    GLfloat mpp;
+    uint32_t time; // SDL_GetTicks when the view was asked for
+} PREFETCH_VIEW;
+
+/*A raster tile decoded by the prefetcher, to be uploaded to the texture cache from the main loop*/
+typedef struct
+{
+    LAYER_RUNTIME *layer;
+    int x;
+    int y;
+    SDL_Surface *surface;
+} PREFETCH_TILE;
+
+
+int init_prefetch();
+void prefetch_note_view(GLfloat *bbox, GLfloat mpp);
+void prefetch_interrupt();
+int prefetch_idle();
+void destroy_prefetch();
+
+#endif
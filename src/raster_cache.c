@@ -0,0 +1,202 @@
+/**********************************************************************
+ *
+ * TileLessMap
+ *
+ * TileLessMap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * TileLessMap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TileLessMap.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **********************************************************************
+ *
+ * Copyright (C) 2016-2018 Nicklas Avén
+ *
+ ***********************************************************************/
+
+
+/**********************************************************************
+ * Cache of raster tile textures.
+ *
+ * Decoding a tile and uploading it to the gpu is by far the most
+ * expensive part of rendering a raster layer, so the textures are kept
+ * between frames, keyed by layer and tile x, y.
+ * The entries are kept in least recently used order and the oldest
+ * textures are deleted when the cache grows above its limit.
+ * Textures are only added and deleted from the rendering thread since
+ * it owns the gl context. The prefetcher checks from its own thread
+ * what is already there, so the hash is guarded by a mutex.
+ ***********************************************************************/
+
+#include "theclient.h"
+#include "mem.h"
+#include "raster_cache.h"
+#include "tilelessmap.h"
+
+static RASTER_CACHE_ENTRY *cache = NULL;
+static size_t cache_bytes = 0;
+static size_t cache_max_bytes = RASTER_CACHE_DEFAULT_SIZE;
+
+static uint64_t n_hits = 0;
+static uint64_t n_misses = 0;
+static uint64_t n_evicted = 0;
+static uint64_t n_prefetched = 0;
+static uint64_t n_prefetch_hits = 0;
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void set_key(RASTER_CACHE_KEY *key, LAYER_RUNTIME *l, int x, int y)
+{
+    memset(key, 0, sizeof(RASTER_CACHE_KEY));
+    key->layer = l;
+    key->x = x;
+    key->y = y;
+}
+
+static void free_entry(RASTER_CACHE_ENTRY *e)
+{
+    HASH_DEL(cache, e);
+    glDeleteTextures(1, &(e->texture));
+    cache_bytes -= e->bytes;
+    st_free(e);
+}
+
+/*Delete the least recently used textures until we are below max_bytes*/
+static void evict(size_t max_bytes)
+{
+    RASTER_CACHE_ENTRY *e, *tmp;
+    HASH_ITER(hh, cache, e, tmp)
+    {
+        if(cache_bytes <= max_bytes)
+            break;
+        free_entry(e);
+        n_evicted++;
+    }
+}
+
+/**
+ * Returns the texture of a tile, or 0 if the tile has to be loaded
+ */
+GLuint raster_cache_get(LAYER_RUNTIME *l, int x, int y)
+{
+    RASTER_CACHE_KEY key;
+    RASTER_CACHE_ENTRY *e = NULL;
+
+    set_key(&key, l, x, y);
+    pthread_mutex_lock(&cache_mutex);
+    HASH_FIND(hh, cache, &key, sizeof(RASTER_CACHE_KEY), e);
+    if(!e)
+    {
+        n_misses++;
+        pthread_mutex_unlock(&cache_mutex);
+        return 0;
+    }
+    n_hits++;
+    if(e->prefetched)
+    {
+        n_prefetch_hits++;
+        e->prefetched = 0;
+    }
+
+    /*Move it last, to mark it as most recently used*/
+    HASH_DEL(cache, e);
+    HASH_ADD(hh, cache, key, sizeof(RASTER_CACHE_KEY), e);
+    pthread_mutex_unlock(&cache_mutex);
+    return e->texture;
+}
+
+/*Is the tile in the cache. Doesn't count as a hit, and can be called from any thread*/
+int raster_cache_has(LAYER_RUNTIME *l, int x, int y)
+{
+    RASTER_CACHE_KEY key;
+    RASTER_CACHE_ENTRY *e = NULL;
+
+    set_key(&key, l, x, y);
+    pthread_mutex_lock(&cache_mutex);
+    HASH_FIND(hh, cache, &key, sizeof(RASTER_CACHE_KEY), e);
+    pthread_mutex_unlock(&cache_mutex);
+    return e != NULL;
+}
+
+/**
+ * Hand over a texture to the cache. From now on the cache is responsible for deleting it.
+ * prefetched is set for textures the prefetcher has loaded
+ */
+int raster_cache_add(LAYER_RUNTIME *l, int x, int y, GLuint texture, size_t bytes, int prefetched)
+{
+    RASTER_CACHE_ENTRY *e = NULL;
+
+    e = st_malloc(sizeof(RASTER_CACHE_ENTRY));
+    set_key(&(e->key), l, x, y);
+    e->texture = texture;
+    e->bytes = bytes;
+    e->prefetched = prefetched;
+
+    pthread_mutex_lock(&cache_mutex);
+    RASTER_CACHE_ENTRY *old = NULL;
+    HASH_FIND(hh, cache, &(e->key), sizeof(RASTER_CACHE_KEY), old);
+    if(old)
+        free_entry(old);
+
+    HASH_ADD(hh, cache, key, sizeof(RASTER_CACHE_KEY), e);
+    cache_bytes += bytes;
+    if(prefetched)
+        n_prefetched++;
+
+    /*The newest texture is last and never evicted here, it is about to be drawn*/
+    if(cache_bytes > cache_max_bytes && HASH_COUNT(cache) > 1)
+    {
+        RASTER_CACHE_ENTRY *tmp;
+        HASH_ITER(hh, cache, old, tmp)
+        {
+            if(cache_bytes <= cache_max_bytes || old == e)
+                break;
+            free_entry(old);
+            n_evicted++;
+        }
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    return 0;
+}
+
+void raster_cache_clear()
+{
+    pthread_mutex_lock(&cache_mutex);
+    evict(0);
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+
+/**
+ * Set upper limit of texture memory used for raster tiles.
+ * Has to be called from the rendering thread
+ */
+extern void TLM_set_raster_cache_size(size_t max_bytes)
+{
+    pthread_mutex_lock(&cache_mutex);
+    cache_max_bytes = max_bytes;
+    evict(cache_max_bytes);
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+extern void TLM_get_raster_cache_stats(TLM_CACHE_STATS *stats)
+{
+    pthread_mutex_lock(&cache_mutex);
+    stats->hits = n_hits;
+    stats->misses = n_misses;
+    stats->evicted = n_evicted;
+    stats->entries = HASH_COUNT(cache);
+    stats->bytes = cache_bytes;
+    stats->max_bytes = cache_max_bytes;
+    stats->prefetched = n_prefetched;
+    stats->prefetch_hits = n_prefetch_hits;
+    pthread_mutex_unlock(&cache_mutex);
+}
@@ -0,0 +1,53 @@
+/**********************************************************************
+ *
+ * TileLessMap
+ *
+ * TileLessMap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * TileLessMap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TileLessMap.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **********************************************************************
+ *
+ * Copyright (C) 2016-2018 Nicklas Avén
+ *
+ ***********************************************************************/
+#ifndef _raster_cache_H
+#define _raster_cache_H
+
+#include "structures.h"
+
+/*Default upper limit of texture memory used by raster tiles. Can be changed with TLM_set_raster_cache_size*/
+#define RASTER_CACHE_DEFAULT_SIZE (64*1024*1024)
+
+typedef struct
+{
+    LAYER_RUNTIME *layer;
+    int32_t x;
+    int32_t y;
+} RASTER_CACHE_KEY;
+
+typedef struct
+{
+    RASTER_CACHE_KEY key;
+    GLuint texture;
+    size_t bytes; // estimated size of the texture on the gpu
+    uint8_t prefetched; // loaded by the prefetcher and not drawn since
+    UT_hash_handle hh;
+} RASTER_CACHE_ENTRY;
+
+
+GLuint raster_cache_get(LAYER_RUNTIME *l, int x, int y);
+int raster_cache_has(LAYER_RUNTIME *l, int x, int y);
+int raster_cache_add(LAYER_RUNTIME *l, int x, int y, GLuint texture, size_t bytes, int prefetched);
+void raster_cache_clear();
+
+#endif
@@ -0,0 +1,320 @@
+/**********************************************************************
+ *
+ * TileLessMap
+ *
+ * TileLessMap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * TileLessMap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TileLessMap.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **********************************************************************
+ *
+ * Copyright (C) 2016-2018 Nicklas Avén
+ *
+ ***********************************************************************/
+
+
+/**********************************************************************
+ * Decoding of raster tiles in background threads.
+ *
+ * When a tile is not in the texture cache the rendering thread hands
+ * the compressed tile over to the decoders and draws a placeholder.
+ * The decoders turn it into an RGB24 surface, and send an event so
+ * the map is rendered again. Next time the tile is asked for, the
+ * surface is ready and the rendering thread only has to upload it.
+ *
+ * Tiles that are not asked for in a pass over the layer are dropped,
+ * so we never spend time decoding tiles that has left the screen.
+ * Tiles that fail to decode are remembered as long as they are asked
+ * for, so a broken tile is decoded once and not once per frame.
+ ***********************************************************************/
+
+#include "theclient.h"
+#include "mem.h"
+#include "SDL_image.h"
+#include "raster_decode.h"
+
+static pthread_t decoders[MAX_RASTER_DECODERS];
+static int n_decoders = 0;
+
+/*All jobs, keyed by layer and tile*/
+static RASTER_JOB *jobs = NULL;
+
+/*Queue of jobs to decode*/
+static RASTER_JOB *queue_first = NULL;
+static RASTER_JOB *queue_last = NULL;
+
+static int stop_decoders = 0;
+static int event_pending = 0;
+static unsigned int current_pass = 0;
+
+static pthread_mutex_t decode_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t decode_cond = PTHREAD_COND_INITIALIZER;
+
+
+/*Decode a tile to a surface in a format we can upload right away. Also used by the prefetcher*/
+SDL_Surface* raster_decode_tile(uint8_t *data, size_t data_len)
+{
+    SDL_Surface *surface, *rgb;
+    surface = IMG_Load_RW(SDL_RWFromMem(data, (int) data_len), 1);
+    if(!surface)
+        return NULL;
+    if(surface->format->format == SDL_PIXELFORMAT_RGB24)
+        return surface;
+    rgb = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_RGB24, 0);
+    SDL_FreeSurface(surface);
+    return rgb;
+}
+
+static void free_job(RASTER_JOB *job)
+{
+    if(job->surface)
+        SDL_FreeSurface(job->surface);
+    st_free(job->data);
+    st_free(job);
+}
+
+/*Tell the main loop there is something new to render. Called with the mutex held*/
+static void push_raster_event()
+{
+    if(event_pending || RasterEventType == ((Uint32)-1))
+        return;
+    SDL_Event event;
+    SDL_zero(event);
+    event.type = RasterEventType;
+    event.user.code = 1;
+    SDL_PushEvent(&event);
+    event_pending = 1;
+}
+
+static void *raster_decoder_thread(void *arg)
+{
+    RASTER_JOB *job;
+    SDL_Surface *surface;
+    (void) arg;
+
+    while(1)
+    {
+        pthread_mutex_lock(&decode_mutex);
+        while(!queue_first && !stop_decoders)
+            pthread_cond_wait(&decode_cond, &decode_mutex);
+        if(stop_decoders)
+        {
+            pthread_mutex_unlock(&decode_mutex);
+            break;
+        }
+        job = queue_first;
+        queue_first = job->next;
+        if(!queue_first)
+            queue_last = NULL;
+        job->next = NULL;
+
+        if(job->cancelled)
+        {
+            free_job(job);
+            pthread_mutex_unlock(&decode_mutex);
+            continue;
+        }
+        job->state = RASTER_RUNNING;
+        pthread_mutex_unlock(&decode_mutex);
+
+        surface = raster_decode_tile(job->data, job->data_len);
+
+        pthread_mutex_lock(&decode_mutex);
+        if(job->cancelled)
+        {
+            if(surface)
+                SDL_FreeSurface(surface);
+            free_job(job);
+        }
+        else
+        {
+            job->surface = surface;
+            job->state = surface ? RASTER_DECODED : RASTER_FAILED;
+            if(!surface)
+            {
+                /*Kept as a negative entry, the data is not needed anymore*/
+                st_free(job->data);
+                job->data = NULL;
+            }
+            push_raster_event();
+        }
+        pthread_mutex_unlock(&decode_mutex);
+    }
+    return NULL;
+}
+
+/**
+ * Start the decoders. Without them tiles are decoded directly in raster_decode_get
+ */
+int init_raster_decode()
+{
+    int i, n, have_raster = 0;
+
+    for (i=0; i<global_layers->nlayers; i++)
+    {
+        if(global_layers->layers[i].geometryType == RASTER)
+            have_raster = 1;
+    }
+#if THREADING > 0
+    /*Leave one core for rendering*/
+    n = SDL_GetCPUCount() - 1;
+#else
+    n = 0;
+#endif
+    if(n > MAX_RASTER_DECODERS)
+        n = MAX_RASTER_DECODERS;
+
+    RasterEventType = ((Uint32)-1);
+    if(n < 1 || !have_raster)
+        return 0;
+
+    RasterEventType = SDL_RegisterEvents(1);
+    stop_decoders = 0;
+    for (i=0; i<n; i++)
+    {
+        if(pthread_create(decoders + i, NULL, raster_decoder_thread, NULL))
+            break;
+        n_decoders++;
+    }
+    log_this(100, "Started %d raster decoders\n", n_decoders);
+    return 0;
+}
+
+/**
+ * Start a pass over a raster layer. Returns the pass number to give to raster_decode_end
+ */
+unsigned int raster_decode_begin()
+{
+    pthread_mutex_lock(&decode_mutex);
+    current_pass++;
+    event_pending = 0;
+    pthread_mutex_unlock(&decode_mutex);
+    return current_pass;
+}
+
+/**
+ * Get the decoded surface of a tile.
+ * Returns 1 and hands over the surface to the caller when the tile is decoded,
+ * 0 if it is not decoded yet and -1 if it cannot be decoded.
+ * A tile that failed stays failed until it is not asked for in a pass.
+ */
+int raster_decode_get(LAYER_RUNTIME *l, int x, int y, uint8_t *data, size_t data_len, SDL_Surface **surface)
+{
+    RASTER_CACHE_KEY key;
+    RASTER_JOB *job = NULL;
+    int ret = 0;
+
+    *surface = NULL;
+    memset(&key, 0, sizeof(RASTER_CACHE_KEY));
+    key.layer = l;
+    key.x = x;
+    key.y = y;
+
+    pthread_mutex_lock(&decode_mutex);
+    HASH_FIND(hh, jobs, &key, sizeof(RASTER_CACHE_KEY), job);
+    if(!job && !n_decoders)
+    {
+        /*No decoders, so we decode right here and only remember the failures*/
+        pthread_mutex_unlock(&decode_mutex);
+        *surface = raster_decode_tile(data, data_len);
+        if(*surface)
+            return 1;
+        pthread_mutex_lock(&decode_mutex);
+        job = st_calloc(1, sizeof(RASTER_JOB));
+        job->key = key;
+        job->state = RASTER_FAILED;
+        HASH_ADD(hh, jobs, key, sizeof(RASTER_CACHE_KEY), job);
+    }
+    else if(!job)
+    {
+        job = st_calloc(1, sizeof(RASTER_JOB));
+        job->key = key;
+        job->data = st_malloc(data_len);
+        memcpy(job->data, data, data_len);
+        job->data_len = data_len;
+        job->state = RASTER_QUEUED;
+        HASH_ADD(hh, jobs, key, sizeof(RASTER_CACHE_KEY), job);
+
+        if(queue_last)
+            queue_last->next = job;
+        else
+            queue_first = job;
+        queue_last = job;
+        pthread_cond_signal(&decode_cond);
+    }
+    job->last_request = current_pass;
+
+    if(job->state == RASTER_DECODED)
+    {
+        HASH_DEL(jobs, job);
+        ret = 1;
+        *surface = job->surface;
+        job->surface = NULL;
+        free_job(job);
+    }
+    else if(job->state == RASTER_FAILED)
+        ret = -1;
+    pthread_mutex_unlock(&decode_mutex);
+    return ret;
+}
+
+/**
+ * Drop the jobs of a layer that was not asked for in this pass.
+ * Jobs being decoded right now are freed by the decoder when it is done.
+ */
+void raster_decode_end(LAYER_RUNTIME *l, unsigned int pass)
+{
+    RASTER_JOB *job, *tmp;
+    pthread_mutex_lock(&decode_mutex);
+    HASH_ITER(hh, jobs, job, tmp)
+    {
+        if(job->key.layer != l || job->last_request == pass)
+            continue;
+        HASH_DEL(jobs, job);
+        if(job->state == RASTER_DECODED || job->state == RASTER_FAILED)
+            free_job(job);
+        else
+            job->cancelled = 1;
+    }
+    pthread_mutex_unlock(&decode_mutex);
+}
+
+void destroy_raster_decode()
+{
+    int i;
+    RASTER_JOB *job, *tmp;
+
+    pthread_mutex_lock(&decode_mutex);
+    stop_decoders = 1;
+    pthread_cond_broadcast(&decode_cond);
+    pthread_mutex_unlock(&decode_mutex);
+
+    for (i=0; i<n_decoders; i++)
+        pthread_join(decoders[i], NULL);
+    n_decoders = 0;
+
+    /*Everything left is either in the hash or cancelled in the queue*/
+    HASH_ITER(hh, jobs, job, tmp)
+    {
+        HASH_DEL(jobs, job);
+        job->cancelled = 1;
+        if(job->state != RASTER_QUEUED)
+            free_job(job);
+    }
+    while(queue_first)
+    {
+        job = queue_first;
+        queue_first = job->next;
+        free_job(job);
+    }
+    queue_last = NULL;
+}
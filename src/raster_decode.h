@@ -0,0 +1,65 @@
+/**********************************************************************
+ *
+ * TileLessMap
+ *
+ * TileLessMap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * TileLessMap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TileLessMap.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **********************************************************************
+ *
+ * Copyright (C) 2016-2018 Nicklas Avén
+ *
+ ***********************************************************************/
+#ifndef _raster_decode_H
+#define _raster_decode_H
+
+#include <pthread.h>
+#include "structures.h"
+#include "raster_cache.h"
+
+/*Upper limit of threads decoding raster tiles*/
+#define MAX_RASTER_DECODERS 4
+
+/*States of a tile in the decode queue*/
+#define RASTER_QUEUED 0
+#define RASTER_RUNNING 1
+#define RASTER_DECODED 2
+#define RASTER_FAILED 3
+
+/**
+ * A tile waiting to be decoded, or decoded and waiting to be uploaded.
+ * The compressed data is copied since the raster buffers of the layer
+ * can be refilled before the tile is decoded
+ */
+typedef struct RASTER_JOB
+{
+    RASTER_CACHE_KEY key;
+    uint8_t *data;
+    size_t data_len;
+    SDL_Surface *surface; // RGB24, ready for glTexImage2D
+    int state;
+    int cancelled; // no longer wanted, the decoder frees it when it is picked
+    unsigned int last_request;
+    struct RASTER_JOB *next;
+    UT_hash_handle hh;
+} RASTER_JOB;
+
+
+int init_raster_decode();
+SDL_Surface* raster_decode_tile(uint8_t *data, size_t data_len);
+unsigned int raster_decode_begin();
+int raster_decode_get(LAYER_RUNTIME *l, int x, int y, uint8_t *data, size_t data_len, SDL_Surface **surface);
+void raster_decode_end(LAYER_RUNTIME *l, unsigned int pass);
+void destroy_raster_decode();
+
+#endif
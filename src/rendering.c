@@ -27,6 +27,10 @@
 #include "SDL_image.h"
 #include "uthash.h"
 #include "utils.h"
+#include "raster_cache.h"
+#include "raster_decode.h"
+#include "stats.h"
+#include "fetch_pool.h"
 
 int loadPoint(LAYER_RUNTIME *oneLayer,GLfloat *theMatrix)
 {
@@ -76,6 +80,7 @@ int renderPoint(LAYER_RUNTIME *oneLayer,GLfloat *theMatrix)
 
 
     glUniformMatrix4fv(sym_matrix, 1, GL_FALSE,theMatrix );
+    glUniform4fv(sym_reproj, 4, oneLayer->reproj_poly);
 
 
     SDL_GL_SetAttribute( SDL_GL_DEPTH_SIZE,16);
@@ -161,6 +166,7 @@ int renderPoint(LAYER_RUNTIME *oneLayer,GLfloat *theMatrix)
             glUniform4fv(sym_color,1,color );
             glUniform1fv(sym_radius,1,&radius );
             glDrawArrays(GL_TRIANGLE_FAN, 0, sym_npoints/2);
+            STATS_DRAW_CALL();
 
         }
         p = points->points->list + points->point_start_indexes->list[i];
@@ -198,16 +204,14 @@ int loadLine(LAYER_RUNTIME *oneLayer,GLfloat *theMatrix)
     if(oneLayer->type & 8)
     {
         LINESTRING_LIST *line = oneLayer->wide_lines;
-        glBindBuffer(GL_ARRAY_BUFFER, line->vbo);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*line->vertex_array->used,line->vertex_array->list, GL_STATIC_DRAW);
+        upload_gpu_buffer(&(line->vbo), GL_ARRAY_BUFFER, line->vertex_array->list, sizeof(GLfloat)*line->vertex_array->used, oneLayer->data_version);
         renderLineTri(oneLayer,theMatrix);
     }
     else
     {
         LINESTRING_LIST *line = oneLayer->lines;
         //	 int i,j, offset=0;
-        glBindBuffer(GL_ARRAY_BUFFER, line->vbo);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*line->vertex_array->used,line->vertex_array->list, GL_STATIC_DRAW);
+        upload_gpu_buffer(&(line->vbo), GL_ARRAY_BUFFER, line->vertex_array->list, sizeof(GLfloat)*line->vertex_array->used, oneLayer->data_version);
         renderLine( oneLayer, theMatrix);
     }
     return 0;
@@ -241,7 +245,7 @@ int renderLineTri(LAYER_RUNTIME *oneLayer,GLfloat *theMatrix)
 
     GLfloat px_Matrix[16] = {sx, 0,0,0,0,sy,0,0,0,0,1,0,-1,-1,0,1};
     GLint unit = -1;
-    glBindBuffer(GL_ARRAY_BUFFER, line->vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, line->vbo.id);
 
     glUseProgram(lw_program);
 
@@ -271,6 +275,7 @@ int renderLineTri(LAYER_RUNTIME *oneLayer,GLfloat *theMatrix)
 
     log_this(10, "%f, %f,%f, %f,%f, %f,%f, %f,%f, %f,%f, %f,%f, %f,%f, %f",theMatrix[0],theMatrix[1],theMatrix[2],theMatrix[3],theMatrix[4],theMatrix[5],theMatrix[6],theMatrix[7],theMatrix[8],theMatrix[9],theMatrix[10],theMatrix[11],theMatrix[12],theMatrix[13],theMatrix[14],theMatrix[15]);
     glUniformMatrix4fv(lw_matrix, 1, GL_FALSE,theMatrix );
+    glUniform4fv(lw_reproj, 4, oneLayer->reproj_poly);
 
     SDL_GL_SetAttribute( SDL_GL_DEPTH_SIZE,16);
     glEnable (GL_DEPTH_TEST);
@@ -338,6 +343,7 @@ fprintf(stderr,"0 - opengl error:%d in func %s, i = %d\n", err, __func__,i);
             glUniform4fv(lw_color,1,color );
             glUniform1fv(lw_linewidth,1,&lw );
             glDrawArrays(GL_TRIANGLE_STRIP, n_vals_acc, n_vals);
+            STATS_DRAW_CALL();
             while ((err = glGetError()) != GL_NO_ERROR) {
                 log_this(10, "Problem1\n");
                 fprintf(stderr,"opengl error:%d in %s\n", err, __func__);
@@ -381,7 +387,7 @@ int renderLine(LAYER_RUNTIME *oneLayer,GLfloat *theMatrix)
 
     unsigned int n_vals = 0, n_vals_acc = 0;
     uint8_t ndims = oneLayer->n_dims;
-    glBindBuffer(GL_ARRAY_BUFFER, line->vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, line->vbo.id);
 
 
 
@@ -398,6 +404,7 @@ int renderLine(LAYER_RUNTIME *oneLayer,GLfloat *theMatrix)
     );
 
     glUniformMatrix4fv(std_matrix, 1, GL_FALSE,theMatrix );
+    glUniform4fv(std_reproj, 4, oneLayer->reproj_poly);
 
     unsigned int used_n_pa = line->line_start_indexes->used;
 
@@ -431,6 +438,7 @@ int renderLine(LAYER_RUNTIME *oneLayer,GLfloat *theMatrix)
 
 
             glDrawArrays(GL_LINE_STRIP, n_vals_acc, n_vals);
+            STATS_DRAW_CALL();
 
 
         }
@@ -450,17 +458,194 @@ fprintf(stderr,"0 - opengl error:%d in func %s\n", err, __func__);
 
 
 
+/*Max number of vertices a batch can address with GLushort indexes*/
+#define MAX_BATCH_VERTICES_16 65536
+
+typedef struct
+{
+    GLuint chunk;
+    struct STYLES *style;
+    GLuint poly;
+    GLuint first; //the first polygon in the chunk with the same style, the batches are drawn in that order
+} POLY_BATCH_ITEM;
+
+static int cmp_batch_item(const void *a, const void *b)
+{
+    const POLY_BATCH_ITEM *pa = (const POLY_BATCH_ITEM*) a;
+    const POLY_BATCH_ITEM *pb = (const POLY_BATCH_ITEM*) b;
+    if(pa->chunk != pb->chunk)
+        return pa->chunk < pb->chunk ? -1 : 1;
+    if(pa->style != pb->style)
+        return (uintptr_t) pa->style < (uintptr_t) pb->style ? -1 : 1;
+    if(pa->poly != pb->poly)
+        return pa->poly < pb->poly ? -1 : 1;
+    return 0;
+}
+
+/*The style pointers only group the items, the order between the batches comes from the layer, so it is the same every run*/
+static int cmp_batch_order(const void *a, const void *b)
+{
+    const POLY_BATCH_ITEM *pa = (const POLY_BATCH_ITEM*) a;
+    const POLY_BATCH_ITEM *pb = (const POLY_BATCH_ITEM*) b;
+    if(pa->chunk != pb->chunk)
+        return pa->chunk < pb->chunk ? -1 : 1;
+    if(pa->first != pb->first)
+        return pa->first < pb->first ? -1 : 1;
+    if(pa->poly != pb->poly)
+        return pa->poly < pb->poly ? -1 : 1;
+    return 0;
+}
+
+/*Without 32 bit indexes a polygon with more vertices than GLushort can address
+ * is expanded to plain triangles and drawn with glDrawArrays*/
+static void add_loose_polygon(POLYGON_LIST *poly, GLuint i, GLuint ndims, struct STYLES *style)
+{
+    GLuint first_element = i ? poly->element_start_indexes->list[i-1] : 0;
+    GLuint end_element = poly->element_start_indexes->list[i];
+    GLfloat *vertices = poly->vertex_array->list + poly->polygon_start_indexes->list[i];
+    GLuint e;
+
+    add2gluint_list(poly->loose_info, poly->loose_vertices->used / 2);
+    add2gluint_list(poly->loose_info, end_element - first_element);
+    add2pointer_list(poly->loose_style, style);
+
+    for (e=first_element; e<end_element; e++)
+        addbatch2glfloat_list(poly->loose_vertices, 2, vertices + ndims * poly->element_array->list[e]);
+}
+
+/**
+ * Group the triangles of all polygons by style so each style can be drawn with one call.
+ * The element indexes are rebased from the start of the polygon to the start of the batch.
+ * With 32 bit indexes everything fits in one chunk. Without them the vertex array is split
+ * in chunks that GLushort indexes can address, and a batch is all polygons in a chunk with the same style.
+ * The batches are drawn in the order their styles first appear in the layer.
+ */
+static int batch_polygons(LAYER_RUNTIME *oneLayer)
+{
+    POLYGON_LIST *poly = oneLayer->polygons;
+    GLuint used_n_poly = poly->polygon_start_indexes->used;
+    GLuint ndims = oneLayer->n_dims ? oneLayer->n_dims : 2;
+    GLuint i, k, n_items = 0;
+    GLuint chunk = 0, chunk_start = 0;
+    GLuint first_vertex, n_vertices, first_element, end_element;
+    GLuint max_vertices = have_uint_elements ? UINT32_MAX : MAX_BATCH_VERTICES_16;
+
+    reset_gluint_list(poly->batch_elements);
+    reset_glushort_list(poly->batch_elements16);
+    reset_gluint_list(poly->batch_info);
+    reset_pointer_list(poly->batch_style);
+    reset_glfloat_list(poly->loose_vertices);
+    reset_gluint_list(poly->loose_info);
+    reset_pointer_list(poly->loose_style);
+
+    if(!used_n_poly)
+        return 0;
+
+    POLY_BATCH_ITEM *items = st_malloc(used_n_poly * sizeof(POLY_BATCH_ITEM));
+
+    for (i=0; i<used_n_poly; i++)
+    {
+        struct STYLES *styles = (struct STYLES *) poly->style_id->list[i];
+        if(!styles)
+            styles=system_default_style;
+        if(!styles->polygon_styles)
+            continue;
+
+        first_vertex = poly->polygon_start_indexes->list[i] / ndims;
+        if(i < used_n_poly - 1)
+            n_vertices = poly->polygon_start_indexes->list[i+1] / ndims - first_vertex;
+        else
+            n_vertices = poly->vertex_array->used / ndims - first_vertex;
+
+        if(n_vertices > max_vertices)
+        {
+            add_loose_polygon(poly, i, ndims, styles);
+            continue;
+        }
+
+        if(n_items == 0 || first_vertex + n_vertices - chunk_start > max_vertices)
+        {
+            if(n_items > 0)
+                chunk++;
+            chunk_start = first_vertex;
+        }
+        items[n_items].chunk = chunk;
+        items[n_items].style = styles;
+        items[n_items].poly = i;
+        n_items++;
+    }
+
+    qsort(items, n_items, sizeof(POLY_BATCH_ITEM), cmp_batch_item);
+    for (k=0; k<n_items; k++)
+    {
+        if(k == 0 || items[k].chunk != items[k-1].chunk || items[k].style != items[k-1].style)
+            items[k].first = items[k].poly;
+        else
+            items[k].first = items[k-1].first;
+    }
+    qsort(items, n_items, sizeof(POLY_BATCH_ITEM), cmp_batch_order);
+
+    for (k=0; k<n_items; k++)
+    {
+        i = items[k].poly;
+        first_vertex = poly->polygon_start_indexes->list[i] / ndims;
+
+        /*new batch*/
+        if(k == 0 || items[k].chunk != items[k-1].chunk || items[k].style != items[k-1].style)
+        {
+            add2gluint_list(poly->batch_info, poly->polygon_start_indexes->list[i]);
+            add2gluint_list(poly->batch_info, poly->batch_elements->used);
+            add2gluint_list(poly->batch_info, 0);
+            add2pointer_list(poly->batch_style, items[k].style);
+        }
+        GLuint *info = poly->batch_info->list + poly->batch_info->used - 3;
+        GLuint offset = first_vertex - info[0] / ndims;
+
+        first_element = i ? poly->element_start_indexes->list[i-1] : 0;
+        end_element = poly->element_start_indexes->list[i];
+
+        addbatch2gluint_list(poly->batch_elements, end_element - first_element, poly->element_array->list + first_element);
+        if(offset)
+        {
+            GLuint *e = poly->batch_elements->list + poly->batch_elements->used - (end_element - first_element);
+            GLuint n;
+            for (n=0; n<end_element - first_element; n++)
+                e[n] += offset;
+        }
+        info[2] += end_element - first_element;
+    }
+    st_free(items);
+
+    /*All values fits in GLushort since the chunks are small enough*/
+    if(!have_uint_elements)
+    {
+        for (k=0; k<poly->batch_elements->used; k++)
+            add2glushort_list(poly->batch_elements16, (GLushort) poly->batch_elements->list[k]);
+    }
+    return 0;
+}
+
 int loadPolygon(LAYER_RUNTIME *oneLayer,GLfloat *theMatrix)
 {
 
     POLYGON_LIST *poly = oneLayer->polygons;
+    unsigned int version = oneLayer->data_version;
 
+    /*Nothing has changed since last time, everything is already on the gpu*/
+    if(poly->vbo.version != version)
+    {
+        batch_polygons(oneLayer);
 
-    glBindBuffer(GL_ARRAY_BUFFER, poly->vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*poly->vertex_array->used,poly->vertex_array->list, GL_STATIC_DRAW);
+        upload_gpu_buffer(&(poly->vbo), GL_ARRAY_BUFFER, poly->vertex_array->list, sizeof(GLfloat)*poly->vertex_array->used, version);
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, poly->ebo);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLshort)*poly->element_array->used, poly->element_array->list, GL_STATIC_DRAW);
+        if(have_uint_elements)
+            upload_gpu_buffer(&(poly->ebo), GL_ELEMENT_ARRAY_BUFFER, poly->batch_elements->list, sizeof(GLuint)*poly->batch_elements->used, version);
+        else
+            upload_gpu_buffer(&(poly->ebo), GL_ELEMENT_ARRAY_BUFFER, poly->batch_elements16->list, sizeof(GLushort)*poly->batch_elements16->used, version);
+
+        if(poly->loose_vertices->used)
+            upload_gpu_buffer(&(poly->lvbo), GL_ARRAY_BUFFER, poly->loose_vertices->list, sizeof(GLfloat)*poly->loose_vertices->used, version);
+    }
 
     if(oneLayer->type & 4)
         renderPolygon( oneLayer, theMatrix);
@@ -475,14 +660,14 @@ int renderPolygon(LAYER_RUNTIME *oneLayer,GLfloat *theMatrix)
     uint32_t i;//, np, pi;
     GLfloat *color;
     uint8_t ndims = oneLayer->n_dims;
-    size_t index_offset = 0;
     POLYGON_LIST *poly = oneLayer->polygons;
 
-    glBindBuffer(GL_ARRAY_BUFFER, poly->vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, poly->vbo.id);
     unsigned int n_vals = 0, n_vals_acc = 0;
 
     unsigned int used_n_pa;
     unsigned int used_n_poly;
+    unsigned int used_n_batch;
 
 
 
@@ -496,22 +681,23 @@ int renderPolygon(LAYER_RUNTIME *oneLayer,GLfloat *theMatrix)
 
         n_polys += used_n_poly;
 
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, poly->ebo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, poly->ebo.id);
         glUniformMatrix4fv(std_matrix, 1, GL_FALSE,theMatrix );
+        glUniform4fv(std_reproj, 4, oneLayer->reproj_poly);
 
         // n_polys += poly->pa_start_indexes->used;
         //total_points += poly->vertex_array->used/ndims;
         //n_tri += poly->element_array->used/3;
 
 
-        for (i=0; i<used_n_poly; i++)
+        /*One draw call per batch and symbolizer, see batch_polygons*/
+        used_n_batch = poly->batch_style->used;
+        for (i=0; i<used_n_batch; i++)
         {
-            size_t  vertex_offset = sizeof(GLfloat) * *(poly->polygon_start_indexes->list + i);
+            GLuint *info = poly->batch_info->list + 3*i;
+            size_t  vertex_offset = sizeof(GLfloat) * info[0];
+            size_t  index_offset = (have_uint_elements ? sizeof(GLuint) : sizeof(GLushort)) * info[1];
 
-            // printf("pa_list_index = %d, vertex_list_index_0 = %d\n", poly->polygon_start_indexes->list[i], poly->pa_start_indexes->list[0]);
-            // size_t  vertex_offset = sizeof(GLuint) * poly->pa_start_indexes->list[poly->polygon_start_indexes->list[i]];
-
-            //printf("vertex_offfset = %d\n", vertex_offset);
             glVertexAttribPointer(
                 std_coord2d, // attribute
                 2,                 // number of elements per vertex, here (x,y)
@@ -521,42 +707,45 @@ int renderPolygon(LAYER_RUNTIME *oneLayer,GLfloat *theMatrix)
                 (GLvoid*) vertex_offset                  // offset of first element
             );
 
+            style = ((struct STYLES *) poly->batch_style->list[i])->polygon_styles;
 
-            struct STYLES *styles = (struct STYLES *) *((struct STYLES **)poly->style_id->list +i);
-            if(!styles)
-                styles=system_default_style;
-            style = styles->polygon_styles;
-
-
-
-            n_vals = *(poly->element_start_indexes->list + i) - n_vals_acc;
-            n_vals_acc = *(poly->element_start_indexes->list + i);
-
-            if(!style)
-                continue;
             int r;
             for (r = 0; r<style->nsyms; r++)
             {
-
-
                 color = style->color->list + 4*r;
                 glUniform4fv(std_color,1,color );
 
-                //    printf("color = %f, %f, %f,  %f\n", color[0], color[1], color[2], color[3]);
-                glDrawElements(GL_TRIANGLES, n_vals,GL_UNSIGNED_SHORT,(GLvoid*) index_offset);
+                glDrawElements(GL_TRIANGLES, info[2],have_uint_elements ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT,(GLvoid*) index_offset);
+                STATS_DRAW_CALL();
             }
+        }
 
-            index_offset = sizeof(GLushort) * *(poly->element_start_indexes->list + i);
-
+        /*Polygons too big for 16 bit indexes*/
+        if(poly->loose_style->used)
+        {
+            glBindBuffer(GL_ARRAY_BUFFER, poly->lvbo.id);
+            glVertexAttribPointer(std_coord2d, 2, GL_FLOAT, GL_FALSE, 0, 0);
+            for (i=0; i<poly->loose_style->used; i++)
+            {
+                GLuint *info = poly->loose_info->list + 2*i;
+                style = ((struct STYLES *) poly->loose_style->list[i])->polygon_styles;
+                int r;
+                for (r = 0; r<style->nsyms; r++)
+                {
+                    glUniform4fv(std_color,1,style->color->list + 4*r );
+                    glDrawArrays(GL_TRIANGLES, info[0], info[1]);
+                    STATS_DRAW_CALL();
+                }
+            }
+            glBindBuffer(GL_ARRAY_BUFFER, poly->vbo.id);
         }
-        n_vals = n_vals_acc = 0;
         glDisableVertexAttribArray(std_coord2d);
     }
     
     if(!(oneLayer->type & 8))
     {
         LINE_STYLE *style = NULL;
-        glBindBuffer(GL_ARRAY_BUFFER, oneLayer->polygons->vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, oneLayer->polygons->vbo.id);
 
 
 
@@ -574,6 +763,7 @@ int renderPolygon(LAYER_RUNTIME *oneLayer,GLfloat *theMatrix)
         );
 
         glUniformMatrix4fv(std_matrix, 1, GL_FALSE,theMatrix );
+        glUniform4fv(std_reproj, 4, oneLayer->reproj_poly);
 
         used_n_pa = poly->pa_start_indexes->used;
 
@@ -605,6 +795,7 @@ int renderPolygon(LAYER_RUNTIME *oneLayer,GLfloat *theMatrix)
 
 
                     glDrawArrays(GL_LINE_LOOP, n_vals_acc, n_vals);
+                    STATS_DRAW_CALL();
                 }
             }
             n_vals_acc = *(poly->pa_start_indexes->list + i)/ndims;
@@ -627,7 +818,7 @@ fprintf(stderr,"0 - opengl error:%d in func %s\n", err, __func__);
 static int render_data_layers(MATRIX *theMatrix, CTRL *controls)
 {
     log_this(10, "Entering render_data\n");
-    int i;
+    int i, fetched;
     LAYER_RUNTIME *oneLayer;
 
     GLfloat meterPerPixel = (theMatrix->bbox[3]-theMatrix->bbox[1])/CURR_HEIGHT;
@@ -643,11 +834,28 @@ static int render_data_layers(MATRIX *theMatrix, CTRL *controls)
 //printf("render layer %s\n",oneLayer->name);
         if(oneLayer->visible && oneLayer->minScale<=meterPerPixel && oneLayer->maxScale>meterPerPixel)
         {
+            /*A fetch pool worker is writing to the buffers*/
+            if(fetch_pool_collect(oneLayer, &fetched))
+                continue;
 
 //~ 
             log_this(100, "render : %s\n",oneLayer->name);
+            stats_begin_layer(oneLayer);
+            update_reproj_poly(oneLayer, theMatrix->bbox);
             if(oneLayer->geometryType >= RASTER)
                 loadandRenderRaster( oneLayer, theMatrix->matrix);
+            else if(fetched)
+            {
+                /*Fetched since last frame, so it is uploaded before it is rendered*/
+                if(type & 224)
+                    loadPoint( oneLayer, theMatrix->matrix);
+                if(type & 24)
+                    loadLine( oneLayer, theMatrix->matrix);
+                if(type & 6)
+                    loadPolygon( oneLayer, theMatrix->matrix);
+                stats_end_layer(oneLayer);
+                continue;
+            }
             //     log_this(10, "render point");
             if (type & 32)
                 render_text(oneLayer, theMatrix->matrix);
@@ -662,6 +870,7 @@ static int render_data_layers(MATRIX *theMatrix, CTRL *controls)
             if(type & 4)
                 renderPolygon( oneLayer, theMatrix->matrix);
             //renderLine(oneLayer, theMatrix,1);
+            stats_end_layer(oneLayer);
 
 
         }
@@ -685,6 +894,7 @@ fprintf(stderr,"0 - opengl error:%d in func %s\n", err, __func__);
 
 int render_data(SDL_Window* window,MATRIX *theMatrix, CTRL *controls)
 {
+    stats_begin_frame();
     glClearColor(1.0, 1.0, 1.0, 1.0);
     glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
 
@@ -694,6 +904,7 @@ int render_data(SDL_Window* window,MATRIX *theMatrix, CTRL *controls)
     {
         loadPolygon(infoRenderLayer, theMatrix->matrix);
     }
+    stats_end_frame();
     SDL_GL_SwapWindow(window);
 
     return 0;
@@ -722,8 +933,7 @@ int load_text(LAYER_RUNTIME *oneLayer)
     TEXTBLOCK *tb = oneLayer->text->tb;
     tb->txt_info->points = oneLayer->points;
     
-    glBindBuffer(GL_ARRAY_BUFFER, tb->txt_info->points->tbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(float)*4*(tb->dims->coords->used), tb->dims->coords->coords, GL_STATIC_DRAW);       
+    upload_gpu_buffer(&(tb->txt_info->points->tbo), GL_ARRAY_BUFFER, tb->dims->coords->coords, sizeof(float)*4*(tb->dims->coords->used), oneLayer->data_version);
     
      while ((err = glGetError()) != GL_NO_ERROR) {
         log_this(10, "Problem 2\n");
@@ -776,10 +986,11 @@ float delta[2];
     
     glUseProgram(txt2_program);
     glUniformMatrix4fv(txt2_matrix, 1, GL_FALSE,theMatrix );
+    glUniform4fv(txt2_reproj, 4, oneLayer->reproj_poly);
     
     glUniformMatrix4fv(txt2_px_matrix, 1, GL_FALSE,pxMatrix );
     
-    glBindBuffer(GL_ARRAY_BUFFER, point->tbo);
+    glBindBuffer(GL_ARRAY_BUFFER, point->tbo.id);
     
     while ((err = glGetError()) != GL_NO_ERROR) {
         fprintf(stderr,"4 - opengl error:%d in func %s\n", err, __func__);
@@ -852,6 +1063,7 @@ float delta[2];
                 glUniform4fv(txt2_color,1,color );
                 
                 glDrawArrays(GL_TRIANGLES, tot_points,npoints);       
+                STATS_DRAW_CALL();
        //           glDrawArrays(GL_TRIANGLE_STRIP, tot_points,n_points);       
                 tot_points+=npoints;
                 
@@ -885,9 +1097,10 @@ int draw_txt(TEXTBLOCK *tb,GLfloat *theMatrix,GLfloat *pxMatrix, float *anchor,
     
     glUniformMatrix4fv(txt2_px_matrix, 1, GL_FALSE,pxMatrix );
     
-    glBindBuffer(GL_ARRAY_BUFFER, point->tbo);
+    glBindBuffer(GL_ARRAY_BUFFER, point->tbo.id);
     
     glUseProgram(txt2_program);
+    reset_reproj_uniform(txt2_reproj);
     glEnableVertexAttribArray(txt2_box);
     /* Describe our vertices array to OpenGL (it can't guess its format automatically) */
     
@@ -937,6 +1150,7 @@ float delta[2];
                 glUniform4fv(txt2_color,1,color );
                 
                 glDrawArrays(GL_TRIANGLES, tot_points,n_points);       
+                STATS_DRAW_CALL();
        //           glDrawArrays(GL_TRIANGLE_STRIP, tot_points,n_points);       
                 tot_points+=n_points;
         }
@@ -1027,16 +1241,19 @@ int renderGPS(GLfloat *theMatrix)
     glUniform4fv(gps_color,1,color1 );
     glUniform1fv(gps_radius,1,&radius1 );
     glDrawArrays(GL_TRIANGLE_FAN, 0, (gps_npoints+2) * 2);
+    STATS_DRAW_CALL();
 
     glUniformMatrix4fv(gps_px_matrix, 1, GL_FALSE,px_Matrix );
     glUniform4fv(gps_color,1,color2 );
     glUniform1fv(gps_radius,1,&radius2 );
     glDrawArrays(GL_TRIANGLE_FAN, 0, (gps_npoints+2) * 2);
+    STATS_DRAW_CALL();
 
     glUniformMatrix4fv(gps_px_matrix, 1, GL_FALSE,px_Matrix );
     glUniform4fv(gps_color,1,color3 );
     glUniform1fv(gps_radius,1,&radius3 );
     glDrawArrays(GL_TRIANGLE_FAN, 0, (gps_npoints+2) * 2);
+    STATS_DRAW_CALL();
 
 
 
@@ -1054,6 +1271,45 @@ int renderGPS(GLfloat *theMatrix)
 }
 
 
+/*Upload a decoded tile as a new texture*/
+GLuint load_raster_texture(SDL_Surface *res_texture, size_t *bytes)
+{
+    GLuint texture_id;
+    glGenTextures(1, &texture_id);
+    glBindTexture(GL_TEXTURE_2D, texture_id);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexImage2D(GL_TEXTURE_2D, // target
+                 0,  // level, 0 = base, no minimap,
+                 GL_RGB, // internalformat
+                 res_texture->w,  // width
+                 res_texture->h,  // height
+                 0,  // border, always 0 in OpenGL ES
+                 GL_RGB,  // format
+                 GL_UNSIGNED_BYTE, // type
+                 res_texture->pixels);
+    *bytes = (size_t) res_texture->w * res_texture->h * 3;
+    STATS_UPLOAD(*bytes);
+    return texture_id;
+}
+
+/*A light grey texture drawn where the tiles are not decoded yet*/
+static GLuint get_placeholder_texture()
+{
+    static GLuint placeholder = 0;
+    GLubyte grey[4] = {225, 225, 225, 0};
+
+    if(placeholder)
+        return placeholder;
+
+    glGenTextures(1, &placeholder);
+    glBindTexture(GL_TEXTURE_2D, placeholder);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 1, 1, 0, GL_RGB, GL_UNSIGNED_BYTE, grey);
+    return placeholder;
+}
+
 int loadandRenderRaster(LAYER_RUNTIME *oneLayer,GLfloat *theMatrix)
 {
 
@@ -1062,97 +1318,74 @@ int loadandRenderRaster(LAYER_RUNTIME *oneLayer,GLfloat *theMatrix)
     RASTER_LIST *rast = oneLayer->rast;
     LINESTRING_LIST *line = oneLayer->lines;
     size_t  vertex_offset = 0;
-    GLuint vbo_cube_texcoords;
-    GLfloat cube_texcoords[2*4] = {
-        // front
-        0.0, 0.0,
-        1.0, 0.0,
-        1.0, 1.0,
-        0.0, 1.0,
-    };
-    vbo_cube_texcoords = rast->cvbo;
-    glBindBuffer(GL_ARRAY_BUFFER, vbo_cube_texcoords);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(cube_texcoords), cube_texcoords, GL_STATIC_DRAW);
-
-    GLuint ibo_cube_elements;
-    GLushort cube_elements[] = {
-        // front
-        0,  1,  2,
-        2,  3,  0
-    };
-
-    ibo_cube_elements = rast->cibo;
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo_cube_elements);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(cube_elements), cube_elements, GL_STATIC_DRAW);
-
-
+    size_t bytes;
+    SDL_Surface *surface;
+    int decoded;
+    unsigned int pass = raster_decode_begin();
 
+    /*The texture coordinates and the elements are the same for all tiles
+     * and loaded once in init_raster_list*/
+    GLuint vbo_cube_texcoords = rast->cvbo;
+    GLuint ibo_cube_elements = rast->cibo;
+    GLuint vbo_cube_vertices = rast->vbo;
 
     glUseProgram(raster_program);
 
     glActiveTexture(GL_TEXTURE0);
 
     glUniformMatrix4fv(raster_matrix, 1, GL_FALSE,theMatrix );
+    glUniform1i(raster_texture, /*GL_TEXTURE*/0);
+
+    glEnableVertexAttribArray(raster_texcoord);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo_cube_texcoords);
+    glVertexAttribPointer(
+        raster_texcoord, // attribute
+        2,                  // number of elements per vertex, here (x,y)
+        GL_FLOAT,           // the type of each element
+        GL_FALSE,           // take our values as-is
+        0,                  // no extra data between each position
+        0                   // offset of first element
+    );
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo_cube_elements);
+
     for (i=0; i<rast->raster_start_indexes->used; i++)
     {
         uint8_t *data = rast->data->list + tot_index;
         size_t data_len = rast->raster_start_indexes->list[i];
-        SDL_Surface* res_texture =  IMG_Load_RW(SDL_RWFromMem(data, data_len), 1);
+        int x = rast->tileidxy->list[2*i];
+        int y = rast->tileidxy->list[2*i+1];
+
+        vertex_offset = i ? line->line_start_indexes->list[i-1] : 0;
+        tot_index+=data_len;
 
-        if (res_texture == NULL)
+        /*Tiles we have seen before are already on the gpu.
+         * Others are decoded in the background and we draw a placeholder until they are ready*/
+        GLuint texture_id = raster_cache_get(oneLayer, x, y);
+        if(!texture_id)
         {
-            continue;
+            decoded = raster_decode_get(oneLayer, x, y, data, data_len, &surface);
+            if(decoded < 0)
+                continue;
+            if(decoded)
+            {
+                texture_id = load_raster_texture(surface, &bytes);
+                SDL_FreeSurface(surface);
+                raster_cache_add(oneLayer, x, y, texture_id, bytes, 0);
+            }
+            else
+                texture_id = get_placeholder_texture();
         }
-        GLuint texture_id;
-        glGenTextures(1, &texture_id);
-        glBindTexture(GL_TEXTURE_2D, texture_id);
-
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexImage2D(GL_TEXTURE_2D, // target
-                     0,  // level, 0 = base, no minimap,
-                     GL_RGB, // internalformat
-                     res_texture->w,  // width
-                     res_texture->h,  // height
-                     0,  // border, always 0 in OpenGL ES
-                     GL_RGB,  // format
-                     GL_UNSIGNED_BYTE, // type
-                     res_texture->pixels);
-        SDL_FreeSurface(res_texture);
-
-
-
 
         GLfloat *d = line->vertex_array->list+vertex_offset;
-        /*
-        printf("vertex_offset = %zu of %zu\n", vertex_offset, line->vertex_array->used);
-            int z;
-            for (z=0;z<8;z++)
-            {
-             printf("val %d = %f and tile_size = %zu \n",z, d[z], data_len);
-            }*/
-
-
-
 
-
-        GLuint vbo_cube_vertices;
-        
-        vbo_cube_vertices = rast->vbo;
         glBindBuffer(GL_ARRAY_BUFFER, vbo_cube_vertices);
         glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 8, d, GL_STATIC_DRAW);
 
-
-
-
-
-
-
-        glUniform1i(raster_texture, /*GL_TEXTURE*/0);
         glBindTexture(GL_TEXTURE_2D, texture_id);
 
         glEnableVertexAttribArray(raster_coord2d);
         // Describe our vertices array to OpenGL (it can't guess its format automatically)
-        glBindBuffer(GL_ARRAY_BUFFER, vbo_cube_vertices);
         glVertexAttribPointer(
             raster_coord2d, // attribute
             2,                 // number of elements per vertex, here (x,y,z)
@@ -1162,36 +1395,16 @@ int loadandRenderRaster(LAYER_RUNTIME *oneLayer,GLfloat *theMatrix)
             0 //(GLvoid*) vertex_offset                  // offset of first element
         );
 
-
-
-
-        // size_t  vertex_offset = 8*i*sizeof(GLfloat);
-        glEnableVertexAttribArray(raster_texcoord);
-        glBindBuffer(GL_ARRAY_BUFFER, vbo_cube_texcoords);
-        glVertexAttribPointer(
-            raster_texcoord, // attribute
-            2,                  // number of elements per vertex, here (x,y)
-            GL_FLOAT,           // the type of each element
-            GL_FALSE,           // take our values as-is
-            0,                  // no extra data between each position
-            0                   // offset of first element
-        );
-
         /* Push each element in buffer_vertices to the vertex shader */
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo_cube_elements);
-        int size;
-        glGetBufferParameteriv(GL_ELEMENT_ARRAY_BUFFER, GL_BUFFER_SIZE, &size);
-
-        glDrawElements(GL_TRIANGLES, size/sizeof(GLushort), GL_UNSIGNED_SHORT, 0);
-
-        glDisableVertexAttribArray(raster_coord2d);
-        glDisableVertexAttribArray(raster_texcoord);
-
-
-        vertex_offset =  *(line->line_start_indexes->list + i);
-        tot_index+=data_len;
+        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+        STATS_DRAW_CALL();
     }
 
+    glDisableVertexAttribArray(raster_coord2d);
+    glDisableVertexAttribArray(raster_texcoord);
+
+    /*Stop decoding tiles that are not in the view any more*/
+    raster_decode_end(oneLayer, pass);
 
     glUseProgram(0);
     return 0;
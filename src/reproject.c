@@ -37,6 +37,8 @@ static double g1;
 static double g2;
 static double g3;
 
+/*The fetch workers reproject in parallel, so the constants must only be initialized once*/
+static pthread_once_t reproj_once = PTHREAD_ONCE_INIT;
 
 
 static void init_reproj()
@@ -58,21 +60,20 @@ static void init_reproj()
 }
 
 
-void reproject(GLfloat *points,uint8_t utm_in,uint8_t utm_out, uint8_t hemi_in, uint8_t hemi_out)
+/*The reprojection in double precision, reproject rounds the result to float*/
+static void reproject_double(double *points,uint8_t utm_in,uint8_t utm_out, uint8_t hemi_in, uint8_t hemi_out)
 {
-
-    if(utm_in == utm_out && hemi_in == hemi_out)
-        return;
-
     double N,T,C,A, AA,M, phi,lng, lngd, x, y;
     int zcm;
     int south;
     double  mu, phi1, C1, T1, N1, R1, D, DD;
 
+    if(utm_in == utm_out && hemi_in == hemi_out)
+        return;
 
     if(!k0)
     {
-        init_reproj();
+        pthread_once(&reproj_once, init_reproj);
     }
 
     if(utm_in > 0)
@@ -172,8 +173,8 @@ void reproject(GLfloat *points,uint8_t utm_in,uint8_t utm_out, uint8_t hemi_in,
         /*
         printf("%f, %f\n",x,y);
           */
-        points[0] = (GLfloat) x;
-        points[1] = (GLfloat) y;
+        points[0] = x;
+        points[1] = y;
     }
     else
     {
@@ -191,4 +192,279 @@ void reproject(GLfloat *points,uint8_t utm_in,uint8_t utm_out, uint8_t hemi_in,
 }//End UTM to Geog
 
 
+void reproject(GLfloat *points,uint8_t utm_in,uint8_t utm_out, uint8_t hemi_in, uint8_t hemi_out)
+{
+    double p[2];
 
+    if(utm_in == utm_out && hemi_in == hemi_out)
+        return;
+
+    p[0] = points[0];
+    p[1] = points[1];
+    reproject_double(p, utm_in, utm_out, hemi_in, hemi_out);
+    points[0] = (GLfloat) p[0];
+    points[1] = (GLfloat) p[1];
+}
+
+
+
+/********************************************************************
+ * Correction grid
+ *
+ * Inside a view the reprojection from one utm zone to another is
+ * very smooth. So instead of reprojecting every vertex we reproject
+ * the nodes of a grid over the view, and interpolate bilinear between
+ * them. When the grid is built the error is measured in the middle of
+ * every cell and on the cell edges, and if it is bigger than max_error
+ * the grid is not used.
+ *********************************************************************/
+
+static void grid_interpolate(REPROJ_GRID *g, double fx, double fy, double *out)
+{
+    int n = REPROJ_GRID_SIZE + 1;
+    int ix = (int) fx;
+    int iy = (int) fy;
+    double *n00, *n10, *n01, *n11;
+
+    if(ix >= REPROJ_GRID_SIZE)
+        ix = REPROJ_GRID_SIZE - 1;
+    if(iy >= REPROJ_GRID_SIZE)
+        iy = REPROJ_GRID_SIZE - 1;
+    fx -= ix;
+    fy -= iy;
+
+    n00 = g->nodes + 2 * (iy * n + ix);
+    n10 = n00 + 2;
+    n01 = n00 + 2 * n;
+    n11 = n01 + 2;
+
+    out[0] = (n00[0] * (1 - fx) + n10[0] * fx) * (1 - fy) + (n01[0] * (1 - fx) + n11[0] * fx) * fy;
+    out[1] = (n00[1] * (1 - fx) + n10[1] * fx) * (1 - fy) + (n01[1] * (1 - fx) + n11[1] * fx) * fy;
+}
+
+/*The error of the grid compared to reprojecting the point, at position fx, fy in cells*/
+static double grid_error(REPROJ_GRID *g, double fx, double fy)
+{
+    GLfloat p[2];
+    double res[2];
+
+    p[0] = (GLfloat) (g->minx + fx * g->cell_w);
+    p[1] = (GLfloat) (g->miny + fy * g->cell_h);
+    reproject(p, g->utm_in, g->utm_out, g->hemi_in, g->hemi_out);
+    grid_interpolate(g, fx, fy, res);
+    return fmax(fabs(res[0] - p[0]), fabs(res[1] - p[1]));
+}
+
+/**
+ * Build a grid over box (minx, miny, maxx, maxy in the input projection).
+ * Returns 0 if the grid can be used, 1 if the error is too big.
+ */
+int reproj_grid_build(REPROJ_GRID *g, GLfloat *box, uint8_t utm_in, uint8_t utm_out, uint8_t hemi_in, uint8_t hemi_out, GLfloat max_error)
+{
+    int n = REPROJ_GRID_SIZE + 1;
+    int i, j;
+    GLfloat p[2];
+    GLfloat max_coord = 0;
+    double err, max_err = 0;
+
+    g->valid = 0;
+    if(!g->nodes)
+        g->nodes = malloc(2 * n * n * sizeof(double));
+    if(!g->nodes)
+        return 1;
+
+    g->utm_in = utm_in;
+    g->utm_out = utm_out;
+    g->hemi_in = hemi_in;
+    g->hemi_out = hemi_out;
+    g->minx = box[0];
+    g->miny = box[1];
+    g->cell_w = (box[2] - box[0]) / (double) REPROJ_GRID_SIZE;
+    g->cell_h = (box[3] - box[1]) / (double) REPROJ_GRID_SIZE;
+    if(g->cell_w <= 0 || g->cell_h <= 0)
+        return 1;
+
+    for (j=0; j<n; j++)
+    {
+        for (i=0; i<n; i++)
+        {
+            p[0] = (GLfloat) (g->minx + i * g->cell_w);
+            p[1] = (GLfloat) (g->miny + j * g->cell_h);
+            reproject(p, utm_in, utm_out, hemi_in, hemi_out);
+            g->nodes[2 * (j * n + i)] = p[0];
+            g->nodes[2 * (j * n + i) + 1] = p[1];
+            max_coord = fmaxf(max_coord, fmaxf(fabsf(p[0]), fabsf(p[1])));
+        }
+    }
+
+    /*Both the input and the output is rounded to float, so we can't measure better than that*/
+    max_error += 2 * (nextafterf(max_coord, INFINITY) - max_coord);
+
+    for (j=0; j<REPROJ_GRID_SIZE && max_err <= max_error; j++)
+    {
+        for (i=0; i<REPROJ_GRID_SIZE && max_err <= max_error; i++)
+        {
+            err = fmax(grid_error(g, i + 0.5, j + 0.5), fmax(grid_error(g, i + 0.5, j), grid_error(g, i, j + 0.5)));
+            if(err > max_err)
+                max_err = err;
+        }
+    }
+    if(max_err > max_error)
+        return 1;
+
+    g->valid = 1;
+    return 0;
+}
+
+void reproj_grid_destroy(REPROJ_GRID *g)
+{
+    free(g->nodes);
+    g->nodes = NULL;
+    g->valid = 0;
+}
+
+/**
+ * Reproject npoints points, stride values apart.
+ * Points inside a valid grid for the same zones are interpolated from the grid, the rest are reprojected one by one.
+ * g can be NULL
+ */
+void reproject_batch(GLfloat *points, uint32_t npoints, uint32_t stride, REPROJ_GRID *g, uint8_t utm_in, uint8_t utm_out, uint8_t hemi_in, uint8_t hemi_out)
+{
+    uint32_t i;
+    double fx, fy, res[2];
+    GLfloat *p;
+
+    if(utm_in == utm_out && hemi_in == hemi_out)
+        return;
+
+    if(!g || !g->valid || g->utm_in != utm_in || g->utm_out != utm_out || g->hemi_in != hemi_in || g->hemi_out != hemi_out)
+    {
+        for (i=0; i<npoints; i++)
+            reproject(points + i * stride, utm_in, utm_out, hemi_in, hemi_out);
+        return;
+    }
+
+    for (i=0; i<npoints; i++)
+    {
+        p = points + i * stride;
+        fx = (p[0] - g->minx) / g->cell_w;
+        fy = (p[1] - g->miny) / g->cell_h;
+        if(fx < 0 || fy < 0 || fx > REPROJ_GRID_SIZE || fy > REPROJ_GRID_SIZE)
+        {
+            reproject(p, utm_in, utm_out, hemi_in, hemi_out);
+            continue;
+        }
+        grid_interpolate(g, fx, fy, res);
+        p[0] = (GLfloat) res[0];
+        p[1] = (GLfloat) res[1];
+    }
+}
+
+
+
+
+/********************************************************************
+ * Reprojection in the vertex shaders
+ *
+ * Around a view the reprojection is close to a second degree
+ * polynomial of the distance from the view center. The coefficients
+ * are given to the shaders as uniform vec4 reproj[4]:
+ * reproj[0]    center in the input projection (xy) and in the output projection (zw)
+ * reproj[1]    the linear terms for x (xy) and for y (zw)
+ * reproj[2]    dx*dx, dx*dy and dy*dy terms for x
+ * reproj[3]    dx*dx, dx*dy and dy*dy terms for y
+ *********************************************************************/
+
+void reproj_poly_identity(GLfloat *poly)
+{
+    memset(poly, 0, 16 * sizeof(GLfloat));
+    poly[4] = 1;
+    poly[7] = 1;
+}
+
+/*The polynomial at distance dx, dy from the center, relative to the output center*/
+static void poly_eval(double *coef, double dx, double dy, double *out)
+{
+    out[0] = coef[0] * dx + coef[1] * dy + coef[4] * dx * dx + coef[5] * dx * dy + coef[6] * dy * dy;
+    out[1] = coef[2] * dx + coef[3] * dy + coef[7] * dx * dx + coef[8] * dx * dy + coef[9] * dy * dy;
+}
+
+/**
+ * Fit the polynomial over box (minx, miny, maxx, maxy in the input projection).
+ * The derivatives are taken from the exact reprojection of the center, the corners
+ * and the edge midpoints. Returns 0 if the error is below max_error over the whole box, else 1.
+ * The uniform is written also if the error is too big.
+ */
+int reproj_poly_build(GLfloat *poly, GLfloat *box, uint8_t utm_in, uint8_t utm_out, uint8_t hemi_in, uint8_t hemi_out, GLfloat max_error)
+{
+    double f[3][3][2];
+    double coef[10];
+    double c[2], p[2], res[2];
+    double hx, hy, err, max_err = 0;
+    GLfloat cx, cy, max_coord;
+    int i, j, k;
+
+    reproj_poly_identity(poly);
+    if(utm_in == utm_out && hemi_in == hemi_out)
+        return 0;
+
+    /*The center has to be exactly the float the shaders get*/
+    cx = (GLfloat) ((box[0] + box[2]) / 2.0);
+    cy = (GLfloat) ((box[1] + box[3]) / 2.0);
+    hx = (box[2] - box[0]) / 2.0;
+    hy = (box[3] - box[1]) / 2.0;
+    if(hx <= 0 || hy <= 0)
+        return 1;
+
+    for (j=0; j<3; j++)
+    {
+        for (i=0; i<3; i++)
+        {
+            f[j][i][0] = cx + (i - 1) * hx;
+            f[j][i][1] = cy + (j - 1) * hy;
+            reproject_double(f[j][i], utm_in, utm_out, hemi_in, hemi_out);
+        }
+    }
+    c[0] = (GLfloat) f[1][1][0];
+    c[1] = (GLfloat) f[1][1][1];
+
+    for (k=0; k<2; k++)
+    {
+        coef[k * 2] = (f[1][2][k] - f[1][0][k]) / (2 * hx);
+        coef[k * 2 + 1] = (f[2][1][k] - f[0][1][k]) / (2 * hy);
+        coef[4 + k * 3] = (f[1][2][k] - 2 * f[1][1][k] + f[1][0][k]) / (2 * hx * hx);
+        coef[5 + k * 3] = (f[2][2][k] - f[0][2][k] - f[2][0][k] + f[0][0][k]) / (4 * hx * hy);
+        coef[6 + k * 3] = (f[2][1][k] - 2 * f[1][1][k] + f[0][1][k]) / (2 * hy * hy);
+    }
+
+    /*The shaders work in float, so we can't do better than the float resolution of the coordinates*/
+    max_coord = fmaxf(fabsf((GLfloat) c[0]), fabsf((GLfloat) c[1]));
+    max_error += 2 * (nextafterf(max_coord, INFINITY) - max_coord);
+
+    for (j=0; j<=4 && max_err <= max_error; j++)
+    {
+        for (i=0; i<=4 && max_err <= max_error; i++)
+        {
+            p[0] = cx + (i - 2) * hx / 2;
+            p[1] = cy + (j - 2) * hy / 2;
+            poly_eval(coef, p[0] - cx, p[1] - cy, res);
+            reproject_double(p, utm_in, utm_out, hemi_in, hemi_out);
+            err = fmax(fabs(c[0] + res[0] - p[0]), fabs(c[1] + res[1] - p[1]));
+            if(err > max_err)
+                max_err = err;
+        }
+    }
+
+    poly[0] = cx;
+    poly[1] = cy;
+    poly[2] = (GLfloat) c[0];
+    poly[3] = (GLfloat) c[1];
+    for (k=0; k<4; k++)
+        poly[4 + k] = (GLfloat) coef[k];
+    for (k=0; k<3; k++)
+    {
+        poly[8 + k] = (GLfloat) coef[4 + k];
+        poly[12 + k] = (GLfloat) coef[7 + k];
+    }
+    return max_err > max_error;
+}
@@ -148,6 +148,23 @@ void reset_shaders(GLuint vs,GLuint fs, GLuint program)
 
 
 
+/*Set the reproj uniform of the program in use to no reprojection*/
+void reset_reproj_uniform(GLint location)
+{
+    GLfloat poly[16];
+    reproj_poly_identity(poly);
+    glUniform4fv(location, 4, poly);
+}
+
+/*Reprojection of layers in another utm zone, see reproj_poly_build.
+ * With the identity the point is returned as it is*/
+#define REPROJ_GLSL "uniform vec4 reproj[4]; \
+vec2 reproject(vec2 p) { \
+vec2 d = p - reproj[0].xy; \
+vec3 q = vec3(d.x * d.x, d.x * d.y, d.y * d.y); \
+return reproj[0].zw + vec2(dot(reproj[1].xy, d) + dot(reproj[2].xyz, q), dot(reproj[1].zw, d) + dot(reproj[3].xyz, q)); \
+} "
+
 int build_program()
 {
     GLuint vs, fs;
@@ -158,10 +175,10 @@ int build_program()
 
 
 
-    const unsigned char gen_vstd[1024] =  "attribute vec2 coord2d; \
+    const unsigned char gen_vstd[1024] =  REPROJ_GLSL "attribute vec2 coord2d; \
 uniform mat4 theMatrix;\
 void main(void) { \
-  gl_Position =  theMatrix * vec4(coord2d,  1.0, 1.0);  \
+  gl_Position =  theMatrix * vec4(reproject(coord2d),  1.0, 1.0);  \
 }";
 
     const unsigned char gen_fstd[1024] = "uniform vec4 color; \
@@ -191,6 +208,15 @@ void main(void) { \
         return 1;
     }
 
+    std_reproj = glGetUniformLocation(std_program, "reproj");
+    if (std_reproj == -1) {
+        log_this(100, "Could not bind uniform : %s\n", "reproj");
+        return 1;
+    }
+    glUseProgram(std_program);
+    reset_reproj_uniform(std_reproj);
+    glUseProgram(0);
+
 
     reset_shaders(vs, fs, std_program);
 
@@ -264,7 +290,7 @@ void main(void) {\
 
 
 
-    const unsigned char gen_vtxt2[2048] =  "attribute vec4 box;\
+    const unsigned char gen_vtxt2[2048] =  REPROJ_GLSL "attribute vec4 box;\
 uniform vec2 coord2d; \
 uniform mat4 theMatrix; \
 uniform mat4 px_Matrix; \
@@ -274,7 +300,7 @@ varying vec2 texpos;\
 void main(void) {\
 vec4 npos = px_Matrix * vec4(box.xy, 0.0, 0.0); \
 vec4 dpos = px_Matrix * vec4(delta,0,0); \
-vec4 pos = theMatrix * vec4(coord2d, 1.0, 1.0);  \
+vec4 pos = theMatrix * vec4(reproject(coord2d), 1.0, 1.0);  \
   gl_Position = (pos + npos + dpos); \
   texpos = box.zw;\
     }";
@@ -324,6 +350,15 @@ void main(void) {\
         log_this(100, "Could not bind uniform : %s\n", "coord2d");
         return 1;
     }
+
+    txt2_reproj = glGetUniformLocation(txt2_program, "reproj");
+    if (txt2_reproj == -1) {
+        log_this(100, "Could not bind uniform : %s\n", "reproj");
+        return 1;
+    }
+    glUseProgram(txt2_program);
+    reset_reproj_uniform(txt2_reproj);
+    glUseProgram(0);
     txt_tex = glGetUniformLocation(txt2_program, "tex");
     if (txt2_tex == -1)
     {
@@ -340,7 +375,7 @@ void main(void) {\
 
     /*create a shader program lines with width*/
 
-    const unsigned char gen_vlw[1024] =  "attribute vec2 coord2d; \
+    const unsigned char gen_vlw[1024] =  REPROJ_GLSL "attribute vec2 coord2d; \
 attribute vec2 norm;\
 uniform float linewidth;\
 uniform float z;\
@@ -349,7 +384,7 @@ uniform mat4 theMatrix;\
 void main(void) { \
 vec4 delta = vec4(norm * linewidth,0,0); \
 vec4 npos = px_Matrix * delta; \
-vec4 pos = theMatrix * vec4(coord2d, z, 1.0);  \
+vec4 pos = theMatrix * vec4(reproject(coord2d), z, 1.0);  \
   gl_Position = (pos + npos);\
 }";
 
@@ -412,6 +447,15 @@ void main(void) { \
         fprintf(stderr, "Could not bind uniform : %s\n", "lw_px_matrix");
         return 1;
     }
+    lw_reproj = glGetUniformLocation(lw_program, "reproj");
+    if (lw_reproj == -1)
+    {
+        fprintf(stderr, "Could not bind uniform : %s\n", "reproj");
+        return 1;
+    }
+    glUseProgram(lw_program);
+    reset_reproj_uniform(lw_reproj);
+    glUseProgram(0);
 
 
 
@@ -501,7 +545,7 @@ void main(void) { \
 
     /*create a shader program symbols*/
 
-    const unsigned char gen_vsym[1024] =  "attribute vec2 norm; \
+    const unsigned char gen_vsym[1024] =  REPROJ_GLSL "attribute vec2 norm; \
 uniform float radius; \
 uniform vec2 coord2d;  \
 uniform float z;\
@@ -510,7 +554,7 @@ uniform mat4 theMatrix; \
 void main(void) {  \
 vec4 delta = vec4(norm * radius,0,0); \
 vec4 npos = px_Matrix * delta; \
-vec4 pos = theMatrix * vec4(coord2d, z, 1.0);  \
+vec4 pos = theMatrix * vec4(reproject(coord2d), z, 1.0);  \
   gl_Position = (pos + npos); \
 }";
 
@@ -576,6 +620,15 @@ void main(void) { \
         fprintf(stderr, "Could not bind uniform : %s\n", "sym_px_matrix");
         return 1;
     }
+    sym_reproj = glGetUniformLocation(sym_program, "reproj");
+    if (sym_reproj == -1)
+    {
+        fprintf(stderr, "Could not bind uniform : %s\n", "reproj");
+        return 1;
+    }
+    glUseProgram(sym_program);
+    reset_reproj_uniform(sym_reproj);
+    glUseProgram(0);
 
 
 
@@ -22,6 +22,7 @@
  ***********************************************************************/
 
 #include "theclient.h"
+#include "stats.h"
 
 
 
@@ -94,6 +95,7 @@ int render_simple_rect(GLshort *coords, GLfloat *color, MATRIX *matrix_hndl)
     glUseProgram(std_program);
 
 
+    reset_reproj_uniform(std_reproj);
     glUniform4fv(std_color,1,norm_color );
     glUniformMatrix4fv(std_matrix, 1, GL_FALSE,theMatrix );
 
@@ -132,6 +134,7 @@ int render_simple_rect(GLshort *coords, GLfloat *color, MATRIX *matrix_hndl)
 
 
     glDrawElements(GL_TRIANGLES, 6,GL_UNSIGNED_SHORT,NULL);
+    STATS_DRAW_CALL();
 
 
     glDisableVertexAttribArray(std_coord2d);
@@ -0,0 +1,350 @@
+/**********************************************************************
+ *
+ * TileLessMap
+ *
+ * TileLessMap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * TileLessMap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TileLessMap.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **********************************************************************
+ *
+ * Copyright (C) 2016-2018 Nicklas Avén
+ *
+ ***********************************************************************/
+
+
+/**********************************************************************
+ * Instrumentation of the pipeline, to find out which layer is slow.
+ *
+ * The fetch workers add sql, decode and reprojection time to the
+ * fetch_stats of the layer they are working on. They are added to the
+ * layer's stats on the rendering thread when the fetch is collected, so
+ * the stats are only touched from one thread. The rendering thread counts draw calls and bytes
+ * uploaded and, where timer queries are available, measures gpu time
+ * per layer. When a frame is finished the numbers are copied so they
+ * can be read through the TLM_ api or printed on the map.
+ ***********************************************************************/
+
+#include "theclient.h"
+#include "mem.h"
+#include "stats.h"
+#include "text.h"
+#include "buffer_handling.h"
+#include "interface/interface.h"
+#include "tilelessmap.h"
+
+int stats_enabled = 0;
+unsigned int stats_draw_calls = 0;
+size_t stats_upload_bytes = 0;
+
+static int overlay_enabled = 0;
+
+static uint64_t n_frames = 0;
+static uint64_t frame_start = 0;
+static unsigned int frame_draw_start = 0;
+static size_t frame_upload_start = 0;
+static unsigned int layer_draw_start = 0;
+static size_t layer_upload_start = 0;
+
+/*numbers from the last finished frame*/
+static TLM_FRAME_STATS last_frame;
+static LAYER_STATS *last_layers = NULL;
+static int n_last_layers = 0;
+
+/*One timer query per layer. Only one GL_TIME_ELAPSED query can be active at a time*/
+static GLuint *queries = NULL;
+static uint8_t *query_pending = NULL;
+static int n_queries = 0;
+static int query_running = -1;
+
+static TEXTBLOCK *overlay_txt = NULL;
+
+static void (*frame_callback)(const TLM_FRAME_STATS *stats, void *arg) = NULL;
+static void *frame_callback_arg = NULL;
+
+
+uint64_t stats_now()
+{
+    return (uint64_t) SDL_GetPerformanceCounter();
+}
+
+static double ticks2ms(uint64_t ticks)
+{
+    return ticks * 1000.0 / SDL_GetPerformanceFrequency();
+}
+
+static int layer_index(LAYER_RUNTIME *l)
+{
+    int i = (int) (l - global_layers->layers);
+    if(i < 0 || i >= global_layers->nlayers)
+        return -1;
+    return i;
+}
+
+static void destroy_queries()
+{
+#ifndef __ANDROID__
+    if(n_queries)
+        glDeleteQueries(n_queries, queries);
+#endif
+    st_free(queries);
+    queries = NULL;
+    st_free(query_pending);
+    query_pending = NULL;
+    n_queries = 0;
+    query_running = -1;
+}
+
+static void init_queries()
+{
+#ifndef __ANDROID__
+    if(!have_timer_query || n_queries == global_layers->nlayers)
+        return;
+    destroy_queries();
+    n_queries = global_layers->nlayers;
+    queries = st_malloc(n_queries * sizeof(GLuint));
+    query_pending = st_calloc(n_queries, sizeof(uint8_t));
+    glGenQueries(n_queries, queries);
+#endif
+}
+
+/**
+ * Called first in get_data and render_data.
+ * Everything but the gpu time is zeroed, the gpu time is only replaced when a new result is available
+ */
+void stats_begin_frame()
+{
+    int i;
+    LAYER_STATS *s;
+    if(!stats_enabled)
+        return;
+
+    init_queries();
+    for (i=0; i<global_layers->nlayers; i++)
+    {
+        s = &(global_layers->layers[i].stats);
+        s->sql_ticks = 0;
+        s->decode_ticks = 0;
+        s->reproject_ticks = 0;
+        s->n_features = 0;
+        s->n_culled = 0;
+        s->n_decimated = 0;
+        s->upload_bytes = 0;
+        s->draw_calls = 0;
+    }
+    frame_draw_start = stats_draw_calls;
+    frame_upload_start = stats_upload_bytes;
+    frame_start = stats_now();
+}
+
+/**
+ * Add what a fetch has added up to the layer's stats, and start over for the next fetch.
+ * Called when the layer is collected from the fetch pool, keep is 0 for fetches of an old view
+ */
+void stats_collect_fetch(LAYER_RUNTIME *l, int keep)
+{
+    LAYER_STATS *f = &(l->fetch_stats);
+    if(stats_enabled && keep)
+    {
+        l->stats.sql_ticks += f->sql_ticks;
+        l->stats.decode_ticks += f->decode_ticks;
+        l->stats.reproject_ticks += f->reproject_ticks;
+        l->stats.n_features += f->n_features;
+        l->stats.n_culled += f->n_culled;
+        l->stats.n_decimated += f->n_decimated;
+    }
+    memset(f, 0, sizeof(LAYER_STATS));
+}
+
+void stats_begin_layer(LAYER_RUNTIME *l)
+{
+    if(!stats_enabled)
+        return;
+
+    layer_draw_start = stats_draw_calls;
+    layer_upload_start = stats_upload_bytes;
+#ifndef __ANDROID__
+    int i = layer_index(l);
+    if(!n_queries || i < 0 || i >= n_queries || query_running >= 0)
+        return;
+
+    /*The result of last query is not read before it is ready, so we don't stall the pipeline.
+     Until then we don't start a new one for this layer*/
+    if(query_pending[i])
+    {
+        GLint available = 0;
+        GLuint64 ns;
+        glGetQueryObjectiv(queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+        if(!available)
+            return;
+        glGetQueryObjectui64v(queries[i], GL_QUERY_RESULT, &ns);
+        l->stats.gpu_ns = (uint64_t) ns;
+        query_pending[i] = 0;
+    }
+    glBeginQuery(GL_TIME_ELAPSED, queries[i]);
+    query_running = i;
+#endif
+}
+
+void stats_end_layer(LAYER_RUNTIME *l)
+{
+    if(!stats_enabled)
+        return;
+
+    l->stats.draw_calls += stats_draw_calls - layer_draw_start;
+    l->stats.upload_bytes += stats_upload_bytes - layer_upload_start;
+#ifndef __ANDROID__
+    if(query_running >= 0)
+    {
+        glEndQuery(GL_TIME_ELAPSED);
+        query_pending[query_running] = 1;
+        query_running = -1;
+    }
+#endif
+}
+
+static void render_overlay()
+{
+    char txt[4096];
+    size_t len;
+    int i;
+    LAYER_STATS *s;
+    GLfloat color[] = {200,0,0,255};
+    GLfloat point_coord[2];
+    float anchor[2] = {0,0};
+    float displacement[2] = {0,0};
+
+    if(!text_font_normal)
+        return;
+
+    len = snprintf(txt, sizeof(txt), "frame %llu: %.1f ms, gpu %.1f ms, %u draw calls, %zu kB uploaded\n",
+                   (unsigned long long) last_frame.frame, last_frame.frame_ms, last_frame.gpu_ms,
+                   last_frame.draw_calls, last_frame.upload_bytes / 1024);
+
+    for (i=0; i<n_last_layers && len < sizeof(txt); i++)
+    {
+        s = last_layers + i;
+        if(!s->n_features && !s->draw_calls && !s->gpu_ns)
+            continue;
+        len += snprintf(txt + len, sizeof(txt) - len, "%s: sql %.1f, decode %.1f, reproject %.1f, gpu %.1f ms, %llu features (%llu culled), %llu vertices decimated, %u draw calls, %zu kB\n",
+                        global_layers->layers[i].name, ticks2ms(s->sql_ticks), ticks2ms(s->decode_ticks),
+                        ticks2ms(s->reproject_ticks), s->gpu_ns / 1000000.0,
+                        (unsigned long long) s->n_features, (unsigned long long) s->n_culled, (unsigned long long) s->n_decimated, s->draw_calls, s->upload_bytes / 1024);
+    }
+
+    if(!overlay_txt)
+        overlay_txt = init_textblock();
+    else
+        reset_textblock(overlay_txt);
+
+    append_2_textblock(overlay_txt, txt, text_font_normal, color, 0, NEW_STRING, tmp_unicode_txt);
+
+    point_coord[0] = 10;
+    point_coord[1] = CURR_HEIGHT - 10;
+
+    /*print_txtblock only uploads the text the first time, so when the text is changed we do it here*/
+    if(overlay_txt->txt_info->points)
+    {
+        overlay_txt->txt_info->points->points->list[0] = point_coord[0];
+        overlay_txt->txt_info->points->points->list[1] = point_coord[1];
+        upload_gpu_buffer(&(overlay_txt->txt_info->points->tbo), GL_ARRAY_BUFFER, overlay_txt->dims->coords->coords, sizeof(float)*4*(overlay_txt->dims->coords->used), 0);
+    }
+    print_txtblock(point_coord, NULL, overlay_txt, anchor, displacement);
+}
+
+/**
+ * Called before the buffers are swapped.
+ * Takes a copy of the numbers for the api and draws the overlay if it is turned on
+ */
+void stats_end_frame()
+{
+    int i;
+    uint64_t gpu_ns = 0;
+    if(!stats_enabled)
+        return;
+
+    last_frame.frame = ++n_frames;
+    last_frame.frame_ms = ticks2ms(stats_now() - frame_start);
+    last_frame.draw_calls = stats_draw_calls - frame_draw_start;
+    last_frame.upload_bytes = stats_upload_bytes - frame_upload_start;
+
+    if(n_last_layers != global_layers->nlayers)
+    {
+        st_free(last_layers);
+        n_last_layers = global_layers->nlayers;
+        last_layers = st_malloc(n_last_layers * sizeof(LAYER_STATS));
+    }
+    for (i=0; i<n_last_layers; i++)
+    {
+        last_layers[i] = global_layers->layers[i].stats;
+        gpu_ns += last_layers[i].gpu_ns;
+    }
+    last_frame.gpu_ms = gpu_ns / 1000000.0;
+
+    if(frame_callback)
+        frame_callback(&last_frame, frame_callback_arg);
+
+    if(overlay_enabled)
+        render_overlay();
+}
+
+void destroy_stats()
+{
+    destroy_queries();
+    st_free(last_layers);
+    last_layers = NULL;
+    n_last_layers = 0;
+    if(overlay_txt)
+        destroy_textblock(overlay_txt);
+    overlay_txt = NULL;
+}
+
+
+extern void TLM_set_stats(int enabled, int overlay)
+{
+    stats_enabled = enabled ? 1 : 0;
+    overlay_enabled = enabled && overlay ? 1 : 0;
+    n_frames = 0;
+    memset(&last_frame, 0, sizeof(TLM_FRAME_STATS));
+}
+
+extern int TLM_get_frame_stats(TLM_FRAME_STATS *stats)
+{
+    *stats = last_frame;
+    return 0;
+}
+
+extern int TLM_get_layer_stats(int layer, TLM_LAYER_STATS *stats)
+{
+    LAYER_STATS *s;
+    if(layer < 0 || layer >= n_last_layers || layer >= global_layers->nlayers)
+        return 1;
+
+    s = last_layers + layer;
+    stats->name = global_layers->layers[layer].name;
+    stats->sql_ms = ticks2ms(s->sql_ticks);
+    stats->decode_ms = ticks2ms(s->decode_ticks);
+    stats->reproject_ms = ticks2ms(s->reproject_ticks);
+    stats->gpu_ms = s->gpu_ns / 1000000.0;
+    stats->n_features = s->n_features;
+    stats->n_culled = s->n_culled;
+    stats->n_decimated = s->n_decimated;
+    stats->upload_bytes = s->upload_bytes;
+    stats->draw_calls = s->draw_calls;
+    return 0;
+}
+
+extern void TLM_set_frame_callback(void (*callback)(const TLM_FRAME_STATS *stats, void *arg), void *arg)
+{
+    frame_callback = callback;
+    frame_callback_arg = arg;
+}
@@ -0,0 +1,46 @@
+/**********************************************************************
+ *
+ * TileLessMap
+ *
+ * TileLessMap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * TileLessMap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TileLessMap.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **********************************************************************
+ *
+ * Copyright (C) 2016-2018 Nicklas Avén
+ *
+ ***********************************************************************/
+#ifndef _stats_H
+#define _stats_H
+
+#include "structures.h"
+
+/*1 when the pipeline is measured, read by the fetch workers to know if they shall take time*/
+extern int stats_enabled;
+
+/*Counted on the rendering thread, the per layer numbers are the difference before and after the layer*/
+extern unsigned int stats_draw_calls;
+extern size_t stats_upload_bytes;
+
+#define STATS_DRAW_CALL() (stats_draw_calls++)
+#define STATS_UPLOAD(bytes) (stats_upload_bytes += (bytes))
+
+uint64_t stats_now();
+void stats_begin_frame();
+void stats_end_frame();
+void stats_begin_layer(LAYER_RUNTIME *l);
+void stats_end_layer(LAYER_RUNTIME *l);
+void stats_collect_fetch(LAYER_RUNTIME *l, int keep);
+void destroy_stats();
+
+#endif
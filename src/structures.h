@@ -33,6 +33,7 @@
 #endif
 
 #include "ext/sqlite/sqlite3.h"
+#include "uthash.h"
 
 
 
@@ -107,7 +108,43 @@ typedef struct
     int usage;
 }PS_HOLDER;
 
+/*Cells per side in a reprojection grid*/
+#define REPROJ_GRID_SIZE 32
 
+/*Reprojected nodes of a grid over the view, to interpolate reprojected coordinates from*/
+typedef struct
+{
+    int valid;
+    uint8_t utm_in;
+    uint8_t utm_out;
+    uint8_t hemi_in;
+    uint8_t hemi_out;
+    double minx, miny; // in the input projection
+    double cell_w, cell_h;
+    double *nodes; // (REPROJ_GRID_SIZE+1)^2 x,y pairs in the output projection, row by row
+} REPROJ_GRID;
+
+/*Max number of levels of detail per layer, in geometry_levels*/
+#define MAX_GEOM_LEVELS 8
+
+/*A precomputed level of detail, with its own geometry, triangles and r-tree*/
+typedef struct
+{
+    sqlite3_stmt *ps;
+    GLfloat min_mpp; // the level is used from this meter per pixel
+    GLfloat max_mpp; // up to, but not including, this
+} GEOM_LEVEL;
+
+
+
+
+/*A buffer on the gpu that keeps its allocation between uploads and only grows*/
+typedef struct
+{
+    GLuint id;
+    size_t capacity; // bytes allocated on the gpu
+    unsigned int version; // data_version of the layer when the content was uploaded, 0 if unknown
+} GPU_BUFFER;
 
 
 typedef struct
@@ -116,7 +153,7 @@ typedef struct
     GLUINT_LIST *point_start_indexes;
     POINTER_LIST *style_id;
     GLuint vbo;
-    GLuint tbo;
+    GPU_BUFFER tbo;
 
 }
 POINT_LIST;
@@ -127,7 +164,7 @@ typedef struct
     GLFLOAT_LIST *vertex_array;
     GLUINT_LIST *line_start_indexes;
     POINTER_LIST *style_id;
-    GLuint vbo;
+    GPU_BUFFER vbo;
 
 }
 LINESTRING_LIST;
@@ -138,12 +175,20 @@ typedef struct
     GLFLOAT_LIST *vertex_array;  //all vertex coordinates in a long array
     GLUINT_LIST *pa_start_indexes; //start index in vertex array above of each point array
     GLUINT_LIST *polygon_start_indexes; //start index in vertex_array above for each polygon
-    GLUSHORT_LIST *element_array;    // a long array of triangle indexes
+    GLUINT_LIST *element_array;    // a long array of triangle indexes, relative to the start of each polygon
     GLUINT_LIST *element_start_indexes; //indexes telling where each polygon starts
     POINTER_LIST *style_id;
     POINTER_LIST *line_style_id;
-    GLuint vbo;
-    GLuint ebo;
+    GLUINT_LIST *batch_elements; // element_array grouped by style and rebased, this is what is loaded to ebo
+    GLUSHORT_LIST *batch_elements16; // batch_elements as GLushort, when 32 bit indexes are not supported
+    GLUINT_LIST *batch_info; // 3 values per batch: start in vertex_array, first element in batch_elements and number of elements
+    POINTER_LIST *batch_style; // style of each batch
+    GLFLOAT_LIST *loose_vertices; // triangles of polygons too big for 16 bit indexes, drawn without elements
+    GLUINT_LIST *loose_info; // 2 values per polygon in loose_vertices: first vertex and number of vertices
+    POINTER_LIST *loose_style;
+    GPU_BUFFER lvbo;
+    GPU_BUFFER vbo;
+    GPU_BUFFER ebo;
 }
 POLYGON_LIST;
 
@@ -287,6 +332,13 @@ typedef struct
 
 } TWKB_BUF;
 
+/*Set of feature ids that is already loaded in a layers buffers*/
+typedef struct
+{
+    int64_t id;
+    UT_hash_handle hh;
+} LOADED_ID;
+
 typedef struct
 {
     float bbox_min[TWKB_IN_MAXCOORDS];
@@ -296,21 +348,40 @@ typedef struct
 
 
 
+/*Instrumentation for one layer, times are in ticks of SDL_GetPerformanceCounter*/
+typedef struct
+{
+    uint64_t sql_ticks; // time spent in sqlite3_step
+    uint64_t decode_ticks; // time spent decoding twkb or copying from the geometry cache, reprojection included
+    uint64_t reproject_ticks;
+    uint64_t n_short_reprojections; // point arrays too short to be timed one by one, only some of them are timed
+    uint64_t n_features;
+    uint64_t n_culled; // features skipped or collapsed from their bbox
+    uint64_t n_decimated; // vertices dropped since they were within the decimation tolerance
+    size_t upload_bytes;
+    unsigned int draw_calls;
+    uint64_t gpu_ns; // last finished timer query, lags a few frames behind
+} LAYER_STATS;
+
 /**
 
 Information about all the layers in the project is loaded in an array of this structure at start.
 */
-typedef struct
+typedef struct LAYER_RUNTIME
 {
     //General
     char *name;
     char *db;
+    int data_db; // index of the data db the layer is in, for its connections
     char *title;
     uint8_t visible;
     int layer_id;
     
     //Info for fetching data and rendering
     PS_HOLDER *preparedStatement;
+    GEOM_LEVEL levels[MAX_GEOM_LEVELS];
+    int n_levels;
+    int geom_level; // the level the buffers are loaded from, -1 for the layer's own geometry
     GLfloat *BBOX; // the requested bounding box (window)
     uint8_t geometryType;
     uint8_t type;
@@ -328,7 +399,25 @@ typedef struct
     struct STYLES *styles;
     int style_key_type;
     
+    //Decoded features can be taken from the geometry cache. Not for layers whose statement is swapped, like infoLayer
+    uint8_t use_geom_cache;
+    struct LAYER_RUNTIME *prefetch_for; // set on the prefetcher's copies of a layer, what they decode is cached as if this layer had decoded it
+
+    //Incremental loading
+    GLfloat loaded_bbox[4]; // the area we know is completely loaded in the buffers
+    GLfloat fetched_extent[4]; // extent of everything fetched since the buffers were reset
+    GLfloat loaded_mpp; // meter per pixel the buffers are loaded for. 0 if nothing is loaded
+    GLfloat decimate_tol; // vertices closer than this in meters are dropped when decoding, a power of 2. 0 for no decimation
+    REPROJ_GRID reproj_grid; // built for the view when the layer is fetched, if the layer is in another zone than the map
+    uint8_t gpu_reproject; // the buffers are in the layer's own zone, and the shaders reproject them
+    GLfloat reproj_poly[16]; // the shaders' reproj uniform, identity unless gpu_reproject is set
+    GLfloat reproj_poly_box[4]; // the view reproj_poly was fitted for
+    GLfloat fetch_boxes[4][4]; // the strips to fetch. If n_fetch_boxes is 0, BBOX is fetched
+    int n_fetch_boxes;
+    LOADED_ID *loaded_ids;
+
     //Buffers
+    unsigned int data_version; // changed every time the buffers below are changed, so we know when to upload them again
     POINT_LIST *points;
     LINESTRING_LIST *lines;
     LINESTRING_LIST *wide_lines;
@@ -337,6 +426,8 @@ typedef struct
     INT64_LIST *twkb_id;
     RASTER_LIST *rast;
     
+    LAYER_STATS stats;
+    LAYER_STATS fetch_stats; // added up by the thread fetching the layer, and added to stats when the fetch is collected
 }
 LAYER_RUNTIME;
 
@@ -394,6 +485,8 @@ typedef struct
         char string_type[128];
     } styleID; //the current styleID
     int styleid_type;
+    struct STYLES *style; //the style of the current row, looked up once per row
+    GLfloat *cull_box; //minx, miny, maxx, maxy in the layer's projection. Geometries outside is skipped. NULL turns culling off
     const char *txt;
     uint8_t line_width;  //If we shall calculate triangels to get line width
     uint8_t utm_zone;
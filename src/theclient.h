@@ -61,12 +61,16 @@
 #define INIT_HEIGHT 500
 
 //Set this to 0 to do the data fetching in serial. Good for debugging
-#define THREADING 0
+//With threading on, visible layers are fetched in parallel by the fetch pool (fetch_pool.c)
+#define THREADING 1
 
 #define DEFAULT_TEXT_BUF 1024
 
 #define MAX_ZOOM_FINGERS 2
 
+/*Relative difference in meter per pixel that is still regarded as the same zoom*/
+#define SAME_ZOOM_TOLERANCE 0.001
+
 
 #define INIT_PS_POOL_SIZE 10
 
@@ -214,8 +218,11 @@ int element_set_end(uint32_t npoints, uint8_t ndims,uint32_t styleID, ELEMENTSTR
 GLfloat* increase_buffer(GLESSTRUCT *res_buf);
 */
 /*Functions exposed to other programs*/
-void *twkb_fromSQLiteBBOX_thread( void *theL);
 void *twkb_fromSQLiteBBOX( void *theL);
+int geom_level(LAYER_RUNTIME *theLayer, GLfloat mpp);
+int gpu_reproject(LAYER_RUNTIME *theLayer, GLfloat *bbox, GLfloat mpp);
+void update_reproj_poly(LAYER_RUNTIME *theLayer, GLfloat *bbox);
+void *twkb_fromSQLiteBBOX_stmt(LAYER_RUNTIME *theLayer, sqlite3_stmt *prepared_statement);
 GLuint create_shader(const char* source, GLenum type);
 void print_log(GLuint object);
 int loadOrSaveDb(sqlite3 *pInMemory, const char *zFilename, int isSave);
@@ -233,6 +240,10 @@ LAYERS* init_layers(int n);
 int  matrixFromBBOX(MATRIX *map_matrix );
 //int get_data(SDL_Window* window,GLfloat *bbox,GLfloat *theMatrix);
 int get_data(SDL_Window* window,MATRIX *map_matrix,struct CTRL *controls);
+int request_data(SDL_Window* window,MATRIX *map_matrix,struct CTRL *controls);
+int show_data(SDL_Window* window,MATRIX *map_matrix,struct CTRL *controls);
+int show_progress(SDL_Window* window,MATRIX *map_matrix,struct CTRL *controls);
+void layer_fetch_box(LAYER_RUNTIME *l, GLfloat *bbox, GLfloat *box);
 
 int loadPoint(LAYER_RUNTIME *oneLayer,GLfloat *theMatrix);
 int  renderPoint(LAYER_RUNTIME *oneLayer,GLfloat *theMatrix);
@@ -250,6 +261,7 @@ int render_info(SDL_Window* window,GLfloat *theMatrix);
 int loadRaster(LAYER_RUNTIME *oneLayer,GLfloat *theMatrix);
 int renderRaster(LAYER_RUNTIME *oneLayer,GLfloat *theMatrix);
 int loadandRenderRaster(LAYER_RUNTIME *oneLayer,GLfloat *theMatrix);
+GLuint load_raster_texture(SDL_Surface *res_texture, size_t *bytes);
 
 FINGEREVENT* init_touch_que();
 int reset_touch_que(FINGEREVENT *touches);
@@ -261,6 +273,7 @@ int register_motion(FINGEREVENT *touches, int64_t fingerid, GLfloat x, GLfloat y
 GLuint create_program(const unsigned char *vs_source,const unsigned char *fs_source, GLuint *vs, GLuint *fs);
 
 void reset_shaders(GLuint vs,GLuint fs,GLuint program);
+void reset_reproj_uniform(GLint location);
 
 //uint32_t utf82unicode(char *text, char **the_rest);
 int init_text_resources();
@@ -288,6 +301,11 @@ int renderGPS(GLfloat *theMatrix);
 int loadGPS(GLfloat *gps_circle);
 int loadSymbols();
 void reproject(GLfloat *points,uint8_t utm_in,uint8_t utm_out, uint8_t hemi_in, uint8_t hemi_out);
+void reproject_batch(GLfloat *points, uint32_t npoints, uint32_t stride, REPROJ_GRID *g, uint8_t utm_in, uint8_t utm_out, uint8_t hemi_in, uint8_t hemi_out);
+int reproj_grid_build(REPROJ_GRID *g, GLfloat *box, uint8_t utm_in, uint8_t utm_out, uint8_t hemi_in, uint8_t hemi_out, GLfloat max_error);
+void reproj_grid_destroy(REPROJ_GRID *g);
+void reproj_poly_identity(GLfloat *poly);
+int reproj_poly_build(GLfloat *poly, GLfloat *box, uint8_t utm_in, uint8_t utm_out, uint8_t hemi_in, uint8_t hemi_out, GLfloat max_error);
 int check_column(const unsigned char *dbname,const unsigned char * layername, const unsigned char  *col_name);
 
 
@@ -316,6 +334,14 @@ int text_scale;
 GLfloat *gps_circle;
 
 LAYERS *global_layers;
+int incremental_loading; //only fetch newly exposed areas when panning
+int feature_culling; //skip features outside the view and simplify features smaller than a pixel, from their twkb bbox
+GLfloat decimate_pixels; //vertices of lines closer than this many pixels are dropped when decoding. 0 turns it off
+int gpu_reprojection; //layers in another utm zone are uploaded in their own zone and reprojected in the shaders
+int progressive_rendering; //show the map layer by layer as they are fetched, instead of when all are
+#define N_OVERSCAN_CLASSES 4
+GLfloat overscan[N_OVERSCAN_CLASSES]; //share of the view size fetched outside the view, per TLM_OVERSCAN_ class
+int prefetching; //warm the caches for where the user is heading while the map is idle
 //LAYER_RUNTIME *layerRuntime;
 LAYER_RUNTIME *infoLayer;
 LAYER_RUNTIME *infoRenderLayer;
@@ -340,6 +366,7 @@ GLuint std_program;
 GLint std_coord2d;
 GLint std_matrix;
 GLint std_color;
+GLint std_reproj;
 
 //Standard textprogram
 GLuint txt_program;
@@ -360,6 +387,7 @@ GLint txt2_box;
 GLint txt2_tex;
 GLint txt2_texpos;
 GLint txt2_color;
+GLint txt2_reproj;
 
 GLuint gen_vbo;
 
@@ -373,6 +401,7 @@ GLint lw_linewidth;
 GLint lw_norm;
 GLint lw_color;
 GLint lw_z;
+GLint lw_reproj;
 
 //gps-void calc_end(POINT_CIRCLE* p, GLfloat* ut, int* c, vec2* last_normal)
 
@@ -392,6 +421,7 @@ GLint sym_color;
 GLint sym_matrix;
 GLint sym_px_matrix;
 GLint sym_z;
+GLint sym_reproj;
 
 GLuint raster_program;
 GLint raster_coord2d;
@@ -408,7 +438,14 @@ typedef struct  {
 } point;
 
 point gps_point;
+/*1 if glDrawElements accepts GL_UNSIGNED_INT, desktop GL or GLES2 with OES_element_index_uint*/
+int have_uint_elements;
+/*1 if we can measure gpu time with GL_TIME_ELAPSED queries, only desktop for now*/
+int have_timer_query;
+
 Uint32 GPSEventType;
+Uint32 RasterEventType;
+Uint32 FetchEventType; //pushed by the fetch pool when all layers for the last view are fetched
 Uint32 haveDBEventType;
 GLuint text_vbo;
 int gps_npoints;
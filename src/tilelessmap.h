@@ -27,6 +27,8 @@
 *************************************************************************/
 #ifndef _tilelessmap_H
 #define _tilelessmap_H
+#include <stdint.h>
+#include <stddef.h>
 #include "interface/interface.h"
 #include "info.h"
 #include "log.h"
@@ -67,6 +69,100 @@ extern int TLM_init_db(const char *f,const char *dir);
 extern void TLM_start();
 extern void TLM_close();
 
+/*Record the user's interaction to a file, or replay a recorded file instead of the user's input. Call before TLM_start*/
+extern int TLM_record_trace(const char *filename);
+extern int TLM_replay_trace(const char *filename, int max_speed);
+
+
+/*************** Caches *******************/
+/*Page cache and mmap size for each connection to a data db. Every data db gets its own connection,
+for the main thread and for each fetch thread. Call before TLM_init_db. Default is 512 KiB cache and
+64 MB mmap, no mmap on 32 bit*/
+extern void TLM_set_db_budget(size_t cache_bytes, size_t mmap_bytes);
+
+typedef struct
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evicted;
+    size_t entries;
+    size_t bytes;
+    size_t max_bytes;
+    uint64_t prefetched; // entries added by the idle prefetcher
+    uint64_t prefetch_hits; // prefetched entries later used for the view, prefetch_hits / prefetched is the share that paid off
+} TLM_CACHE_STATS;
+
+/*Max memory used for decoded geometries, 0 turns the cache off*/
+extern void TLM_set_geom_cache_size(size_t max_bytes);
+extern void TLM_get_geom_cache_stats(TLM_CACHE_STATS *stats);
+
+/*Max texture memory used for raster tiles. Has to be called from the rendering thread*/
+extern void TLM_set_raster_cache_size(size_t max_bytes);
+extern void TLM_get_raster_cache_stats(TLM_CACHE_STATS *stats);
+
+/*Fill the caches for the views we guess comes next, from the recent panning and zooming, while the map is left alone.
+Any input aborts it. On by default*/
+extern void TLM_set_prefetching(int enabled);
+
+
+/*************** Decoding *******************/
+/*Vertices of lines closer than this many pixels to each other are dropped when decoding. 0 turns it off.
+Takes effect the next time a layer is loaded from scratch*/
+extern void TLM_set_decimation(float pixels);
+
+/*Let the shaders reproject layers stored in another utm zone than the map, instead of reprojecting when decoding.
+Only used when the reprojection over the view is close enough to a polynomial. Takes effect the next time a layer is loaded*/
+extern void TLM_set_gpu_reprojection(int enabled);
+
+
+/*************** Rendering *******************/
+/*Show the map layer by layer as they are fetched when panning and zooming, instead of waiting for all of them. On by default*/
+extern void TLM_set_progressive_rendering(int enabled);
+
+/*Layer classes for the overscan*/
+#define TLM_OVERSCAN_POINTS 0 // points and texts
+#define TLM_OVERSCAN_LINES 1
+#define TLM_OVERSCAN_POLYGONS 2
+#define TLM_OVERSCAN_RASTER 3
+
+/*Fetch this share of the view's width and height outside the view on every side, for layers of a class.
+Panning inside what is fetched needs no fetching at all. Default is 0.25 for vector layers and 0 for raster*/
+extern void TLM_set_overscan(int layer_class, float share);
+
+
+/*************** Instrumentation *******************/
+typedef struct
+{
+    uint64_t frame; // number of frames since instrumentation was turned on
+    double frame_ms; // cpu time from start of get_data or render_data until the buffers are swapped
+    double gpu_ms; // sum of the layers last gpu times, 0 if timer queries are not available
+    unsigned int draw_calls;
+    size_t upload_bytes;
+} TLM_FRAME_STATS;
+
+typedef struct
+{
+    const char *name;
+    double sql_ms;
+    double decode_ms; // reprojection included
+    double reproject_ms;
+    double gpu_ms;
+    uint64_t n_features;
+    uint64_t n_culled; // features skipped or simplified since they were outside the view or smaller than a pixel
+    uint64_t n_decimated; // vertices dropped by the decimation
+    size_t upload_bytes;
+    unsigned int draw_calls;
+} TLM_LAYER_STATS;
+
+/*Turn on or off the measuring. With overlay the numbers are also printed on the map*/
+extern void TLM_set_stats(int enabled, int overlay);
+/*Numbers from the last finished frame*/
+extern int TLM_get_frame_stats(TLM_FRAME_STATS *stats);
+/*layer is the index in the layer list. Returns 1 if there is no such layer*/
+extern int TLM_get_layer_stats(int layer, TLM_LAYER_STATS *stats);
+/*Called on the rendering thread every time a frame is finished, while measuring. NULL turns it off*/
+extern void TLM_set_frame_callback(void (*callback)(const TLM_FRAME_STATS *stats, void *arg), void *arg);
+
 
 /*************** Get info about layers *******************/
 TLM_LAYER_LIST *TLM_get_layerlist();
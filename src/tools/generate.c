@@ -0,0 +1,883 @@
+/**********************************************************************
+ *
+ * TileLessMap
+ *
+ * TileLessMap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * TileLessMap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TileLessMap.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **********************************************************************
+ *
+ * Copyright (C) 2016-2018 Nicklas Avén
+ *
+ ***********************************************************************/
+
+
+/**********************************************************************
+ * Generator of synthetic TileLess projects
+ *
+ * Writes a project db and a data db with the same layout as the
+ * projects load_layers reads: dbs, layers, info, fonts and init_box in
+ * the project db, and geometry_columns, raster_columns, the layer tables
+ * and their r-tree indexes in the data db.
+ *
+ * For every utm zone asked for there is one point, one line and one
+ * polygon layer. The features are spread randomly over the extent, and
+ * for layers in another zone than the map they are stored in the zone of
+ * the layer, so the client has to reproject them. Polygons are convex,
+ * so the triangle index is a simple fan. Optionally there is a raster
+ * layer with generated tiles.
+ *
+ * Everything is seeded, so the same arguments gives the same project.
+ ***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "../theclient.h"
+
+#define GEN_MAX_ZONES 8
+
+/*Fonts we look for if none is given, the client needs at least one*/
+static const char *default_fonts[] = {
+    "/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf",
+    "/usr/share/fonts/TTF/DejaVuSans.ttf",
+    "/usr/share/fonts/dejavu/DejaVuSans.ttf",
+    "/usr/share/fonts/truetype/liberation/LiberationSans-Regular.ttf",
+    NULL
+};
+
+typedef struct
+{
+    uint8_t *buf;
+    size_t used;
+    size_t alloced;
+} GEN_BUF;
+
+typedef struct
+{
+    const char *projectfile;
+    const char *datafile;
+    const char *fontfile;
+    long n_features; // per geometry type
+    int n_vertices; // per line and polygon
+    int n_styles;
+    int zones[GEN_MAX_ZONES];
+    int n_zones;
+    int raster_tiles; // tiles per side, 0 for no raster layer
+    int tile_size; // pixels
+    int labels;
+    double x, y, width;
+    uint64_t seed;
+} GEN_SETTINGS;
+
+
+/************* Random numbers, our own so a seed gives the same result everywhere *************/
+static uint64_t rnd_state;
+
+static uint64_t rnd()
+{
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 7;
+    rnd_state ^= rnd_state << 17;
+    return rnd_state;
+}
+
+/*Uniform in [0,1)*/
+static double rnd_unit()
+{
+    return (rnd() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+/************* Writing twkb *************/
+static void buf_reset(GEN_BUF *b)
+{
+    b->used = 0;
+}
+
+static void buf_byte(GEN_BUF *b, uint8_t v)
+{
+    if(b->used == b->alloced)
+    {
+        b->alloced = b->alloced ? b->alloced * 2 : 1024;
+        b->buf = realloc(b->buf, b->alloced);
+        if(!b->buf)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    b->buf[b->used++] = v;
+}
+
+static void buf_append(GEN_BUF *b, const uint8_t *data, size_t len)
+{
+    size_t i;
+    for (i=0; i<len; i++)
+        buf_byte(b, data[i]);
+}
+
+static void buf_uvarint(GEN_BUF *b, uint64_t v)
+{
+    while(v >= 0x80)
+    {
+        buf_byte(b, (uint8_t) (v | 0x80));
+        v >>= 7;
+    }
+    buf_byte(b, (uint8_t) v);
+}
+
+static void buf_svarint(GEN_BUF *b, int64_t v)
+{
+    buf_uvarint(b, ((uint64_t) v << 1) ^ (uint64_t) (v >> 63));
+}
+
+/**
+ * Encode a point, linestring or a multipolygon with one ring, with precision 0.
+ * The twkb has bbox and size, the way the client expects them.
+ */
+static void write_twkb(GEN_BUF *out, GEN_BUF *body, int type, const int64_t *coords, int npoints, int64_t *bbox)
+{
+    int i;
+    int64_t last[2] = {0,0};
+
+    bbox[0] = bbox[2] = coords[0];
+    bbox[1] = bbox[3] = coords[1];
+    for (i=1; i<npoints; i++)
+    {
+        if(coords[2*i] < bbox[0]) bbox[0] = coords[2*i];
+        if(coords[2*i] > bbox[2]) bbox[2] = coords[2*i];
+        if(coords[2*i+1] < bbox[1]) bbox[1] = coords[2*i+1];
+        if(coords[2*i+1] > bbox[3]) bbox[3] = coords[2*i+1];
+    }
+
+    buf_reset(body);
+    buf_svarint(body, bbox[0]);
+    buf_svarint(body, bbox[2] - bbox[0]);
+    buf_svarint(body, bbox[1]);
+    buf_svarint(body, bbox[3] - bbox[1]);
+
+    if(type == MULTIPOLYGONTYPE)
+    {
+        buf_uvarint(body, 1); // polygons
+        buf_uvarint(body, 1); // rings
+    }
+    if(type != POINTTYPE)
+        buf_uvarint(body, npoints);
+
+    for (i=0; i<npoints; i++)
+    {
+        buf_svarint(body, coords[2*i] - last[0]);
+        buf_svarint(body, coords[2*i+1] - last[1]);
+        last[0] = coords[2*i];
+        last[1] = coords[2*i+1];
+    }
+
+    buf_reset(out);
+    buf_byte(out, (uint8_t) type); // precision 0
+    buf_byte(out, 0x03); // bbox and size
+    buf_uvarint(out, body->used);
+    buf_append(out, body->buf, body->used);
+}
+
+/**
+ * The triangle index of a convex ring with n vertices, as decode_element_array reads it.
+ * A header where the third byte is the extended dimensions, the number of triangles
+ * and then the 3 indexes of every triangle as deltas to the triangle before.
+ */
+static void write_fan(GEN_BUF *out, int n)
+{
+    int i;
+    int64_t last[3] = {0,0,0};
+    int64_t tri[3];
+
+    buf_reset(out);
+    buf_byte(out, LINETYPE);
+    buf_byte(out, 0x08); // extended dimensions
+    buf_byte(out, 0x01); // z with precision 0
+    buf_uvarint(out, n - 2);
+    for (i=0; i<n-2; i++)
+    {
+        tri[0] = 0;
+        tri[1] = i + 1;
+        tri[2] = i + 2;
+        buf_svarint(out, tri[0] - last[0]);
+        buf_svarint(out, tri[1] - last[1]);
+        buf_svarint(out, tri[2] - last[2]);
+        memcpy(last, tri, sizeof(last));
+    }
+}
+
+/*A 24 bit bmp, which SDL_image reads without any extra library*/
+static void write_bmp(GEN_BUF *out, int size, uint8_t r, uint8_t g, uint8_t b)
+{
+    int x, y;
+    uint32_t row = (uint32_t) size * 3;
+    uint32_t data_size = row * size;
+    uint32_t header[13] = {54 + data_size, 0, 54, 40, (uint32_t) size, (uint32_t) size, 1 | (24 << 16), 0, data_size, 2835, 2835, 0, 0};
+
+    buf_reset(out);
+    buf_byte(out, 'B');
+    buf_byte(out, 'M');
+    for (x=0; x<13; x++)
+    {
+        buf_byte(out, header[x] & 0xff);
+        buf_byte(out, (header[x] >> 8) & 0xff);
+        buf_byte(out, (header[x] >> 16) & 0xff);
+        buf_byte(out, (header[x] >> 24) & 0xff);
+    }
+    /*A shaded tile with a darker border, so the tile edges are visible*/
+    for (y=0; y<size; y++)
+    {
+        for (x=0; x<size; x++)
+        {
+            int border = x == 0 || y == 0 || x == size - 1 || y == size - 1;
+            double shade = border ? 0.5 : 0.75 + 0.25 * y / size;
+            buf_byte(out, (uint8_t) (b * shade));
+            buf_byte(out, (uint8_t) (g * shade));
+            buf_byte(out, (uint8_t) (r * shade));
+        }
+    }
+}
+
+
+/************* Databases *************/
+static int exec_sql(sqlite3 *db, const char *sql)
+{
+    char *err_msg = NULL;
+    if(sqlite3_exec(db, sql, NULL, NULL, &err_msg) != SQLITE_OK)
+    {
+        fprintf(stderr, "SQL error: %s in %s\n", err_msg, sql);
+        sqlite3_free(err_msg);
+        return 1;
+    }
+    return 0;
+}
+
+static sqlite3_stmt* prepare(sqlite3 *db, const char *sql)
+{
+    sqlite3_stmt *ps = NULL;
+    if(sqlite3_prepare_v2(db, sql, -1, &ps, NULL) != SQLITE_OK)
+    {
+        fprintf(stderr, "SQL error: %s in %s\n", sqlite3_errmsg(db), sql);
+        return NULL;
+    }
+    return ps;
+}
+
+static int step_and_reset(sqlite3 *db, sqlite3_stmt *ps)
+{
+    if(sqlite3_step(ps) != SQLITE_DONE)
+    {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+    sqlite3_reset(ps);
+    return 0;
+}
+
+static sqlite3* create_db(const char *filename)
+{
+    sqlite3 *db;
+    remove(filename);
+    if(sqlite3_open(filename, &db) != SQLITE_OK)
+    {
+        fprintf(stderr, "Cannot create %s: %s\n", filename, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return NULL;
+    }
+    exec_sql(db, "PRAGMA journal_mode = OFF; PRAGMA synchronous = OFF;");
+    return db;
+}
+
+static int create_project_tables(sqlite3 *project)
+{
+    return exec_sql(project,
+                    "CREATE TABLE dbs (name TEXT, source TEXT);"
+                    "CREATE TABLE layers (layerID INTEGER, name TEXT, source TEXT, title TEXT, defaultVisible INTEGER, "
+                    "minScale REAL, maxScale REAL, type TEXT, showText INTEGER, linewidth INTEGER, sld TEXT, orderby INTEGER, info_rel TEXT);"
+                    "CREATE TABLE info (layerID INTEGER, field TEXT, row INTEGER, column INTEGER, header TEXT);"
+                    "CREATE TABLE fonts (name TEXT, type INTEGER, font BLOB, prio INTEGER);"
+                    "CREATE TABLE init_box (x REAL, y REAL, box_width REAL, utm_zone INTEGER, hemisphere INTEGER);");
+}
+
+static int create_data_tables(sqlite3 *data)
+{
+    return exec_sql(data,
+                    "CREATE TABLE geometry_columns (layer_name TEXT, geometry_type INTEGER, geometry_fld TEXT, idx_id_fld TEXT, id_fld TEXT, "
+                    "spatial_idx_fld TEXT, tri_idx_fld TEXT, utm_zone INTEGER, hemisphere INTEGER, n_dims INTEGER);"
+                    "CREATE TABLE raster_columns (layer_name TEXT, geometry_fld TEXT, data_fld TEXT, id_fld TEXT, spatial_idx TEXT, "
+                    "utm_zone INTEGER, hemisphere INTEGER, tilewidth INTEGER, tileheight INTEGER);");
+}
+
+static int add_font(sqlite3 *project, const char *fontfile)
+{
+    FILE *f;
+    long len;
+    char *font;
+    int type, res = 0;
+    sqlite3_stmt *ps;
+
+    f = fopen(fontfile, "rb");
+    if(!f)
+    {
+        fprintf(stderr, "Cannot open font %s\n", fontfile);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    font = malloc(len);
+    if(!font || fread(font, 1, len, f) != (size_t) len)
+    {
+        fprintf(stderr, "Cannot read font %s\n", fontfile);
+        fclose(f);
+        free(font);
+        return 1;
+    }
+    fclose(f);
+
+    ps = prepare(project, "INSERT INTO fonts (name, type, font, prio) VALUES ('default', ?, ?, 1);");
+    if(!ps)
+    {
+        free(font);
+        return 1;
+    }
+    /*The same font for normal, bold and italic*/
+    for (type=1; type<=3 && !res; type++)
+    {
+        sqlite3_bind_int(ps, 1, type);
+        sqlite3_bind_blob(ps, 2, font, (int) len, SQLITE_STATIC);
+        res = step_and_reset(project, ps);
+    }
+    sqlite3_finalize(ps);
+    free(font);
+    return res;
+}
+
+/*A color per style, spread around the color wheel*/
+static void style_color(int i, int n, char *color)
+{
+    double h = 6.0 * i / n;
+    int k = (int) h;
+    double f = h - k;
+    double rgb[3];
+    switch (k % 6)
+    {
+    case 0: rgb[0] = 1; rgb[1] = f; rgb[2] = 0; break;
+    case 1: rgb[0] = 1 - f; rgb[1] = 1; rgb[2] = 0; break;
+    case 2: rgb[0] = 0; rgb[1] = 1; rgb[2] = f; break;
+    case 3: rgb[0] = 0; rgb[1] = 1 - f; rgb[2] = 1; break;
+    case 4: rgb[0] = f; rgb[1] = 0; rgb[2] = 1; break;
+    default: rgb[0] = 1; rgb[1] = 0; rgb[2] = 1 - f; break;
+    }
+    sprintf(color, "#%02x%02x%02x", (int) (rgb[0] * 200 + 20), (int) (rgb[1] * 200 + 20), (int) (rgb[2] * 200 + 20));
+}
+
+static void sld_append(char **txt, size_t *len, size_t *alloced, const char *s)
+{
+    size_t l = strlen(s);
+    while(*len + l + 1 > *alloced)
+    {
+        *alloced = *alloced ? *alloced * 2 : 4096;
+        *txt = realloc(*txt, *alloced);
+    }
+    memcpy(*txt + *len, s, l + 1);
+    *len += l;
+}
+
+/**
+ * One rule per style value. Written indented, since the sld reader looks at
+ * the text inside the symbolizer tags to find them, the way QGIS writes sld
+ */
+static char* create_sld(int geometry_type, int n_styles, int labels)
+{
+    char *txt = NULL;
+    size_t len = 0, alloced = 0;
+    char rule[2048];
+    char color[8];
+    int i;
+
+    sld_append(&txt, &len, &alloced,
+            "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+            "<StyledLayerDescriptor xmlns=\"http://www.opengis.net/sld\" xmlns:ogc=\"http://www.opengis.net/ogc\" xmlns:se=\"http://www.opengis.net/se\" version=\"1.1.0\">\n"
+            " <NamedLayer>\n"
+            "  <UserStyle>\n"
+            "   <se:FeatureTypeStyle>\n");
+    for (i=0; i<n_styles; i++)
+    {
+        style_color(i, n_styles, color);
+        snprintf(rule, sizeof(rule),
+                 "    <se:Rule>\n"
+                 "     <se:Name>%d</se:Name>\n"
+                 "     <ogc:Filter xmlns:ogc=\"http://www.opengis.net/ogc\">\n"
+                 "      <ogc:PropertyIsEqualTo>\n"
+                 "       <ogc:PropertyName>style</ogc:PropertyName>\n"
+                 "       <ogc:Literal>%d</ogc:Literal>\n"
+                 "      </ogc:PropertyIsEqualTo>\n"
+                 "     </ogc:Filter>\n", i, i);
+        sld_append(&txt, &len, &alloced, rule);
+
+        if(geometry_type == POINTTYPE)
+            snprintf(rule, sizeof(rule),
+                     "     <se:PointSymbolizer>\n"
+                     "      <se:Graphic>\n"
+                     "       <se:Mark>\n"
+                     "        <se:WellKnownName>%s</se:WellKnownName>\n"
+                     "        <se:Fill>\n"
+                     "         <se:SvgParameter name=\"fill\">%s</se:SvgParameter>\n"
+                     "        </se:Fill>\n"
+                     "       </se:Mark>\n"
+                     "       <se:Size>%d</se:Size>\n"
+                     "      </se:Graphic>\n"
+                     "     </se:PointSymbolizer>\n", i % 2 ? "square" : "circle", color, 6 + i % 4);
+        else if(geometry_type == LINETYPE)
+            snprintf(rule, sizeof(rule),
+                     "     <se:LineSymbolizer>\n"
+                     "      <se:Stroke>\n"
+                     "       <se:SvgParameter name=\"stroke\">%s</se:SvgParameter>\n"
+                     "       <se:SvgParameter name=\"stroke-width\">%d</se:SvgParameter>\n"
+                     "      </se:Stroke>\n"
+                     "     </se:LineSymbolizer>\n", color, 1 + i % 3);
+        else
+            snprintf(rule, sizeof(rule),
+                     "     <se:PolygonSymbolizer>\n"
+                     "      <se:Fill>\n"
+                     "       <se:SvgParameter name=\"fill\">%s</se:SvgParameter>\n"
+                     "      </se:Fill>\n"
+                     "     </se:PolygonSymbolizer>\n", color);
+        sld_append(&txt, &len, &alloced, rule);
+
+        if(labels && geometry_type == POINTTYPE)
+            sld_append(&txt, &len, &alloced,
+                    "     <se:TextSymbolizer>\n"
+                    "      <se:Label>\n"
+                    "       <ogc:PropertyName>label</ogc:PropertyName>\n"
+                    "      </se:Label>\n"
+                    "      <se:Font>\n"
+                    "       <se:SvgParameter name=\"font-family\">default</se:SvgParameter>\n"
+                    "       <se:SvgParameter name=\"font-size\">10</se:SvgParameter>\n"
+                    "      </se:Font>\n"
+                    "      <se:Fill>\n"
+                    "       <se:SvgParameter name=\"fill\">#000000</se:SvgParameter>\n"
+                    "      </se:Fill>\n"
+                    "     </se:TextSymbolizer>\n");
+        sld_append(&txt, &len, &alloced, "    </se:Rule>\n");
+    }
+    sld_append(&txt, &len, &alloced,
+            "   </se:FeatureTypeStyle>\n"
+            "  </UserStyle>\n"
+            " </NamedLayer>\n"
+            "</StyledLayerDescriptor>\n");
+    return txt;
+}
+
+static int add_layer(sqlite3 *project, int layer_id, const char *name, const char *type, int show_text, const char *sld)
+{
+    int res;
+    sqlite3_stmt *ps = prepare(project, "INSERT INTO layers (layerID, name, source, title, defaultVisible, minScale, maxScale, "
+                               "type, showText, linewidth, sld, orderby) VALUES (?, ?, 'gen', ?, 1, 0, 1e9, ?, ?, 0, ?, ?);");
+    if(!ps)
+        return 1;
+    sqlite3_bind_int(ps, 1, layer_id);
+    sqlite3_bind_text(ps, 2, name, -1, SQLITE_STATIC);
+    sqlite3_bind_text(ps, 3, name, -1, SQLITE_STATIC);
+    sqlite3_bind_text(ps, 4, type, -1, SQLITE_STATIC);
+    sqlite3_bind_int(ps, 5, show_text);
+    sqlite3_bind_text(ps, 6, sld, -1, SQLITE_STATIC);
+    sqlite3_bind_int(ps, 7, layer_id);
+    res = step_and_reset(project, ps);
+    sqlite3_finalize(ps);
+    if(res)
+        return 1;
+
+    ps = prepare(project, "INSERT INTO info (layerID, field, row, column, header) VALUES (?, ?, ?, 0, ?);");
+    if(!ps)
+        return 1;
+    sqlite3_bind_int(ps, 1, layer_id);
+    sqlite3_bind_text(ps, 2, "twkb_id", -1, SQLITE_STATIC);
+    sqlite3_bind_int(ps, 3, 0);
+    sqlite3_bind_text(ps, 4, "id", -1, SQLITE_STATIC);
+    res = step_and_reset(project, ps);
+    if(!res)
+    {
+        sqlite3_bind_int(ps, 1, layer_id);
+        sqlite3_bind_text(ps, 2, "style", -1, SQLITE_STATIC);
+        sqlite3_bind_int(ps, 3, 1);
+        sqlite3_bind_text(ps, 4, "style", -1, SQLITE_STATIC);
+        res = step_and_reset(project, ps);
+    }
+    sqlite3_finalize(ps);
+    return res;
+}
+
+/*Project a coordinate from the map's zone to the layer's zone*/
+static void to_zone(double *x, double *y, int map_zone, int zone)
+{
+    GLfloat c[2];
+    if(zone == map_zone)
+        return;
+    c[0] = (GLfloat) *x;
+    c[1] = (GLfloat) *y;
+    reproject(c, (uint8_t) map_zone, (uint8_t) zone, 0, 0);
+    *x = c[0];
+    *y = c[1];
+}
+
+static int vector_layer(sqlite3 *project, sqlite3 *data, GEN_SETTINGS *gs, int layer_id, int geometry_type, int zone)
+{
+    char name[64];
+    char sql[1024];
+    const char *type_name = geometry_type == POINTTYPE ? "points" : (geometry_type == LINETYPE ? "lines" : "polygons");
+    int twkb_type = geometry_type == POLYGONTYPE ? MULTIPOLYGONTYPE : geometry_type;
+    int npoints = geometry_type == POINTTYPE ? 1 : gs->n_vertices;
+    long n = gs->n_features / gs->n_zones;
+    long i;
+    int j, res = 0;
+    int64_t *coords;
+    int64_t bbox[4];
+    double x, y, cx, cy, r, step, dir;
+    /*Features get smaller the more there are, to keep the density of vertices about the same*/
+    double feature_size = gs->width / sqrt((double) (n ? n : 1));
+    char label[32];
+    char *sld;
+    GEN_BUF twkb = {NULL, 0, 0}, body = {NULL, 0, 0}, tri = {NULL, 0, 0};
+    sqlite3_stmt *ps_feature, *ps_idx;
+
+    snprintf(name, sizeof(name), "%s_%d", type_name, zone);
+
+    snprintf(sql, sizeof(sql), "CREATE TABLE %s (twkb_id INTEGER PRIMARY KEY, twkb BLOB, tri_index BLOB, style INTEGER, label TEXT);"
+             "CREATE VIRTUAL TABLE %s_idx USING rtree(id, minX, maxX, minY, maxY);", name, name);
+    if(exec_sql(data, sql))
+        return 1;
+
+    snprintf(sql, sizeof(sql), "INSERT INTO geometry_columns VALUES ('%s', %d, 'twkb', 'twkb_id', 'twkb_id', '%s_idx', 'tri_index', %d, 0, 2);",
+             name, geometry_type, name, zone);
+    if(exec_sql(data, sql))
+        return 1;
+
+    sld = create_sld(geometry_type, gs->n_styles, gs->labels);
+    res = add_layer(project, layer_id, name, "vector", gs->labels && geometry_type == POINTTYPE, sld);
+    free(sld);
+    if(res)
+        return 1;
+
+    snprintf(sql, sizeof(sql), "INSERT INTO %s VALUES (?, ?, ?, ?, ?);", name);
+    ps_feature = prepare(data, sql);
+    snprintf(sql, sizeof(sql), "INSERT INTO %s_idx VALUES (?, ?, ?, ?, ?);", name);
+    ps_idx = prepare(data, sql);
+    if(!ps_feature || !ps_idx)
+        return 1;
+
+    /*Polygons has the first vertex repeated at the end*/
+    coords = malloc(2 * (npoints + 1) * sizeof(int64_t));
+
+    exec_sql(data, "BEGIN;");
+    for (i=0; i<n && !res; i++)
+    {
+        cx = gs->x - gs->width / 2 + rnd_unit() * gs->width;
+        cy = gs->y - gs->width / 2 + rnd_unit() * gs->width;
+        if(geometry_type == POINTTYPE)
+        {
+            x = cx;
+            y = cy;
+            to_zone(&x, &y, gs->zones[0], zone);
+            coords[0] = llround(x);
+            coords[1] = llround(y);
+        }
+        else if(geometry_type == LINETYPE)
+        {
+            /*A random walk that mostly keeps its direction*/
+            step = feature_size / npoints;
+            dir = rnd_unit() * 2 * M_PI;
+            x = cx;
+            y = cy;
+            for (j=0; j<npoints; j++)
+            {
+                double px = x, py = y;
+                to_zone(&px, &py, gs->zones[0], zone);
+                coords[2*j] = llround(px);
+                coords[2*j+1] = llround(py);
+                dir += (rnd_unit() - 0.5);
+                x += step * cos(dir);
+                y += step * sin(dir);
+            }
+        }
+        else
+        {
+            r = feature_size * (0.1 + 0.3 * rnd_unit());
+            for (j=0; j<npoints; j++)
+            {
+                x = cx + r * cos(2 * M_PI * j / npoints);
+                y = cy + r * sin(2 * M_PI * j / npoints);
+                to_zone(&x, &y, gs->zones[0], zone);
+                coords[2*j] = llround(x);
+                coords[2*j+1] = llround(y);
+            }
+            coords[2*npoints] = coords[0];
+            coords[2*npoints+1] = coords[1];
+        }
+
+        write_twkb(&twkb, &body, twkb_type, coords, geometry_type == POLYGONTYPE ? npoints + 1 : npoints, bbox);
+
+        sqlite3_bind_int64(ps_feature, 1, i + 1);
+        sqlite3_bind_blob(ps_feature, 2, twkb.buf, (int) twkb.used, SQLITE_STATIC);
+        if(geometry_type == POLYGONTYPE)
+        {
+            write_fan(&tri, npoints);
+            sqlite3_bind_blob(ps_feature, 3, tri.buf, (int) tri.used, SQLITE_STATIC);
+        }
+        else
+            sqlite3_bind_null(ps_feature, 3);
+        sqlite3_bind_int(ps_feature, 4, (int) (rnd() % gs->n_styles));
+        snprintf(label, sizeof(label), "%s %ld", type_name, i + 1);
+        sqlite3_bind_text(ps_feature, 5, label, -1, SQLITE_STATIC);
+        res = step_and_reset(data, ps_feature);
+
+        sqlite3_bind_int64(ps_idx, 1, i + 1);
+        sqlite3_bind_double(ps_idx, 2, (double) bbox[0]);
+        sqlite3_bind_double(ps_idx, 3, (double) bbox[2]);
+        sqlite3_bind_double(ps_idx, 4, (double) bbox[1]);
+        sqlite3_bind_double(ps_idx, 5, (double) bbox[3]);
+        res = res || step_and_reset(data, ps_idx);
+    }
+    exec_sql(data, "COMMIT;");
+
+    printf("%s: %ld features\n", name, n);
+    free(coords);
+    free(twkb.buf);
+    free(body.buf);
+    free(tri.buf);
+    sqlite3_finalize(ps_feature);
+    sqlite3_finalize(ps_idx);
+    return res;
+}
+
+static int raster_layer(sqlite3 *project, sqlite3 *data, GEN_SETTINGS *gs, int layer_id)
+{
+    int x, y, res = 0;
+    int n = gs->raster_tiles;
+    double tile_width = gs->width / n;
+    double minx, miny;
+    int64_t coords[8];
+    int64_t bbox[4];
+    char color[8];
+    unsigned int r, g, b;
+    GEN_BUF twkb = {NULL, 0, 0}, body = {NULL, 0, 0}, bmp = {NULL, 0, 0};
+    sqlite3_stmt *ps_tile, *ps_idx;
+
+    if(exec_sql(data, "CREATE TABLE raster (id INTEGER PRIMARY KEY, geom BLOB, tile BLOB, x INTEGER, y INTEGER);"
+                "CREATE VIRTUAL TABLE raster_idx USING rtree(id, minX, maxX, minY, maxY);"))
+        return 1;
+
+    char sql[512];
+    snprintf(sql, sizeof(sql), "INSERT INTO raster_columns VALUES ('raster', 'geom', 'tile', 'id', 'raster_idx', %d, 0, %d, %d);",
+             gs->zones[0], gs->tile_size, gs->tile_size);
+    if(exec_sql(data, sql) || add_layer(project, layer_id, "raster", "raster", 0, NULL))
+        return 1;
+
+    ps_tile = prepare(data, "INSERT INTO raster VALUES (?, ?, ?, ?, ?);");
+    ps_idx = prepare(data, "INSERT INTO raster_idx VALUES (?, ?, ?, ?, ?);");
+    if(!ps_tile || !ps_idx)
+        return 1;
+
+    exec_sql(data, "BEGIN;");
+    for (x=0; x<n && !res; x++)
+    {
+        for (y=0; y<n && !res; y++)
+        {
+            minx = gs->x - gs->width / 2 + x * tile_width;
+            miny = gs->y - gs->width / 2 + y * tile_width;
+
+            /*Top left, top right, bottom right, bottom left, the order of the texture coordinates*/
+            coords[0] = llround(minx);
+            coords[1] = llround(miny + tile_width);
+            coords[2] = llround(minx + tile_width);
+            coords[3] = llround(miny + tile_width);
+            coords[4] = llround(minx + tile_width);
+            coords[5] = llround(miny);
+            coords[6] = llround(minx);
+            coords[7] = llround(miny);
+            write_twkb(&twkb, &body, LINETYPE, coords, 4, bbox);
+
+            style_color((x + y) % 12, 12, color);
+            sscanf(color, "#%02x%02x%02x", &r, &g, &b);
+            write_bmp(&bmp, gs->tile_size, (uint8_t) r, (uint8_t) g, (uint8_t) b);
+
+            sqlite3_bind_int(ps_tile, 1, x * n + y + 1);
+            sqlite3_bind_blob(ps_tile, 2, twkb.buf, (int) twkb.used, SQLITE_STATIC);
+            sqlite3_bind_blob(ps_tile, 3, bmp.buf, (int) bmp.used, SQLITE_STATIC);
+            sqlite3_bind_int(ps_tile, 4, x);
+            sqlite3_bind_int(ps_tile, 5, y);
+            res = step_and_reset(data, ps_tile);
+
+            sqlite3_bind_int(ps_idx, 1, x * n + y + 1);
+            sqlite3_bind_double(ps_idx, 2, (double) bbox[0]);
+            sqlite3_bind_double(ps_idx, 3, (double) bbox[2]);
+            sqlite3_bind_double(ps_idx, 4, (double) bbox[1]);
+            sqlite3_bind_double(ps_idx, 5, (double) bbox[3]);
+            res = res || step_and_reset(data, ps_idx);
+        }
+    }
+    exec_sql(data, "COMMIT;");
+
+    printf("raster: %d tiles\n", n * n);
+    free(twkb.buf);
+    free(body.buf);
+    free(bmp.buf);
+    sqlite3_finalize(ps_tile);
+    sqlite3_finalize(ps_idx);
+    return res;
+}
+
+static int generate(GEN_SETTINGS *gs)
+{
+    sqlite3 *project, *data;
+    const char *fontfile = gs->fontfile;
+    const char *datasource;
+    char sql[512];
+    int i, layer_id = 1, res = 0;
+
+    project = create_db(gs->projectfile);
+    data = create_db(gs->datafile);
+    if(!project || !data || create_project_tables(project) || create_data_tables(data))
+        return 1;
+
+    /*The client looks for the data db in the directory given with -d*/
+    datasource = strrchr(gs->datafile, '/');
+    datasource = datasource ? datasource + 1 : gs->datafile;
+    snprintf(sql, sizeof(sql), "INSERT INTO dbs VALUES ('gen', '%s');"
+             "INSERT INTO init_box VALUES (%f, %f, %f, %d, 0);", datasource, gs->x, gs->y, gs->width, gs->zones[0]);
+    res = exec_sql(project, sql);
+
+    for (i=0; !fontfile && default_fonts[i]; i++)
+    {
+        FILE *f = fopen(default_fonts[i], "rb");
+        if(f)
+        {
+            fclose(f);
+            fontfile = default_fonts[i];
+        }
+    }
+    if(fontfile)
+        res = res || add_font(project, fontfile);
+    else
+        fprintf(stderr, "Warning, no font found. Give one with -F, the client needs a font\n");
+
+    /*Layers are rendered in order, so rasters first and points on top*/
+    if(!res && gs->raster_tiles)
+        res = raster_layer(project, data, gs, layer_id++);
+    for (i=0; i<gs->n_zones && !res; i++)
+        res = vector_layer(project, data, gs, layer_id++, POLYGONTYPE, gs->zones[i]);
+    for (i=0; i<gs->n_zones && !res; i++)
+        res = vector_layer(project, data, gs, layer_id++, LINETYPE, gs->zones[i]);
+    for (i=0; i<gs->n_zones && !res; i++)
+        res = vector_layer(project, data, gs, layer_id++, POINTTYPE, gs->zones[i]);
+
+    sqlite3_close(project);
+    sqlite3_close(data);
+    return res;
+}
+
+static void usage()
+{
+    printf("tileLessGenerate [options]\n"
+           " -o file     project db to write, default generated.tileless\n"
+           " -D file     data db to write, default generated.sqlite\n"
+           " -n count    features per geometry type, default 10000\n"
+           " -v count    vertices per line and polygon, default 16\n"
+           " -s count    number of styles per layer, default 8\n"
+           " -z zones    comma separated utm zones, the first is the zone of the map, default 33\n"
+           " -r count    raster tiles per side, default 0 (no raster layer)\n"
+           " -t pixels   raster tile size, default 256\n"
+           " -x, -y, -w  center and width of the extent in meters, default 325000 6800000 100000\n"
+           " -F file     ttf font to put in the project\n"
+           " -S seed     seed for the random numbers, default 1\n"
+           " -l          label the points\n");
+}
+
+int main(int argc, char **argv)
+{
+    GEN_SETTINGS gs;
+    char *zones, *tok;
+    int i;
+
+    memset(&gs, 0, sizeof(GEN_SETTINGS));
+    gs.projectfile = "generated.tileless";
+    gs.datafile = "generated.sqlite";
+    gs.n_features = 10000;
+    gs.n_vertices = 16;
+    gs.n_styles = 8;
+    gs.zones[0] = 33;
+    gs.n_zones = 1;
+    gs.tile_size = 256;
+    gs.x = 325000;
+    gs.y = 6800000;
+    gs.width = 100000;
+    gs.seed = 1;
+
+    for (i=1; i<argc; i++)
+    {
+        if(!strcmp(argv[i], "-l"))
+        {
+            gs.labels = 1;
+            continue;
+        }
+        if(i + 1 >= argc || argv[i][0] != '-' || strlen(argv[i]) != 2)
+        {
+            usage();
+            return 1;
+        }
+        switch (argv[i][1])
+        {
+        case 'o': gs.projectfile = argv[++i]; break;
+        case 'D': gs.datafile = argv[++i]; break;
+        case 'n': gs.n_features = atol(argv[++i]); break;
+        case 'v': gs.n_vertices = atoi(argv[++i]); break;
+        case 's': gs.n_styles = atoi(argv[++i]); break;
+        case 'r': gs.raster_tiles = atoi(argv[++i]); break;
+        case 't': gs.tile_size = atoi(argv[++i]); break;
+        case 'x': gs.x = atof(argv[++i]); break;
+        case 'y': gs.y = atof(argv[++i]); break;
+        case 'w': gs.width = atof(argv[++i]); break;
+        case 'F': gs.fontfile = argv[++i]; break;
+        case 'S': gs.seed = strtoull(argv[++i], NULL, 10); break;
+        case 'z':
+            zones = argv[++i];
+            gs.n_zones = 0;
+            for (tok = strtok(zones, ","); tok && gs.n_zones < GEN_MAX_ZONES; tok = strtok(NULL, ","))
+                gs.zones[gs.n_zones++] = atoi(tok);
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if(gs.n_vertices < 3 || gs.n_styles < 1 || gs.n_zones < 1 || gs.tile_size < 1 || gs.n_features < 0)
+    {
+        usage();
+        return 1;
+    }
+    for (i=0; i<gs.n_zones; i++)
+    {
+        if(gs.zones[i] < 1 || gs.zones[i] > 60)
+        {
+            fprintf(stderr, "Invalid utm zone %d\n", gs.zones[i]);
+            return 1;
+        }
+    }
+
+    rnd_state = gs.seed ? gs.seed : 1;
+    return generate(&gs);
+}
@@ -0,0 +1,426 @@
+/**********************************************************************
+ *
+ * TileLessMap
+ *
+ * TileLessMap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * TileLessMap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TileLessMap.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **********************************************************************
+ *
+ * Copyright (C) 2016-2018 Nicklas Avén
+ *
+ ***********************************************************************/
+
+
+/**********************************************************************
+ * Recording and replay of user interaction.
+ *
+ * When recording, every mouse, wheel, finger and gps event mainLoop
+ * gets is written to a trace file with the time it arrived.
+ * When replaying, the events are read back and handed to mainLoop
+ * one by one, in the recorded pace or as fast as possible, instead of
+ * the live input. Events from the application itself, like decoded
+ * raster tiles, are still delivered as usual.
+ * Since every recorded event is handed over separately, mouse motions
+ * that were skipped because more events were waiting when recorded
+ * are all rendered in the replay. That makes the replay deterministic.
+ ***********************************************************************/
+
+#include "theclient.h"
+#include "trace.h"
+#include "tilelessmap.h"
+
+/*How often the recorded events are flushed to the file*/
+#define TRACE_FLUSH_INTERVAL 256
+
+static FILE *record_file = NULL;
+static uint32_t record_start = 0;
+static unsigned int n_recorded = 0;
+
+static FILE *replay_file = NULL;
+static int replay_max_speed = 0;
+static uint32_t replay_start = 0;
+static unsigned int n_replayed = 0;
+static uint32_t replay_w, replay_h;
+
+/*Where the mouse was at the last replayed event*/
+static int replay_mouse_x = 0;
+static int replay_mouse_y = 0;
+
+
+static int write_header(FILE *f)
+{
+    uint32_t head[3] = {TRACE_VERSION, (uint32_t) CURR_WIDTH, (uint32_t) CURR_HEIGHT};
+    if(fwrite(TRACE_MAGIC, 1, 8, f) != 8 || fwrite(head, sizeof(uint32_t), 3, f) != 3)
+        return 1;
+    return 0;
+}
+
+static int read_header(FILE *f)
+{
+    char magic[8];
+    uint32_t head[3];
+    if(fread(magic, 1, 8, f) != 8 || memcmp(magic, TRACE_MAGIC, 8) || fread(head, sizeof(uint32_t), 3, f) != 3)
+        return 1;
+    if(head[0] != TRACE_VERSION)
+    {
+        log_this(100, "Unknown trace version %u\n", head[0]);
+        return 1;
+    }
+    replay_w = head[1];
+    replay_h = head[2];
+    return 0;
+}
+
+/**
+ * Translate an SDL event to a record. Returns 0 for events we don't record.
+ * Mouse events has x, y in v[0], v[1]. Motions has the relative movement in v[2], v[3].
+ * Wheel has the scroll in v[0], v[1] and the mouse position in v[2], v[3] since mainLoop reads the mouse position.
+ * Finger events has x, y, dx, dy as SDL. Gps has the reprojected position and accuracy of gps_point.
+ */
+static int event2record(SDL_Event *ev, TRACE_RECORD *r)
+{
+    int x, y;
+    memset(r, 0, sizeof(TRACE_RECORD));
+    if(ev->type == GPSEventType)
+    {
+        r->type = TRACE_GPS;
+        r->v[0] = gps_point.x;
+        r->v[1] = gps_point.y;
+        r->v[2] = gps_point.s;
+        return 1;
+    }
+    switch (ev->type)
+    {
+    case SDL_MOUSEBUTTONDOWN:
+    case SDL_MOUSEBUTTONUP:
+        r->type = ev->type == SDL_MOUSEBUTTONDOWN ? TRACE_MOUSE_DOWN : TRACE_MOUSE_UP;
+        r->button = ev->button.button;
+        r->v[0] = ev->button.x;
+        r->v[1] = ev->button.y;
+        return 1;
+    case SDL_MOUSEMOTION:
+        r->type = TRACE_MOUSE_MOTION;
+        r->button = ev->motion.state;
+        r->v[0] = ev->motion.x;
+        r->v[1] = ev->motion.y;
+        r->v[2] = ev->motion.xrel;
+        r->v[3] = ev->motion.yrel;
+        return 1;
+    case SDL_MOUSEWHEEL:
+        r->type = TRACE_MOUSE_WHEEL;
+        SDL_GetMouseState(&x, &y);
+        r->v[0] = ev->wheel.x;
+        r->v[1] = ev->wheel.y;
+        r->v[2] = x;
+        r->v[3] = y;
+        return 1;
+    case SDL_FINGERDOWN:
+    case SDL_FINGERUP:
+    case SDL_FINGERMOTION:
+        if(ev->type == SDL_FINGERDOWN)
+            r->type = TRACE_FINGER_DOWN;
+        else if(ev->type == SDL_FINGERUP)
+            r->type = TRACE_FINGER_UP;
+        else
+            r->type = TRACE_FINGER_MOTION;
+        r->id = ev->tfinger.fingerId;
+        r->v[0] = ev->tfinger.x;
+        r->v[1] = ev->tfinger.y;
+        r->v[2] = ev->tfinger.dx;
+        r->v[3] = ev->tfinger.dy;
+        return 1;
+    case SDL_WINDOWEVENT:
+        if(ev->window.event != SDL_WINDOWEVENT_RESIZED)
+            return 0;
+        r->type = TRACE_RESIZE;
+        r->v[0] = ev->window.data1;
+        r->v[1] = ev->window.data2;
+        return 1;
+    }
+    return 0;
+}
+
+static int record2event(TRACE_RECORD *r, SDL_Event *ev)
+{
+    memset(ev, 0, sizeof(SDL_Event));
+    ev->common.timestamp = SDL_GetTicks();
+    switch (r->type)
+    {
+    case TRACE_MOUSE_DOWN:
+    case TRACE_MOUSE_UP:
+        ev->type = r->type == TRACE_MOUSE_DOWN ? SDL_MOUSEBUTTONDOWN : SDL_MOUSEBUTTONUP;
+        ev->button.button = (Uint8) r->button;
+        ev->button.state = r->type == TRACE_MOUSE_DOWN ? SDL_PRESSED : SDL_RELEASED;
+        ev->button.x = replay_mouse_x = (Sint32) r->v[0];
+        ev->button.y = replay_mouse_y = (Sint32) r->v[1];
+        return 1;
+    case TRACE_MOUSE_MOTION:
+        ev->type = SDL_MOUSEMOTION;
+        ev->motion.state = r->button;
+        ev->motion.x = replay_mouse_x = (Sint32) r->v[0];
+        ev->motion.y = replay_mouse_y = (Sint32) r->v[1];
+        ev->motion.xrel = (Sint32) r->v[2];
+        ev->motion.yrel = (Sint32) r->v[3];
+        return 1;
+    case TRACE_MOUSE_WHEEL:
+        ev->type = SDL_MOUSEWHEEL;
+        ev->wheel.x = (Sint32) r->v[0];
+        ev->wheel.y = (Sint32) r->v[1];
+        replay_mouse_x = (int) r->v[2];
+        replay_mouse_y = (int) r->v[3];
+        return 1;
+    case TRACE_FINGER_DOWN:
+    case TRACE_FINGER_UP:
+    case TRACE_FINGER_MOTION:
+        if(r->type == TRACE_FINGER_DOWN)
+            ev->type = SDL_FINGERDOWN;
+        else if(r->type == TRACE_FINGER_UP)
+            ev->type = SDL_FINGERUP;
+        else
+            ev->type = SDL_FINGERMOTION;
+        ev->tfinger.fingerId = r->id;
+        ev->tfinger.x = r->v[0];
+        ev->tfinger.y = r->v[1];
+        ev->tfinger.dx = r->v[2];
+        ev->tfinger.dy = r->v[3];
+        ev->tfinger.pressure = 1;
+        return 1;
+    case TRACE_GPS:
+        if(GPSEventType == ((Uint32)-1))
+            GPSEventType = SDL_RegisterEvents(1);
+        gps_point.x = r->v[0];
+        gps_point.y = r->v[1];
+        gps_point.s = r->v[2];
+        ev->type = GPSEventType;
+        ev->user.code = 1;
+        return 1;
+    case TRACE_RESIZE:
+        ev->type = SDL_WINDOWEVENT;
+        ev->window.event = SDL_WINDOWEVENT_RESIZED;
+        ev->window.data1 = (Sint32) r->v[0];
+        ev->window.data2 = (Sint32) r->v[1];
+        return 1;
+    }
+    return 0;
+}
+
+/*Live events that are replaced by the trace while replaying*/
+static int is_input(SDL_Event *ev)
+{
+    TRACE_RECORD r;
+    if(ev->type == SDL_WINDOWEVENT)
+        return 0;
+    return event2record(ev, &r);
+}
+
+static void end_replay()
+{
+    SDL_Event quit;
+    log_this(100, "Replay finished, %u events in %u ms\n", n_replayed, SDL_GetTicks() - replay_start);
+    fclose(replay_file);
+    replay_file = NULL;
+
+    /*A replay is a workload run, so we quit when it's done*/
+    memset(&quit, 0, sizeof(SDL_Event));
+    quit.type = SDL_QUIT;
+    SDL_PushEvent(&quit);
+}
+
+/**
+ * Next replayed event. Until it is time for it, events from the application is delivered.
+ * Returns 0 if it is not time for the next event within timeout ms, a negative timeout waits as long as needed
+ */
+static int replay_event(SDL_Event *ev, int timeout)
+{
+    TRACE_RECORD r;
+    uint32_t now, wait;
+    uint32_t deadline = SDL_GetTicks() + (uint32_t) timeout;
+
+    if(!replay_start)
+    {
+        replay_start = SDL_GetTicks();
+        /*We want the same window size as when recorded*/
+        if(replay_w && replay_h && ((int) replay_w != CURR_WIDTH || (int) replay_h != CURR_HEIGHT))
+            SDL_SetWindowSize(SDL_GL_GetCurrentWindow(), replay_w, replay_h);
+    }
+
+    while(1)
+    {
+        if(fread(&r, sizeof(TRACE_RECORD), 1, replay_file) != 1)
+        {
+            end_replay();
+            return timeout < 0 ? SDL_WaitEvent(ev) : SDL_WaitEventTimeout(ev, timeout);
+        }
+        /*Records we don't know are skipped. The record is not turned into an event until it is handed over,
+         * since that sets the replayed mouse and gps position*/
+        if(r.type < TRACE_MOUSE_DOWN || r.type > TRACE_RESIZE)
+            continue;
+
+        while(!replay_max_speed && (now = SDL_GetTicks() - replay_start) < r.time)
+        {
+            SDL_Event own;
+            wait = r.time - now;
+            if(timeout >= 0)
+            {
+                if(SDL_TICKS_PASSED(SDL_GetTicks(), deadline))
+                {
+                    /*Idle until the deadline, the same record is read again next time*/
+                    fseek(replay_file, -(long) sizeof(TRACE_RECORD), SEEK_CUR);
+                    return 0;
+                }
+                if(deadline - SDL_GetTicks() < wait)
+                    wait = deadline - SDL_GetTicks();
+            }
+            if(SDL_WaitEventTimeout(&own, wait) && !is_input(&own))
+            {
+                /*Deliver the application's own event and read the same record again next time*/
+                fseek(replay_file, -(long) sizeof(TRACE_RECORD), SEEK_CUR);
+                *ev = own;
+                return 1;
+            }
+        }
+        if(replay_max_speed)
+        {
+            SDL_Event own;
+            while(SDL_PollEvent(&own))
+            {
+                if(!is_input(&own))
+                {
+                    fseek(replay_file, -(long) sizeof(TRACE_RECORD), SEEK_CUR);
+                    *ev = own;
+                    return 1;
+                }
+            }
+        }
+        record2event(&r, ev);
+        n_replayed++;
+        return 1;
+    }
+}
+
+static void record_event(SDL_Event *ev)
+{
+    TRACE_RECORD r;
+    if(!event2record(ev, &r))
+        return;
+    r.time = SDL_GetTicks() - record_start;
+    if(fwrite(&r, sizeof(TRACE_RECORD), 1, record_file) != 1)
+    {
+        log_this(100, "Failed to write to trace, recording stopped\n");
+        trace_stop();
+        return;
+    }
+    if(!(++n_recorded % TRACE_FLUSH_INTERVAL))
+        fflush(record_file);
+}
+
+/**
+ * Works as SDL_WaitEvent.
+ * Returns the next replayed event when replaying, and records the events when recording
+ */
+int trace_wait_event(SDL_Event *ev)
+{
+    return trace_wait_event_timeout(ev, -1);
+}
+
+/**
+ * Used by mainLoop instead of SDL_WaitEventTimeout, with a negative timeout it waits until there is an event.
+ * Returns 0 if there was no event within timeout ms
+ */
+int trace_wait_event_timeout(SDL_Event *ev, int timeout)
+{
+    if(replay_file)
+        return replay_event(ev, timeout);
+
+    if(timeout < 0 ? !SDL_WaitEvent(ev) : !SDL_WaitEventTimeout(ev, timeout))
+        return 0;
+
+    if(record_file)
+        record_event(ev);
+    return 1;
+}
+
+/*The mouse position at the current event, from the trace when replaying*/
+void trace_mouse_state(int *x, int *y)
+{
+    if(replay_file)
+    {
+        *x = replay_mouse_x;
+        *y = replay_mouse_y;
+        return;
+    }
+    SDL_GetMouseState(x, y);
+}
+
+void trace_stop()
+{
+    if(record_file)
+    {
+        log_this(100, "Recorded %u events\n", n_recorded);
+        fclose(record_file);
+    }
+    record_file = NULL;
+    if(replay_file)
+        fclose(replay_file);
+    replay_file = NULL;
+}
+
+
+/**
+ * Record the users interaction to filename, from TLM_start until the application is closed
+ */
+extern int TLM_record_trace(const char *filename)
+{
+    trace_stop();
+    record_file = fopen(filename, "wb");
+    if(!record_file)
+    {
+        log_this(100, "Cannot open trace file %s for writing\n", filename);
+        return 1;
+    }
+    if(write_header(record_file))
+    {
+        log_this(100, "Cannot write to trace file %s\n", filename);
+        trace_stop();
+        return 1;
+    }
+    record_start = SDL_GetTicks();
+    n_recorded = 0;
+    return 0;
+}
+
+/**
+ * Replay a recorded trace instead of the users input, and quit when finished.
+ * With max_speed the events are handed over as fast as they are handled, otherwise in the recorded pace
+ */
+extern int TLM_replay_trace(const char *filename, int max_speed)
+{
+    trace_stop();
+    replay_file = fopen(filename, "rb");
+    if(!replay_file)
+    {
+        log_this(100, "Cannot open trace file %s\n", filename);
+        return 1;
+    }
+    if(read_header(replay_file))
+    {
+        log_this(100, "%s is not a trace file\n", filename);
+        trace_stop();
+        return 1;
+    }
+    replay_max_speed = max_speed;
+    replay_start = 0;
+    n_replayed = 0;
+    return 0;
+}
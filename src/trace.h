@@ -0,0 +1,61 @@
+/**********************************************************************
+ *
+ * TileLessMap
+ *
+ * TileLessMap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * TileLessMap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TileLessMap.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **********************************************************************
+ *
+ * Copyright (C) 2016-2018 Nicklas Avén
+ *
+ ***********************************************************************/
+#ifndef _trace_H
+#define _trace_H
+
+#include "theclient.h"
+
+#define TRACE_MAGIC "TLMTRACE"
+#define TRACE_VERSION 1
+
+/*Kinds of events in a trace. Our own numbers, since user events get their numbers at runtime*/
+#define TRACE_MOUSE_DOWN 1
+#define TRACE_MOUSE_UP 2
+#define TRACE_MOUSE_MOTION 3
+#define TRACE_MOUSE_WHEEL 4
+#define TRACE_FINGER_DOWN 5
+#define TRACE_FINGER_UP 6
+#define TRACE_FINGER_MOTION 7
+#define TRACE_GPS 8
+#define TRACE_RESIZE 9
+
+/**
+ * One event in a trace file. The file starts with TRACE_MAGIC, the version
+ * and the window width and height as uint32, followed by the records.
+ * Everything is written in the byte order of the recording device.
+ */
+typedef struct
+{
+    uint32_t time; // ms since the recording started
+    uint16_t type;
+    uint16_t button; // mouse button or button state
+    int64_t id; // finger id
+    float v[4]; // positions, see record_event
+} TRACE_RECORD;
+
+int trace_wait_event(SDL_Event *ev);
+int trace_wait_event_timeout(SDL_Event *ev, int timeout);
+void trace_mouse_state(int *x, int *y);
+void trace_stop();
+
+#endif
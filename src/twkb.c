@@ -25,6 +25,9 @@
 #include "theclient.h"
 #include "buffer_handling.h"
 #include "twkb.h"
+#include "geom_cache.h"
+#include "stats.h"
+#include "tilelessmap.h"
 /*
 static int get_blob(TWKB_BUF *tb,sqlite3_stmt *res, int icol)
 {
@@ -53,73 +56,105 @@ static int get_blob(TWKB_BUF *tb,sqlite3_stmt *res, int icol)
 
 
 
+/**
+ * Point res at the blob in column icol, without copying it.
+ * The memory belongs to sqlite and is only valid until the statement is stepped
+ * or reset, so anything that has to live longer than the row has to be copied
+ * by the caller, like the raster tiles into rast->data.
+ */
 static int get_blob( sqlite3_stmt *prep, int icol,uint8_t **res,size_t *res_len)
 {
-
-
-    /*twkb-buffer*/
-    uint8_t *buf;
-    size_t buf_len;
-    const sqlite3_blob *db_blob;
+    const void *db_blob;
 
     db_blob = sqlite3_column_blob(prep, icol);
+    *res_len = (size_t) sqlite3_column_bytes(prep, icol);
 
-    buf_len = sqlite3_column_bytes(prep, icol);
-    //   log_this(10, "blob size;%d\n", buf_len);
-    buf = malloc(buf_len);
-    memcpy(buf, db_blob,buf_len);
-
-
-    *res = buf;
-    *res_len = buf_len;
-    //printf("allocate buffer at %p\n",tb->start_pos);
+    /*A NULL blob with length is an out of memory error in sqlite*/
+    if(!db_blob && *res_len)
+        return 1;
 
+    /*The decoder never writes to the buffer*/
+    *res = (uint8_t*) db_blob;
     return 0;
-
-
 }
 
-void *twkb_fromSQLiteBBOX_thread(void *theL)
-{
-    twkb_fromSQLiteBBOX(theL);
-
-    pthread_exit(NULL);
-    return NULL;
-}
 
-void *twkb_fromSQLiteBBOX(void *theL)
+/**
+ * Decode the geometry, and for polygons the element array, of the current row.
+ * With a cull_box the geometry can be skipped or collapsed, see decode_twkb.
+ * Then *culled is set to TWKB_CULLED, TWKB_COLLAPSED or TWKB_DROPPED, else to 0
+ */
+static int decode_row(LAYER_RUNTIME *theLayer, sqlite3_stmt *prepared_statement, TWKB_PARSE_STATE *ts, GLfloat *cull_box, int *culled)
 {
-    log_this(10, "Entering twkb_fromSQLiteBBOX, prepared = %p\n", ((LAYER_RUNTIME*) theL)->preparedStatement->ps);
-    /*twkb structures*/
-    TWKB_HEADER_INFO thi;
-    TWKB_PARSE_STATE ts;
     TWKB_BUF tb;
-    sqlite3_stmt *prepared_statement;
     uint8_t *res;
     size_t res_len;
-    GLfloat *ext;
-    BBOX bbox;
-    ts.thi = &thi;
-    ts.thi->bbox=&bbox;
-    LAYER_RUNTIME *theLayer = (LAYER_RUNTIME *) theL;
 
-    ts.theLayer = (LAYER_RUNTIME *) theL;
+    *culled = 0;
+    if(get_blob(prepared_statement,0, &res, &res_len))
+        return 1;
+
+    tb.start_pos = tb.read_pos = res;
+    tb.end_pos=res+res_len;
+    tb.BufOffsetFromBof = 0;
+    ts->tb=&tb;
+    ts->utm_zone = theLayer->utm_zone;
+    ts->hemisphere = theLayer->hemisphere;
+    ts->style = get_style(theLayer->styles, &(ts->styleID), ts->styleid_type);
+    ts->cull_box = cull_box;
+    while (ts->tb->read_pos<ts->tb->end_pos)
+    {
+        *culled = decode_twkb(ts);
+    }
+    if(*culled == TWKB_CULLED || *culled == TWKB_DROPPED)
+    {
+        ts->tb = NULL;
+        return 0;
+    }
 
-    GLfloat rotation;
-    GLint anchor;
-    int size;
-//log_this(10, "sqlite_error? %d\n",sqlite3_config(SQLITE_CONFIG_SERIALIZED ));
+    if(theLayer->type & 4)
+    {
+        if(get_blob(prepared_statement,1, &res, &res_len))
+            return 1;
 
+        tb.start_pos = tb.read_pos = res;
+        tb.end_pos=res+res_len;
+        ts->tb=&tb;
 
-    prepared_statement = theLayer->preparedStatement->ps;
-    ext = theLayer->BBOX;
-    //rc = sqlite3_exec(db, sql, callback, 0, &err_msg);
+        while (ts->tb->read_pos<ts->tb->end_pos)
+        {
+            decode_element_array(ts);
+        }
+    }
+    ts->tb = NULL;
+    return 0;
+}
 
+/*The level of detail to use at meter per pixel mpp, -1 for the layer's own geometry*/
+int geom_level(LAYER_RUNTIME *theLayer, GLfloat mpp)
+{
+    int i;
+    for (i=0; i<theLayer->n_levels; i++)
+    {
+        if(mpp >= theLayer->levels[i].min_mpp && mpp < theLayer->levels[i].max_mpp)
+            return i;
+    }
+    return -1;
+}
 
-    int err = sqlite3_errcode(projectDB);
-    if(err)
-        log_this(1,"sqlite problem, %d\n",err);
+void *twkb_fromSQLiteBBOX(void *theL)
+{
+    LAYER_RUNTIME *theLayer = (LAYER_RUNTIME *) theL;
+    if(theLayer->geom_level >= 0)
+        return twkb_fromSQLiteBBOX_stmt(theLayer, theLayer->levels[theLayer->geom_level].ps);
+    return twkb_fromSQLiteBBOX_stmt(theLayer, theLayer->preparedStatement->ps);
+}
 
+static void *fetch_bbox(LAYER_RUNTIME *theLayer, sqlite3_stmt *prepared_statement, GLfloat *cull_box);
+
+/*The box ext in the map's projection, as a box in the layer's projection covering it*/
+static void layer_box(LAYER_RUNTIME *theLayer, GLfloat *ext, GLfloat *box)
+{
     if((theLayer->utm_zone != curr_utm) || (theLayer->hemisphere != curr_hemi))
     {
         GLfloat reproj_coord[2];
@@ -128,9 +163,6 @@ void *twkb_fromSQLiteBBOX(void *theL)
         GLfloat minx;
         GLfloat miny;
 
-
-
-
         reproj_coord[0] = ext[0];
         reproj_coord[1] = ext[1];
 
@@ -167,29 +199,192 @@ void *twkb_fromSQLiteBBOX(void *theL)
         if(miny > reproj_coord[1])
             miny = reproj_coord[1];
 
+        box[0] = minx;
+        box[1] = miny;
+        box[2] = maxx;
+        box[3] = maxy;
+    }
+    else
+        memcpy(box, ext, 4 * sizeof(GLfloat));
+}
+
+extern void TLM_set_decimation(float pixels)
+{
+    decimate_pixels = pixels > 0 ? pixels : 0;
+}
+
+extern void TLM_set_gpu_reprojection(int enabled)
+{
+    gpu_reprojection = enabled;
+}
+
+/**
+ * Check if the layer should be loaded in its own zone and reprojected in the shaders, for the view bbox.
+ * That is only done if a polynomial fitted over the view is within a fraction of a pixel
+ */
+int gpu_reproject(LAYER_RUNTIME *theLayer, GLfloat *bbox, GLfloat mpp)
+{
+    GLfloat box[4];
+    GLfloat poly[16];
 
-        sqlite3_bind_double(prepared_statement, 1,(float) maxx); //minX
-        sqlite3_bind_double(prepared_statement, 2,(float) minx); //minY
-        sqlite3_bind_double(prepared_statement, 3,(float) maxy); //maxX
-        sqlite3_bind_double(prepared_statement, 4,(float) miny); //maxY
+    if(!gpu_reprojection || theLayer->geometryType == RASTER)
+        return 0;
+    if((theLayer->utm_zone == curr_utm) && (theLayer->hemisphere == curr_hemi))
+        return 0;
 
+    layer_box(theLayer, bbox, box);
+    return !reproj_poly_build(poly, box, theLayer->utm_zone, curr_utm, theLayer->hemisphere, curr_hemi,
+                              REPROJ_POLY_MAX_ERROR_PIXELS * mpp);
+}
+
+/*Fit the shaders' reprojection to the view bbox, if it is not already done*/
+void update_reproj_poly(LAYER_RUNTIME *theLayer, GLfloat *bbox)
+{
+    GLfloat box[4];
 
+    if(!theLayer->gpu_reproject)
+    {
+        reproj_poly_identity(theLayer->reproj_poly);
+        return;
     }
-    else
+    if(!memcmp(theLayer->reproj_poly_box, bbox, 4 * sizeof(GLfloat)))
+        return;
+
+    /*Used also if it is not accurate enough, until the layer is loaded again for the view*/
+    layer_box(theLayer, bbox, box);
+    reproj_poly_build(theLayer->reproj_poly, box, theLayer->utm_zone, curr_utm, theLayer->hemisphere, curr_hemi, 0);
+    memcpy(theLayer->reproj_poly_box, bbox, 4 * sizeof(GLfloat));
+}
+
+/*sqlite3_step, with the time added to the layer's stats when we are measuring*/
+static int timed_step(LAYER_RUNTIME *theLayer, sqlite3_stmt *prepared_statement)
+{
+    int rc;
+    uint64_t t;
+    if(!stats_enabled)
+        return sqlite3_step(prepared_statement);
+
+    t = stats_now();
+    rc = sqlite3_step(prepared_statement);
+    theLayer->fetch_stats.sql_ticks += stats_now() - t;
+    return rc;
+}
+
+/**
+ * Fetch and decode all features of a layer inside theLayer->BBOX.
+ * If get_data has planned an incremental load, the strips in fetch_boxes
+ * are fetched instead, and features already in the buffers are skipped.
+ * The prepared statement is given explicitly since the fetch workers
+ * have their own copies of the statements on their own connections.
+ */
+void *twkb_fromSQLiteBBOX_stmt(LAYER_RUNTIME *theLayer, sqlite3_stmt *prepared_statement)
+{
+    int i;
+    GLfloat *view_box = theLayer->BBOX;
+    GLfloat cull_box[4];
+    GLfloat margin;
+    GLfloat *cull = NULL;
+
+    /*The buffers will change, so they have to be uploaded to the gpu again*/
+    theLayer->data_version++;
+
+    /*The tolerance is rounded down to a power of 2, so the cached features can be used for nearby zoom levels too*/
+    theLayer->decimate_tol = 0;
+    if(decimate_pixels > 0 && theLayer->loaded_mpp > 0 && theLayer->geometryType != RASTER && !(theLayer->type & 224))
+        theLayer->decimate_tol = exp2f(floorf(log2f(decimate_pixels * theLayer->loaded_mpp)));
+
+    /*A grid to interpolate reprojected coordinates from, over the view and a view on every side of it.
+     * It is only used if the error is a fraction of a pixel*/
+    theLayer->reproj_grid.valid = 0;
+    if(((theLayer->utm_zone != curr_utm) || (theLayer->hemisphere != curr_hemi)) && theLayer->loaded_mpp > 0 && !theLayer->gpu_reproject)
     {
+        GLfloat grid_box[4];
+        layer_box(theLayer, view_box, grid_box);
+        margin = grid_box[2] - grid_box[0];
+        grid_box[0] -= margin;
+        grid_box[2] += margin;
+        margin = grid_box[3] - grid_box[1];
+        grid_box[1] -= margin;
+        grid_box[3] += margin;
+        if(reproj_grid_build(&(theLayer->reproj_grid), grid_box, theLayer->utm_zone, curr_utm, theLayer->hemisphere, curr_hemi,
+                             REPROJ_GRID_MAX_ERROR_PIXELS * theLayer->loaded_mpp))
+        {
+            /*Try again with a grid over just the view, the error grows with the square of the cell size*/
+            layer_box(theLayer, view_box, grid_box);
+            if(reproj_grid_build(&(theLayer->reproj_grid), grid_box, theLayer->utm_zone, curr_utm, theLayer->hemisphere, curr_hemi,
+                                 REPROJ_GRID_MAX_ERROR_PIXELS * theLayer->loaded_mpp))
+                log_this(10, "The reprojection grid is not accurate enough for layer %s\n", theLayer->name);
+        }
+    }
 
+    /*Features are culled against the whole view, also when only strips of it are fetched.
+     * The margin keeps symbols and wide lines just outside the view*/
+    if(feature_culling && theLayer->geometryType != RASTER && theLayer->loaded_mpp > 0)
+    {
+        margin = CULL_MARGIN_PIXELS * theLayer->loaded_mpp;
+        layer_box(theLayer, view_box, cull_box);
+        cull_box[0] -= margin;
+        cull_box[1] -= margin;
+        cull_box[2] += margin;
+        cull_box[3] += margin;
+        cull = cull_box;
+    }
 
-        sqlite3_bind_double(prepared_statement, 1,(float) ext[2]); //maxX
-        sqlite3_bind_double(prepared_statement, 2,(float) ext[0]); //minX
-        sqlite3_bind_double(prepared_statement, 3,(float) ext[3]); //maxY
-        sqlite3_bind_double(prepared_statement, 4,(float) ext[1]); //minY
-        log_this(10, "1 = %f, 2 = %f, 3 = %f, 4 = %f\n", ext[2],ext[0],ext[3],ext[1]);
+    if(!theLayer->n_fetch_boxes)
+        return fetch_bbox(theLayer, prepared_statement, cull);
 
+    for (i=0; i<theLayer->n_fetch_boxes; i++)
+    {
+        theLayer->BBOX = theLayer->fetch_boxes[i];
+        fetch_bbox(theLayer, prepared_statement, cull);
     }
+    theLayer->BBOX = view_box;
+    return NULL;
+}
+
+static void *fetch_bbox(LAYER_RUNTIME *theLayer, sqlite3_stmt *prepared_statement, GLfloat *cull_box)
+{
+    log_this(10, "Entering twkb_fromSQLiteBBOX, prepared = %p\n", prepared_statement);
+    /*twkb structures*/
+    TWKB_HEADER_INFO thi;
+    TWKB_PARSE_STATE ts;
+    uint8_t *res;
+    size_t res_len;
+    GLfloat *ext;
+    GLfloat box[4];
+    BBOX bbox;
+    int culled;
+    GEOM_CACHE_MARK mark;
+    sqlite3 *db = sqlite3_db_handle(prepared_statement);
+    ts.thi = &thi;
+    ts.thi->bbox=&bbox;
+
+    ts.theLayer = theLayer;
 
+    GLfloat rotation;
+    GLint anchor;
+    int size;
+//log_this(10, "sqlite_error? %d\n",sqlite3_config(SQLITE_CONFIG_SERIALIZED ));
 
 
-    err = sqlite3_errcode(projectDB);
+    ext = theLayer->BBOX;
+    //rc = sqlite3_exec(db, sql, callback, 0, &err_msg);
+
+
+    int err = sqlite3_errcode(db);
+    if(err)
+        log_this(1,"sqlite problem, %d\n",err);
+
+    layer_box(theLayer, ext, box);
+    sqlite3_bind_double(prepared_statement, 1,(float) box[2]); //maxX
+    sqlite3_bind_double(prepared_statement, 2,(float) box[0]); //minX
+    sqlite3_bind_double(prepared_statement, 3,(float) box[3]); //maxY
+    sqlite3_bind_double(prepared_statement, 4,(float) box[1]); //minY
+    log_this(10, "1 = %f, 2 = %f, 3 = %f, 4 = %f\n", box[2],box[0],box[3],box[1]);
+
+
+
+    err = sqlite3_errcode(db);
     if(err)
         log_this(1,"sqlite problem 2, %d\n",err);
 
@@ -198,7 +393,6 @@ void *twkb_fromSQLiteBBOX(void *theL)
     {
          ts.unicode_txt = NULL ;
          unicode_txt = init_wc_txt(64);
-         reset_textblock(theLayer->text->tb);
     }
     /*
     if(theLayer->points)
@@ -209,8 +403,13 @@ void *twkb_fromSQLiteBBOX(void *theL)
         theLayer->polygons->style_id->list_type = theLayer->style_key_type;
     */
 
-    while (sqlite3_step(prepared_statement)==SQLITE_ROW)
+    while (timed_step(theLayer, prepared_statement)==SQLITE_ROW)
     {
+        ts.id = sqlite3_column_int(prepared_statement, 3);
+
+        /*When loading incremental, features overlapping the already loaded area will show up again*/
+        if(incremental_loading && has_loaded_id(theLayer, ts.id))
+            continue;
 
         if(theLayer->geometryType == RASTER)
         {
@@ -219,9 +418,11 @@ void *twkb_fromSQLiteBBOX(void *theL)
             {
                 fprintf(stderr, "Failed to select data\n");
 
-                sqlite3_close(projectDB);
+                sqlite3_reset(prepared_statement);
                 return NULL;
             }
+            /*The tiles have to outlive the row, so they are copied to the layers raster buffer.
+             * The buffer keeps its allocation between frames and works as an arena for the tiles*/
             addbatch2uint8_list(theLayer->rast->data,res_len, res);
             add2gluint_list(theLayer->rast->raster_start_indexes, res_len);
 
@@ -233,7 +434,6 @@ void *twkb_fromSQLiteBBOX(void *theL)
 
 
         }
-        ts.id = sqlite3_column_int(prepared_statement, 3);
         // printf("id fra db = %ld\n",ts.id);
         ts.styleid_type = theLayer->style_key_type;
         if(ts.styleid_type == INT_TYPE)
@@ -253,48 +453,44 @@ void *twkb_fromSQLiteBBOX(void *theL)
                 return NULL;
             }
         }
-        if(get_blob(prepared_statement,0, &res, &res_len))
-        {
 
-            log_this(1,"Failed to select data\n");
+        uint64_t t_decode = stats_enabled ? stats_now() : 0;
 
-            sqlite3_close(projectDB);
-            return NULL;
-        }
-        tb.start_pos = tb.read_pos = res;
-        tb.end_pos=res+res_len;
-        ts.tb=&tb;
-        ts.utm_zone = theLayer->utm_zone;
-        ts.hemisphere = theLayer->hemisphere;
-        while (ts.tb->read_pos<ts.tb->end_pos)
+        /*Features we have decoded before is taken from the cache, the text is still read below*/
+        culled = 0;
+        if(!theLayer->use_geom_cache || !geom_cache_get(theLayer, ts.id))
         {
-            decode_twkb(&ts);//, theLayer->res_buf);
-        }
-        //printf("start free %p, n_pa = %d\n",tb.start_pos, res_buf->used_n_pa);
-        free(tb.start_pos);
-        if(theLayer->type & 4)
-        {
-            if(get_blob(prepared_statement,1, &res, &res_len))
+            if(theLayer->use_geom_cache)
+                geom_cache_mark(theLayer, &mark);
+
+            if(decode_row(theLayer, prepared_statement, &ts, cull_box, &culled))
             {
-                fprintf(stderr, "Failed to select data\n");
+                log_this(1,"Failed to select data\n");
 
-                sqlite3_close(projectDB);
+                sqlite3_reset(prepared_statement);
                 return NULL;
             }
-            tb.start_pos = tb.read_pos = res;
-            tb.end_pos=res+res_len;
-            ts.tb=&tb;
-
-            while (ts.tb->read_pos<ts.tb->end_pos)
-            {
-                decode_element_array(&ts);
-            }
-            //printf("start free %p, n_pa = %d\n",tb.start_pos, res_buf->used_n_pa);
-            free(tb.start_pos);
-
-
 
+            /*The cache only holds features decoded in full*/
+            if(theLayer->use_geom_cache && !culled)
+                geom_cache_put(theLayer, ts.id, &mark);
+        }
+        if(stats_enabled)
+        {
+            theLayer->fetch_stats.decode_ticks += stats_now() - t_decode;
+            theLayer->fetch_stats.n_features++;
+            if(culled)
+                theLayer->fetch_stats.n_culled++;
         }
+
+        /*Nothing is added for a culled feature, and it has to be fetched again when it comes into view*/
+        if(culled == TWKB_CULLED)
+            continue;
+        /*A dropped polygon is too small to show at this zoom, so there is no need to fetch it again until the zoom changes*/
+        if(incremental_loading)
+            add_loaded_id(theLayer, ts.id);
+        if(culled == TWKB_DROPPED)
+            continue;
         if(theLayer->type & 32)
         {
             const char *txt = (const char*) sqlite3_column_text(prepared_statement, 5);
@@ -61,8 +61,22 @@ void text_destroy_buffer(TEXTSTRUCT *text_buf);
 /* Functions for decoding twkb*/
 int read_header (TWKB_PARSE_STATE *ts);
 int decode_twkb_start(uint8_t *buf, size_t buf_len);
-int decode_twkb(TWKB_PARSE_STATE *old_ts);
-int* decode_element_array(TWKB_PARSE_STATE *old_ts);
+int decode_twkb(TWKB_PARSE_STATE *ts);
+int* decode_element_array(TWKB_PARSE_STATE *ts);
+
+/*What decode_twkb did with a geometry when culling*/
+#define TWKB_CULLED 1 // skipped, nothing added to the buffers
+#define TWKB_COLLAPSED 2 // smaller than a pixel, added as a simplified geometry
+#define TWKB_DROPPED 3 // polygon smaller than a pixel, nothing added but it counts as loaded at this zoom
+
+/*Max error of interpolated reprojection, in pixels*/
+#define REPROJ_GRID_MAX_ERROR_PIXELS 0.1
+
+/*Max error of the polynomial the shaders reproject with, in pixels*/
+#define REPROJ_POLY_MAX_ERROR_PIXELS 0.1
+
+/*Features this many pixels outside the view are still decoded, for symbols and wide lines reaching into the view*/
+#define CULL_MARGIN_PIXELS 32
 
 /*a type holding pointers to our parsing functions*/
 typedef int (*parseFunctions_p)(TWKB_PARSE_STATE*);
@@ -73,6 +87,7 @@ uint64_t buffer_read_uvarint(TWKB_BUF *tb);
 int64_t buffer_read_svarint(TWKB_BUF *tb);
 uint8_t buffer_read_byte(TWKB_BUF *tb);
 void buffer_jump_varint(TWKB_BUF *tb,int n);
+void buffer_read_svarint_batch(TWKB_BUF *tb, int64_t *coords, const double *inv_factors, uint32_t ndims, uint32_t npoints, GLfloat *out);
 
 
 
@@ -25,13 +25,17 @@
 #include "theclient.h"
 #include "buffer_handling.h"
 #include "twkb.h"
+#include "stats.h"
 
-static void init_decode(TWKB_PARSE_STATE *ts,TWKB_PARSE_STATE *old_ts);
+static void reset_header(TWKB_HEADER_INFO *thi);
+static int cull_geometry(TWKB_PARSE_STATE *ts, GLfloat *cull_box);
 static int decode_point(TWKB_PARSE_STATE *ts);
 static int decode_line(TWKB_PARSE_STATE *ts);
 static int decode_polygon(TWKB_PARSE_STATE *ts);
 static int decode_multi(TWKB_PARSE_STATE *ts);
 static int read_pointarray(TWKB_PARSE_STATE *ts, uint32_t npoints);
+/*Number of points decoded at a time when building wide lines*/
+#define POINT_CHUNK 256
 int* decode_id_list(TWKB_PARSE_STATE *ts, int ngeoms);
 
 static inline long int getReadPos(TWKB_BUF *tb)
@@ -40,31 +44,57 @@ static inline long int getReadPos(TWKB_BUF *tb)
 }
 
 
+/**
+ * Decodes one geometry straight into the layer's buffers.
+ * The parse state is shared with the caller and with the members of a
+ * collection, only the header info is reset for each geometry. The style
+ * is looked up once per row by the caller, in ts->style.
+ *
+ * If ts->cull_box is set the geometry can be culled from its bbox, see
+ * cull_geometry. Then TWKB_CULLED, TWKB_COLLAPSED or TWKB_DROPPED is returned.
+ * The cull box is only used for the first geometry, not for the members.
+ */
 int
-decode_twkb(TWKB_PARSE_STATE *old_ts)
+decode_twkb(TWKB_PARSE_STATE *ts)
 {
-    TWKB_PARSE_STATE ts;
-    init_decode(&ts, old_ts);
-    read_header (&ts);
-    switch (ts.thi->type)
+    int res;
+    GLfloat *cull_box = ts->cull_box;
+
+    ts->cull_box = NULL;
+    reset_header(ts->thi);
+    read_header (ts);
+
+    if(cull_box && ts->thi->has_bbox && ts->thi->has_size)
+    {
+        res = cull_geometry(ts, cull_box);
+        if(res)
+            return res;
+    }
+
+    /*The size tells how many bytes the geometry has. Every coordinate takes at least one byte
+    so that is enough room for all coordinates. Multi geometries reserves room for their members*/
+    if(ts->thi->has_size)
+        pa_reserve(ts->theLayer, 1, ts->thi->next_offset - getReadPos(ts->tb));
+
+    switch (ts->thi->type)
     {
     case POINTTYPE:
-        return decode_point(&ts);//, res_buf);
+        return decode_point(ts);//, res_buf);
         break;
     case LINETYPE:
-        return decode_line(&ts);//, res_buf);
+        return decode_line(ts);//, res_buf);
         break;
     case POLYGONTYPE:
-        return decode_polygon(&ts);//, res_buf);
+        return decode_polygon(ts);//, res_buf);
         break;
     case MULTIPOINTTYPE:
     case MULTILINETYPE:
     case MULTIPOLYGONTYPE:
     case COLLECTIONTYPE:
-        return decode_multi(&ts);//, res_buf);
+        return decode_multi(ts);//, res_buf);
         break;
     default:
-        fprintf(stderr,"Error: Unknown type number %d\n",ts.thi->type);
+        fprintf(stderr,"Error: Unknown type number %d\n",ts->thi->type);
         exit(EXIT_FAILURE);
     }
     return 0;
@@ -72,42 +102,115 @@ decode_twkb(TWKB_PARSE_STATE *old_ts)
 
 
 static void
-init_decode(TWKB_PARSE_STATE *ts,TWKB_PARSE_STATE *old_ts )
+reset_header(TWKB_HEADER_INFO *thi)
 {
     int i;
 
-    ts->id = old_ts->id;
-    ts->tb = old_ts->tb;
-    ts->styleid_type = old_ts->styleid_type;
-    if(ts->styleid_type == INT_TYPE)
-        ts->styleID.int_type = old_ts->styleID.int_type;
-    else if(ts->styleid_type == STRING_TYPE)
-    {
-        strcpy(ts->styleID.string_type,old_ts->styleID.string_type);
-    }
-    ts->unicode_txt = old_ts->unicode_txt;
-    ts->txt = old_ts->txt;
-    ts->theLayer = old_ts->theLayer;
-    ts->thi = old_ts->thi;
-    ts->thi->has_bbox=0;
-    ts->thi->has_size=0;
-    ts->thi->has_idlist=0;
-    ts->thi->has_z=0;
-    ts->thi->has_m=0;
-    ts->thi->is_empty=0;
-    ts->thi->type=0;
+    thi->has_bbox=0;
+    thi->has_size=0;
+    thi->has_idlist=0;
+    thi->has_z=0;
+    thi->has_m=0;
+    thi->is_empty=0;
+    thi->type=0;
 
     for (i=0; i<TWKB_IN_MAXCOORDS; i++)
     {
-        ts->thi->factors[i]=0;
-        ts->thi->coords[i]=0;
+        thi->factors[i]=0;
+        thi->coords[i]=0;
     }
-    ts->thi->ndims=0;
+    thi->ndims=0;
 
     return;
 }
 
 
+static uint8_t* put_svarint(uint8_t *p, int64_t val)
+{
+    uint64_t uval = ((uint64_t) val << 1) ^ (uint64_t) (val >> 63);
+    while(uval >= 0x80)
+    {
+        *p++ = (uint8_t) (uval | 0x80);
+        uval >>= 7;
+    }
+    *p++ = (uint8_t) uval;
+    return p;
+}
+
+/*A line smaller than a pixel is decoded as a line between the corners of its bbox*/
+static void collapse_line(TWKB_PARSE_STATE *ts)
+{
+    TWKB_HEADER_INFO *thi = ts->thi;
+    TWKB_BUF tb, *org_tb = ts->tb;
+    uint8_t buf[2 * TWKB_IN_MAXCOORDS * 10];
+    uint8_t *p = buf;
+    uint32_t j, ndims = ts->theLayer->n_dims;
+    int64_t min[TWKB_IN_MAXCOORDS] = {0};
+
+    for (j=0; j<ndims && j<2; j++)
+    {
+        min[j] = llround(thi->bbox->bbox_min[j] * thi->factors[j]);
+        p = put_svarint(p, min[j]);
+    }
+    for (; j<ndims; j++)
+        p = put_svarint(p, 0);
+    for (j=0; j<ndims; j++)
+        p = put_svarint(p, j<2 ? llround(thi->bbox->bbox_max[j] * thi->factors[j]) - min[j] : 0);
+
+    tb.start_pos = tb.read_pos = buf;
+    tb.end_pos = p;
+    tb.BufOffsetFromBof = 0;
+    ts->tb = &tb;
+    read_pointarray(ts, 2);
+    ts->tb = org_tb;
+}
+
+/**
+ * Compares the bbox of a geometry with the view before decoding.
+ * A geometry outside cull_box is jumped over, using the size from the header.
+ * A line smaller than a pixel is collapsed to one segment and a polygon smaller
+ * than a pixel is dropped. Points and collections are always decoded when in view.
+ * Only a geometry that is alone in its row is culled, so the rest of the row,
+ * like the element array of a polygon, can be skipped as a whole.
+ */
+static int cull_geometry(TWKB_PARSE_STATE *ts, GLfloat *cull_box)
+{
+    TWKB_HEADER_INFO *thi = ts->thi;
+    TWKB_BUF *tb = ts->tb;
+    GLfloat *min = thi->bbox->bbox_min;
+    GLfloat *max = thi->bbox->bbox_max;
+    GLfloat pixel = ts->theLayer->loaded_mpp;
+    uint8_t *next = tb->start_pos + (thi->next_offset - tb->BufOffsetFromBof);
+
+    if(next != tb->end_pos)
+        return 0;
+
+    if(max[0] < cull_box[0] || min[0] > cull_box[2] || max[1] < cull_box[1] || min[1] > cull_box[3])
+    {
+        tb->read_pos = next;
+        return TWKB_CULLED;
+    }
+
+    if(max[0] - min[0] >= pixel || max[1] - min[1] >= pixel)
+        return 0;
+
+    switch (thi->type)
+    {
+    case LINETYPE:
+    case MULTILINETYPE:
+        collapse_line(ts);
+        tb->read_pos = next;
+        return TWKB_COLLAPSED;
+    case POLYGONTYPE:
+    case MULTIPOLYGONTYPE:
+        tb->read_pos = next;
+        return TWKB_DROPPED;
+    default:
+        return 0;
+    }
+}
+
+
 int
 read_header (TWKB_PARSE_STATE *ts)
 {
@@ -204,7 +307,7 @@ decode_polygon(TWKB_PARSE_STATE *ts)
     int npoints, i, nrings;
 
     nrings = (int) buffer_read_uvarint(ts->tb);
-
+    pa_reserve(ts->theLayer, nrings, 0);
 
     for (i=0; i<nrings; i++)
     {
@@ -230,6 +333,7 @@ decode_multi(TWKB_PARSE_STATE *ts)
 
     parseFunctions_p pf;
     ngeoms = (int) buffer_read_uvarint(ts->tb);
+    pa_reserve(ts->theLayer, ngeoms, 0);
     if(ts->thi->has_idlist)
         idlist = decode_id_list(ts, ngeoms);
     else
@@ -262,28 +366,81 @@ decode_multi(TWKB_PARSE_STATE *ts)
     return 0;
 }
 
+/*Point arrays shorter than this, like the ones of point layers, are too short to be timed one by one since the timer
+would cost as much as the reprojection. Every REPROJ_SAMPLE:th of them is timed instead and counted REPROJ_SAMPLE times*/
+#define REPROJ_TIMED_POINTS 32
+#define REPROJ_SAMPLE 32
+
+/*reproject, and take the time if we are measuring*/
+static inline void timed_reproject(GLfloat *coords, uint32_t npoints, uint32_t stride, LAYER_RUNTIME *l, uint8_t utm_in, uint8_t hemi_in, uint64_t *ticks)
+{
+    uint64_t t;
+    int sample = npoints < REPROJ_TIMED_POINTS ? REPROJ_SAMPLE : 1;
+    if(!stats_enabled || (sample > 1 && l->fetch_stats.n_short_reprojections++ % REPROJ_SAMPLE))
+    {
+        reproject_batch(coords, npoints, stride, &(l->reproj_grid), utm_in, curr_utm, hemi_in, curr_hemi);
+        return;
+    }
+    t = stats_now();
+    reproject_batch(coords, npoints, stride, &(l->reproj_grid), utm_in, curr_utm, hemi_in, curr_hemi);
+    *ticks += (stats_now() - t) * sample;
+}
+
+/**
+ * Drops vertices closer than tol to the last kept vertex, in both x and y.
+ * The first and the last vertex is always kept, so rings stay closed.
+ * Returns the number of vertices left
+ */
+static uint32_t decimate(GLfloat *coords, uint32_t npoints, uint32_t ndims, GLfloat tol)
+{
+    uint32_t i, j, n = 1;
+    GLfloat *last = coords;
+    GLfloat *c;
+
+    for (i=1; i<npoints; i++)
+    {
+        c = coords + i * ndims;
+        if(i < npoints - 1 && fabsf(c[0] - last[0]) < tol && fabsf(c[1] - last[1]) < tol)
+            continue;
+
+        last = coords + n * ndims;
+        for (j=0; j<ndims; j++)
+            last[j] = c[j];
+        n++;
+    }
+    return n;
+}
 
 static int
 read_pointarray(TWKB_PARSE_STATE *ts, uint32_t npoints)
 {
 //TODO, handle more than 2 coordinates. Now they are just read into the buffer which will give failur in opengl since it doesn't get that info
-    uint32_t i, j;
+    uint32_t i, j, k, m, n_chunk, n_kept = 0;
 
-    int64_t val;
     GLFLOAT_LIST *vertex_list, *wide_line;
-    float new_val;
+    double inv_factors[TWKB_IN_MAXCOORDS];
+    GLfloat chunk[POINT_CHUNK * TWKB_IN_MAXCOORDS];
+    GLfloat *coords;
     GLfloat start_x, start_y;
     int c=0;
     int reprpject = 0;
     uint8_t utm_in, hemi_in;
     uint8_t close_ring = 0;
+    uint64_t reproject_ticks = 0;
     LAYER_RUNTIME *theLayer = ts->theLayer;
     unsigned int type = theLayer->type;
+    /*Polygons with triangles refers to every vertex, so they are never decimated*/
+    GLfloat tol = (type & 4) ? 0 : theLayer->decimate_tol;
+    GLfloat last_x = 0, last_y = 0;
+    uint64_t n_decimated = 0;
 
     //TODO: This will be overwritten for each geometry. This should be per geometry or a better way to register per data set.
 //   theLayer->n_dims = ndims;
     uint32_t ndims = theLayer->n_dims;
-    if((ts->theLayer->utm_zone != curr_utm) || (ts->theLayer->hemisphere != curr_hemi))
+    for( j = 0; j < ndims; j++ )
+        inv_factors[j] = 1.0 / ts->thi->factors[j];
+
+    if(((ts->theLayer->utm_zone != curr_utm) || (ts->theLayer->hemisphere != curr_hemi)) && !ts->theLayer->gpu_reproject)
     {
         reprpject = 1;
         utm_in = ts->theLayer->utm_zone;
@@ -306,46 +463,62 @@ read_pointarray(TWKB_PARSE_STATE *ts, uint32_t npoints)
 
         wide_line = get_wide_line_list(theLayer, ts);
 
-        for( i = 0; i < npoints; i++ )
+        for( i = 0; i < npoints; i += n_chunk )
         {
-
-            for( j = 0; j < ndims; j++ )
+            /*Decode the coordinates a chunk at a time, drop vertices closer than tol to the last kept one,
+            but keep the first and the last, and reproject what is left of the chunk in one go*/
+            n_chunk = npoints - i < POINT_CHUNK ? npoints - i : POINT_CHUNK;
+            buffer_read_svarint_batch(ts->tb, ts->thi->coords, inv_factors, ndims, n_chunk, chunk);
+            m = 0;
+            for( k = 0; k < n_chunk; k++ )
             {
-                val = buffer_read_svarint(ts->tb);
-                ts->thi->coords[j] += val;
-                new_val = (float) (ts->thi->coords[j] / ts->thi->factors[j]);
-                p_akt->coord[j] = new_val;
+                if(tol > 0 && i + k > 0 && i + k < npoints - 1 && fabsf(chunk[k * ndims] - last_x) < tol && fabsf(chunk[k * ndims + 1] - last_y) < tol)
+                {
+                    n_decimated++;
+                    continue;
+                }
+                last_x = chunk[k * ndims];
+                last_y = chunk[k * ndims + 1];
+                for( j = 0; j < ndims; j++ )
+                    chunk[m * ndims + j] = chunk[k * ndims + j];
+                m++;
             }
             if(reprpject)
-                reproject(p_akt->coord,utm_in,curr_utm,hemi_in,  curr_hemi);
-
-            if(type & 4)
-                addbatch2glfloat_list(vertex_list, ndims, p_akt->coord);
+                timed_reproject(chunk, m, ndims, theLayer, utm_in, hemi_in, &reproject_ticks);
 
-            if(i==1)
+            for( k = 0; k < m; k++ )
             {
-                if(close_ring)
-                {
-                    start_x = p->coord[0];
-                    start_y = p->coord[1];
-                }
+                for( j = 0; j < ndims; j++ )
+                    p_akt->coord[j] = chunk[k * ndims + j];
 
-                calc_start(p, wide_line, &c, &last_normal);
-            }
+                if(type & 4)
+                    addbatch2glfloat_list(vertex_list, ndims, p_akt->coord);
 
+                if(n_kept==1)
+                {
+                    if(close_ring)
+                    {
+                        start_x = p->coord[0];
+                        start_y = p->coord[1];
+                    }
 
-            if(i>1)
-            {
-                calc_join(p_akt, wide_line, &c,&last_normal);
-            }
+                    calc_start(p, wide_line, &c, &last_normal);
+                }
 
-            if(i==npoints-1 && !(close_ring))
-                calc_end(p_akt->next, wide_line, &c,&last_normal);
 
+                if(n_kept>1)
+                {
+                    calc_join(p_akt, wide_line, &c,&last_normal);
+                }
+
+                if(i + n_chunk == npoints && k == m - 1 && !(close_ring))
+                    calc_end(p_akt->next, wide_line, &c,&last_normal);
 
 
-            p_akt = p_akt->next; //take a step in the ring
 
+                p_akt = p_akt->next; //take a step in the ring
+                n_kept++;
+            }
         }
         if(close_ring)
         {
@@ -359,25 +532,21 @@ read_pointarray(TWKB_PARSE_STATE *ts, uint32_t npoints)
     }
     else
     {
-        GLfloat coords[4];
-        for( i = 0; i < npoints; i++ )
+        /*Decode straight into the vertex list and reproject in place*/
+        coords = reserve_glfloat_list(vertex_list, npoints * ndims);
+        buffer_read_svarint_batch(ts->tb, ts->thi->coords, inv_factors, ndims, npoints, coords);
+        if(tol > 0 && npoints > 2)
         {
-            for( j = 0; j < ndims; j++ )
-            {
-                val = buffer_read_svarint(ts->tb);
-                ts->thi->coords[j] += val;
-                new_val = (GLfloat) (ts->thi->coords[j] / ts->thi->factors[j]);
-
-                coords[j] = new_val;
-            }
-
-            if(reprpject)
-                reproject(coords,utm_in,curr_utm,hemi_in,  curr_hemi);
-            addbatch2glfloat_list(vertex_list, ndims, coords);
+            n_kept = decimate(coords, npoints, ndims, tol);
+            vertex_list->used -= (npoints - n_kept) * ndims;
+            n_decimated = npoints - n_kept;
+            npoints = n_kept;
         }
-
-
+        if(reprpject)
+            timed_reproject(coords, npoints, ndims, theLayer, utm_in, hemi_in, &reproject_ticks);
     }
+    theLayer->fetch_stats.reproject_ticks += reproject_ticks;
+    theLayer->fetch_stats.n_decimated += n_decimated;
     pa_end(theLayer, ts->id);
     return 0;
 }
@@ -404,41 +573,38 @@ type for this. It have to get a special decoding since the result is to be loade
 We can also skip reading the header, since we we know wat it shall contain.
 If that is not right we will find errors when decoding, hopefully catching before crashing*/
 
-int* decode_element_array(TWKB_PARSE_STATE *old_ts)
+int* decode_element_array(TWKB_PARSE_STATE *ts)
 {
-    TWKB_PARSE_STATE ts;
-    init_decode(&ts, old_ts);
-
     uint32_t npoints;
 
     uint32_t i, j;
-    int64_t val;
+    int64_t *coords = ts->thi->coords;
+    GLuint *val_list;
 
-    GLushort val_list[3];
+    reset_header(ts->thi);
 //jump over header
-    buffer_read_byte(ts.tb);
-    buffer_read_byte(ts.tb);
+    buffer_read_byte(ts->tb);
+    buffer_read_byte(ts->tb);
 //jump over2nd header byte since more than 2 dims
-    buffer_read_byte(ts.tb);
+    buffer_read_byte(ts->tb);
+
+    LAYER_RUNTIME *theLayer = ts->theLayer;
 
-    LAYER_RUNTIME *theLayer = old_ts->theLayer;
+    GLUINT_LIST *element_list = theLayer->polygons->element_array;
 
-    GLUSHORT_LIST *element_list = theLayer->polygons->element_array;
 
+    npoints = (uint32_t) buffer_read_uvarint(ts->tb);
+    add2pointer_list(theLayer->polygons->style_id, ts->style);
 
-    npoints = (uint32_t) buffer_read_uvarint(ts.tb);
-    // add2union_list(theLayer->polygons->style_id, &(old_ts->styleID));
-    struct STYLES *s = get_style(theLayer->styles, &(old_ts->styleID), old_ts->styleid_type);
-    add2pointer_list(theLayer->polygons->style_id, s);
+    /*All indexes are written in one go into reserved space*/
+    val_list = reserve_gluint_list(element_list, 3 * npoints);
     for( i = 0; i < npoints; i++ )
     {
         for( j = 0; j < 3; j++ )
         {
-            val = buffer_read_svarint(ts.tb);
-            ts.thi->coords[j] += val;
-            val_list[j] = (GLushort) ts.thi->coords[j];
+            coords[j] += buffer_read_svarint(ts->tb);
+            *val_list++ = (GLuint) coords[j];
         }
-        addbatch2glushort_list(element_list,3, val_list);
     }
     add2gluint_list(theLayer->polygons->element_start_indexes,element_list->used);
 
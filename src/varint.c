@@ -23,6 +23,19 @@
 
 #include "theclient.h"
 #include "twkb.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define VARINT_X86 1
+#elif defined(__GNUC__) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#include <arm_neon.h>
+#define VARINT_NEON 1
+#endif
+
+/*The batch decoder loads varints as little endian 64 bit words*/
+#if (defined(VARINT_X86) || defined(VARINT_NEON)) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define VARINT_BATCH 1
+#endif
 /**
 Reads an unsigned varInt value
 */
@@ -131,6 +144,141 @@ buffer_jump_varint(TWKB_BUF *tb,int n)
 
 
 
+#ifdef VARINT_BATCH
+/********************************************************************
+ * Batch decoding of varints
+ *
+ * A vector compare of a block of bytes gives a mask with one bit for
+ * every byte that ends a varint. All varints that end in the block is
+ * then read from that mask without looking at the bytes one by one.
+ * Blocks are 32 bytes with AVX2 and 16 bytes with SSE2 or NEON, the
+ * AVX2 version is choosen at runtime if the cpu has it.
+ *********************************************************************/
+
+typedef uint32_t (*varint_mask_func)(const uint8_t *p);
+
+#ifdef VARINT_X86
+__attribute__((target("sse2")))
+static uint32_t varint_end_mask_sse2(const uint8_t *p)
+{
+    return ~(uint32_t) _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) p)) & 0xffff;
+}
+
+__attribute__((target("avx2")))
+static uint32_t varint_end_mask_avx2(const uint8_t *p)
+{
+    return ~(uint32_t) _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*) p));
+}
+#else
+static uint32_t varint_end_mask_neon(const uint8_t *p)
+{
+    static const uint8_t bits[16] = {1,2,4,8,16,32,64,128,1,2,4,8,16,32,64,128};
+    uint8x16_t ends = vandq_u8(vcltq_u8(vld1q_u8(p), vdupq_n_u8(0x80)), vld1q_u8(bits));
+    uint8x8_t sum = vpadd_u8(vget_low_u8(ends), vget_high_u8(ends));
+    sum = vpadd_u8(sum, sum);
+    sum = vpadd_u8(sum, sum);
+    return vget_lane_u8(sum, 0) | ((uint32_t) vget_lane_u8(sum, 1) << 8);
+}
+#endif
+
+static varint_mask_func varint_end_mask = NULL;
+static int varint_block_size = 0;
+/*The fetch workers and the prefetcher decode at the same time, so the setup is only done once*/
+static pthread_once_t varint_once = PTHREAD_ONCE_INIT;
+
+static void init_varint_batch()
+{
+#ifdef VARINT_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        varint_end_mask = varint_end_mask_avx2;
+        varint_block_size = 32;
+    }
+    else if(__builtin_cpu_supports("sse2"))
+    {
+        varint_end_mask = varint_end_mask_sse2;
+        varint_block_size = 16;
+    }
+#else
+    varint_end_mask = varint_end_mask_neon;
+    varint_block_size = 16;
+#endif
+}
+
+/**
+Takes the 7 bit groups of a varint of len bytes (max 8)
+loaded as a little endian word, and puts them together
+*/
+static inline uint64_t varint_compact(uint64_t word, int len)
+{
+    if(len < 8)
+        word &= (((uint64_t) 1) << (8 * len)) - 1;
+    word &= 0x7f7f7f7f7f7f7f7fULL;
+    word = (word & 0x007f007f007f007fULL) | ((word & 0x7f007f007f007f00ULL) >> 1);
+    word = (word & 0x00003fff00003fffULL) | ((word & 0x3fff00003fff0000ULL) >> 2);
+    word = (word & 0x000000000fffffffULL) | ((word & 0x0fffffff00000000ULL) >> 4);
+    return word;
+}
+#endif
+
+/**
+Reads npoints*ndims delta encoded signed varints.
+The deltas are added to coords, which holds the last position,
+and the result multiplied with inv_factors is written to out.
+*/
+void
+buffer_read_svarint_batch(TWKB_BUF *tb, int64_t *coords, const double *inv_factors, uint32_t ndims, uint32_t npoints, GLfloat *out)
+{
+    uint32_t n = npoints * ndims;
+    uint32_t i = 0, j = 0;
+
+#ifdef VARINT_BATCH
+    const uint8_t *p;
+    uint64_t word;
+    uint32_t mask;
+    int start, end;
 
+    pthread_once(&varint_once, init_varint_batch);
 
+    /*We need 8 bytes after the start of the last varint in the block to load it*/
+    while(varint_end_mask && i < n && tb->end_pos - tb->read_pos >= varint_block_size + 8)
+    {
+        p = tb->read_pos;
+        mask = varint_end_mask(p);
+        start = 0;
+        while(mask && i < n)
+        {
+            end = __builtin_ctz(mask);
+            if(end - start >= 8)
+                break;
+            memcpy(&word, p + start, sizeof(uint64_t));
+            coords[j] += unzigzag64(varint_compact(word, end - start + 1));
+            out[i++] = (GLfloat) (coords[j] * inv_factors[j]);
+            if(++j == ndims)
+                j = 0;
+            start = end + 1;
+            mask &= mask - 1;
+        }
+        tb->read_pos = (uint8_t*) p + start;
+
+        /*A varint longer than 8 bytes, or longer than the block, is read the slow way*/
+        if(start == 0 && i < n)
+        {
+            coords[j] += buffer_read_svarint(tb);
+            out[i++] = (GLfloat) (coords[j] * inv_factors[j]);
+            if(++j == ndims)
+                j = 0;
+        }
+    }
+#endif
+
+    for (; i < n; i++)
+    {
+        coords[j] += buffer_read_svarint(tb);
+        out[i] = (GLfloat) (coords[j] * inv_factors[j]);
+        if(++j == ndims)
+            j = 0;
+    }
+}
 